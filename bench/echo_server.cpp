@@ -0,0 +1,296 @@
+//
+//  echo_server.cpp
+//
+// Echo backend of the benchmark (see run.sh): writes back everything it
+// reads. Every thread runs its own event loop with its own listener
+// (SO_REUSEPORT), so the backend isn't the bottleneck of the proxy.
+//
+// Usage: echo_server [-p port] [-t threads] [-l event loop]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <new>              // std::nothrow
+#include "eventloop.h"
+#include "log.h"
+
+const int MAX_EVENTS = 256;             // Max number of events to handle per loop iteration
+const size_t BUF_SIZE = 64*1024;        // The size of the buffer per connection
+
+static unsigned short port = 19001;
+static const char* loop_name = nullptr;
+
+//
+// Event loop of the thread
+//
+class CEchoServer
+{
+public:
+    ~CEchoServer();
+    bool Init();
+    void Run();
+
+private:
+    // Data read but not written back yet
+    struct Conn
+    {
+        char* buf{nullptr};
+        size_t head{0};
+        size_t len{0};
+    };
+
+    bool Reserve(int fd);
+    void OnAccept();
+    void OnRead(int fd);
+    bool Flush(int fd);
+    void Close(int fd);
+
+    CEventLoop* loop{nullptr};
+    int listen_fd{-1};
+    Conn* conns{nullptr};
+    int conns_size{0};
+};
+
+CEchoServer::~CEchoServer()
+{
+    for(int fd = 0; fd < conns_size; fd++)
+        delete [] conns[fd].buf;
+    delete [] conns;
+    delete loop;
+}
+
+bool CEchoServer::Init()
+{
+    loop = CEventLoop::Create(loop_name);
+    if(loop == nullptr)
+        return false;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if(listen_fd < 0)
+    {
+        fprintf(stderr, "%s: socket error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(listen_fd, (const sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 4096) < 0)
+    {
+        fprintf(stderr, "%s: bind/listen port %hu error: %s\n", __func__, port, strerror(errno));
+        return false;
+    }
+    return Reserve(listen_fd) && loop->Add(listen_fd, EVENT_READ);
+}
+
+bool CEchoServer::Reserve(int fd)
+{
+    if(fd < conns_size)
+        return true;
+
+    int new_size = (conns_size > 0 ? conns_size : 1024);
+    while(new_size <= fd)
+        new_size *= 2;
+
+    Conn* new_conns = new (std::nothrow) Conn[new_size];
+    if(new_conns == nullptr)
+    {
+        fprintf(stderr, "%s: Out of memory: new_size=%d\n", __func__, new_size);
+        return false;
+    }
+    for(int i = 0; i < conns_size; i++)
+        new_conns[i] = conns[i];
+    delete [] conns;
+    conns = new_conns;
+    conns_size = new_size;
+    return true;
+}
+
+void CEchoServer::Run()
+{
+    CEventLoop::Event events[MAX_EVENTS];
+    while(true)
+    {
+        int n = loop->Wait(events, MAX_EVENTS, -1);
+        if(n < 0)
+            break;
+
+        for(int i = 0; i < n; i++)
+        {
+            int fd = events[i].fd;
+            if(fd == listen_fd)
+                OnAccept();
+            else if((events[i].events & EVENT_WRITE) && conns[fd].len > 0)
+                Flush(fd); // Note: Resumes reading once flushed
+            else if(events[i].events & EVENT_READ)
+                OnRead(fd);
+        }
+    }
+}
+
+void CEchoServer::OnAccept()
+{
+    // Note: The event loop might be edge-triggered, accept until EAGAIN
+    while(true)
+    {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+        if(fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "%s: accept error: %s\n", __func__, strerror(errno));
+            break;
+        }
+
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if(!Reserve(fd) || !loop->Add(fd, EVENT_READ))
+            close(fd);
+    }
+}
+
+void CEchoServer::OnRead(int fd)
+{
+    Conn& c = conns[fd];
+    if(c.buf == nullptr)
+    {
+        c.buf = new (std::nothrow) char[BUF_SIZE];
+        if(c.buf == nullptr)
+        {
+            Close(fd);
+            return;
+        }
+    }
+
+    // Read until EAGAIN, or until the peer doesn't take the data back
+    while(c.len == 0)
+    {
+        ssize_t n = read(fd, c.buf, BUF_SIZE);
+        if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        {
+            Close(fd);
+            return;
+        }
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+
+        c.head = 0;
+        c.len = n;
+        if(!Flush(fd))
+            return;
+    }
+}
+
+bool CEchoServer::Flush(int fd)
+{
+    Conn& c = conns[fd];
+    while(c.len > 0)
+    {
+        ssize_t n = write(fd, c.buf + c.head, c.len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN)
+            {
+                Close(fd);
+                return false;
+            }
+
+            // Stop reading until the data is written out
+            loop->Modify(fd, EVENT_WRITE);
+            return true;
+        }
+        c.head += n;
+        c.len -= n;
+    }
+
+    // Note: Modify re-arms the events, so the data received in the
+    // meanwhile is reported by the next wait
+    loop->Modify(fd, EVENT_READ);
+    return true;
+}
+
+void CEchoServer::Close(int fd)
+{
+    loop->Remove(fd);
+    close(fd);
+    delete [] conns[fd].buf;
+    conns[fd] = Conn();
+}
+
+static void* EchoThread(void* arg)
+{
+    CEchoServer* server = (CEchoServer*)arg;
+    server->Run();
+    return nullptr;
+}
+
+int main(int argc, char** argv)
+{
+    int threads = 1;
+    int opt = 0;
+    while((opt = getopt(argc, argv, "p:t:l:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'p': port = (unsigned short)atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'l': loop_name = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-t threads] [-l event loop]\n", argv[0]);
+            return 1;
+        }
+    }
+    threads = (threads > 0 ? threads : 1);
+
+    // Note: The log messages of the event loop go to stdout
+    CLog::level = LOG_LEVEL_ERROR;
+    signal(SIGPIPE, SIG_IGN);
+
+    rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    CEchoServer* servers = new CEchoServer[threads];
+    for(int i = 0; i < threads; i++)
+    {
+        if(!servers[i].Init())
+            return 1;
+    }
+
+    for(int i = 1; i < threads; i++)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, nullptr, &EchoThread, &servers[i]) != 0)
+        {
+            fprintf(stderr, "%s: pthread_create error\n", __func__);
+            return 1;
+        }
+    }
+    servers[0].Run();
+    return 0;
+}
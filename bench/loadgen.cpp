@@ -0,0 +1,614 @@
+//
+//  loadgen.cpp
+//
+// Load generator of the benchmark (see run.sh): runs one scenario over the
+// connections to the proxy in front of the echo backend, and prints the
+// results as one JSON object. The scenarios:
+//
+//   throughput - every connection streams the data (up to the window in
+//                flight) and counts the bytes echoed back
+//   latency    - every connection sends the request of the size, waits for
+//                the whole echo, and repeats (p50/p99/p999 of the round trip)
+//   cps        - every connection does connect/request/echo/close and is
+//                replaced by the new one (the connection rate)
+//   idle       - opens the connections (C10K), holds them idle for the
+//                duration, and checks they are all still proxied
+//
+// Usage: loadgen <scenario> [-h host] [-p port] [-c connections]
+//                [-d duration, s] [-s size] [-P proxy pid] [-l event loop]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <new>              // std::nothrow
+#include "eventloop.h"
+#include "log.h"
+
+const int MAX_EVENTS = 1024;            // Max number of events to handle per loop iteration
+const size_t WINDOW = 256*1024;         // Max bytes in flight per connection (throughput)
+const int MAX_CONNECTING = 256;         // Max connects in progress (idle)
+const uint64_t SETUP_TIMEOUT = 60000;   // Time to open the connections (idle), ms
+const uint64_t CHECK_TIMEOUT = 10000;   // Time to check the connections (idle), ms
+
+enum Scenario
+{
+    SCENARIO_THROUGHPUT = 0,
+    SCENARIO_LATENCY,
+    SCENARIO_CPS,
+    SCENARIO_IDLE
+};
+
+static const char* SCENARIO_NAMES[] = {"throughput", "latency", "cps", "idle"};
+
+static uint64_t NowUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Growing array of the latencies, us
+struct Samples
+{
+    uint32_t* data{nullptr};
+    size_t size{0};
+    size_t count{0};
+
+    ~Samples() { delete [] data; }
+
+    void Add(uint64_t us)
+    {
+        if(count == size)
+        {
+            size_t new_size = (size > 0 ? size * 2 : 64*1024);
+            uint32_t* new_data = new (std::nothrow) uint32_t[new_size];
+            if(new_data == nullptr)
+                return; // Sampled enough
+            if(count > 0)
+                memcpy(new_data, data, count * sizeof(uint32_t));
+            delete [] data;
+            data = new_data;
+            size = new_size;
+        }
+        data[count++] = (uint32_t)(us < UINT32_MAX ? us : UINT32_MAX);
+    }
+
+    // Percentile (0..1) of the sorted samples
+    uint32_t Get(double p) const
+    {
+        if(count == 0)
+            return 0;
+        size_t i = (size_t)(p * count);
+        return data[i < count ? i : count - 1];
+    }
+
+    void Sort()
+    {
+        qsort(data, count, sizeof(uint32_t), [](const void* a, const void* b) {
+            uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+            return (x < y ? -1 : (x > y ? 1 : 0));
+        });
+    }
+};
+
+class CLoadGen
+{
+public:
+    // Options
+    int scenario{SCENARIO_THROUGHPUT};
+    const char* host{"127.0.0.1"};
+    unsigned short port{19000};
+    int connections{64};
+    double duration{5};
+    size_t size{0};          // 0 - the default of the scenario
+    int proxy_pid{0};
+    const char* loop_name{nullptr};
+
+    ~CLoadGen();
+    bool Init();
+    void Run();
+
+private:
+    struct Conn
+    {
+        bool open{false};
+        bool connected{false};
+        size_t sent{0};          // Bytes sent (of the request)
+        size_t received{0};      // Bytes received (of the response)
+        uint64_t start_us{0};    // When the request (or the connect) started
+    };
+
+    bool Reserve(int fd);
+    bool Open();
+    void Close(int fd);
+    void Loop(uint64_t until_us);
+    void OnEvent(int fd, int events);
+    bool OnConnect(int fd);
+    void Send(int fd);
+    void Stream(int fd);
+    void Receive(int fd);
+    void OnResponse(int fd);
+    void RunIdle();
+    uint64_t GetProxyRss() const;
+
+    CEventLoop* loop{nullptr};
+    sockaddr_in addr{};
+    Conn* conns{nullptr};
+    int conns_size{0};
+    char* buf{nullptr};
+    size_t buf_size{0};
+
+    // Stats
+    bool measuring{false};   // Count the bytes and the samples?
+    int open_count{0};
+    int connecting{0};       // Connects in progress
+    int ready{0};            // Connections done with the first echo (idle)
+    bool holding{false};     // Holding the connections idle (idle)
+    bool checking{false};    // Checking the connections are alive (idle)
+    int alive{0};
+    uint64_t bytes{0};
+    uint64_t completed{0};
+    uint64_t errors{0};
+    Samples samples;
+};
+
+CLoadGen::~CLoadGen()
+{
+    delete [] conns;
+    delete [] buf;
+    delete loop;
+}
+
+bool CLoadGen::Init()
+{
+    if(size == 0)
+        size = (scenario == SCENARIO_THROUGHPUT ? 64*1024 : (scenario == SCENARIO_LATENCY ? 64 : 1));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "%s: Invalid host: %s\n", __func__, host);
+        return false;
+    }
+
+    buf_size = (size > WINDOW ? size : WINDOW);
+    buf = new (std::nothrow) char[buf_size];
+    if(buf == nullptr)
+        return false;
+    memset(buf, 'x', buf_size);
+
+    loop = CEventLoop::Create(loop_name);
+    return (loop != nullptr);
+}
+
+bool CLoadGen::Reserve(int fd)
+{
+    if(fd < conns_size)
+        return true;
+
+    int new_size = (conns_size > 0 ? conns_size : 1024);
+    while(new_size <= fd)
+        new_size *= 2;
+
+    Conn* new_conns = new (std::nothrow) Conn[new_size];
+    if(new_conns == nullptr)
+    {
+        fprintf(stderr, "%s: Out of memory: new_size=%d\n", __func__, new_size);
+        return false;
+    }
+    for(int i = 0; i < conns_size; i++)
+        new_conns[i] = conns[i];
+    delete [] conns;
+    conns = new_conns;
+    conns_size = new_size;
+    return true;
+}
+
+bool CLoadGen::Open()
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if(fd < 0)
+    {
+        errors++;
+        return false;
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if(!Reserve(fd) || (connect(fd, (const sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) ||
+       !loop->Add(fd, EVENT_WRITE))
+    {
+        close(fd);
+        errors++;
+        return false;
+    }
+
+    Conn& c = conns[fd];
+    c = Conn();
+    c.open = true;
+    c.start_us = NowUs();
+    open_count++;
+    connecting++;
+    return true;
+}
+
+void CLoadGen::Close(int fd)
+{
+    Conn& c = conns[fd];
+    if(!c.open)
+        return;
+
+    // Note: Reset rather than leave the connection in TIME_WAIT, so the
+    // connection rate isn't limited by the local ports
+    linger lg{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    loop->Remove(fd);
+    close(fd);
+    if(!c.connected)
+        connecting--;
+    c = Conn();
+    open_count--;
+}
+
+void CLoadGen::Loop(uint64_t until_us)
+{
+    CEventLoop::Event events[MAX_EVENTS];
+    while(true)
+    {
+        uint64_t now = NowUs();
+        if(now >= until_us)
+            break;
+        if(scenario == SCENARIO_IDLE && !holding && (checking ? alive : ready) + (int)errors >= connections)
+            break; // Done with all the connections
+
+        int timeout_ms = (int)((until_us - now + 999) / 1000);
+        int n = loop->Wait(events, MAX_EVENTS, (timeout_ms < 100 ? timeout_ms : 100));
+        if(n < 0)
+            break;
+        for(int i = 0; i < n; i++)
+            OnEvent(events[i].fd, events[i].events);
+
+        // Keep the number of the connections
+        if(scenario == SCENARIO_CPS)
+        {
+            while(open_count < connections && Open()) {}
+        }
+        else if(scenario == SCENARIO_IDLE && !holding && !checking)
+        {
+            while(open_count + (int)errors < connections && connecting < MAX_CONNECTING && Open()) {}
+        }
+    }
+}
+
+void CLoadGen::OnEvent(int fd, int events)
+{
+    Conn& c = conns[fd];
+    if(!c.open)
+        return;
+    if(!c.connected)
+    {
+        if(events & (EVENT_WRITE | EVENT_READ))
+            OnConnect(fd);
+        return;
+    }
+
+    if(events & EVENT_READ)
+        Receive(fd);
+    if((events & EVENT_WRITE) && conns[fd].open)
+    {
+        if(scenario == SCENARIO_THROUGHPUT)
+            Stream(fd);
+        else
+            Send(fd);
+    }
+}
+
+bool CLoadGen::OnConnect(int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+    {
+        errors++;
+        Close(fd);
+        return false;
+    }
+
+    Conn& c = conns[fd];
+    c.connected = true;
+    connecting--;
+    if(scenario == SCENARIO_THROUGHPUT)
+    {
+        loop->Modify(fd, EVENT_READ | EVENT_WRITE);
+        Stream(fd);
+        return true;
+    }
+
+    // Note: The connect time counts in the connection rate scenario
+    if(scenario != SCENARIO_CPS)
+        c.start_us = NowUs();
+    Send(fd);
+    return true;
+}
+
+void CLoadGen::Send(int fd)
+{
+    Conn& c = conns[fd];
+    while(c.sent < size)
+    {
+        ssize_t n = write(fd, buf, size - c.sent);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN)
+            {
+                errors++;
+                Close(fd);
+                return;
+            }
+            loop->Modify(fd, EVENT_READ | EVENT_WRITE);
+            return;
+        }
+        c.sent += n;
+    }
+    loop->Modify(fd, EVENT_READ);
+}
+
+void CLoadGen::Stream(int fd)
+{
+    Conn& c = conns[fd];
+    while(c.sent - c.received < WINDOW)
+    {
+        size_t len = WINDOW - (c.sent - c.received);
+        ssize_t n = write(fd, buf, (len < size ? len : size));
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN)
+            {
+                errors++;
+                Close(fd);
+            }
+            return; // Note: Still waiting for EVENT_WRITE
+        }
+        c.sent += n;
+    }
+}
+
+void CLoadGen::Receive(int fd)
+{
+    Conn& c = conns[fd];
+    while(true)
+    {
+        ssize_t n = read(fd, buf, buf_size);
+        if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        {
+            errors++;
+            Close(fd);
+            return;
+        }
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+
+        c.received += n;
+        if(measuring)
+            bytes += n;
+        if(scenario != SCENARIO_THROUGHPUT && c.received >= size)
+        {
+            OnResponse(fd);
+            if(!conns[fd].open)
+                return;
+        }
+    }
+
+    // Room in the window again
+    if(scenario == SCENARIO_THROUGHPUT)
+        Stream(fd);
+}
+
+void CLoadGen::OnResponse(int fd)
+{
+    Conn& c = conns[fd];
+    uint64_t now = NowUs();
+    if(measuring)
+    {
+        samples.Add(now - c.start_us);
+        completed++;
+    }
+
+    switch(scenario)
+    {
+    case SCENARIO_LATENCY:
+        c.sent = c.received = 0;
+        c.start_us = now;
+        Send(fd);
+        break;
+
+    case SCENARIO_CPS:
+        Close(fd);
+        break;
+
+    case SCENARIO_IDLE:
+        c.sent = c.received = 0;
+        if(checking)
+            alive++;
+        else
+            ready++;
+        break;
+    }
+}
+
+void CLoadGen::Run()
+{
+    uint64_t duration_us = (uint64_t)(duration * 1000000);
+    if(scenario == SCENARIO_IDLE)
+    {
+        RunIdle();
+        return;
+    }
+
+    // Open the connections and warm up
+    uint64_t start = NowUs();
+    if(scenario != SCENARIO_CPS)
+    {
+        for(int i = 0; i < connections; i++)
+            Open();
+        Loop(start + 200000);
+    }
+
+    measuring = true;
+    uint64_t begin = NowUs();
+    Loop(begin + duration_us);
+    double elapsed = (NowUs() - begin) / 1e6;
+    measuring = false;
+    samples.Sort();
+
+    printf("{\"scenario\":\"%s\",\"connections\":%d,\"size\":%zu,\"duration_s\":%.2f,\"errors\":%llu",
+           SCENARIO_NAMES[scenario], connections, size, elapsed, (unsigned long long)errors);
+    switch(scenario)
+    {
+    case SCENARIO_THROUGHPUT:
+        printf(",\"bytes\":%llu,\"mib_per_s\":%.1f,\"metric\":\"mib_per_s\",\"value\":%.1f,\"higher_is_better\":true}\n",
+               (unsigned long long)bytes, bytes / elapsed / (1024*1024), bytes / elapsed / (1024*1024));
+        break;
+
+    case SCENARIO_LATENCY:
+    case SCENARIO_CPS:
+        printf(",\"completed\":%llu,\"%s\":%.0f,\"p50_us\":%u,\"p99_us\":%u,\"p999_us\":%u",
+               (unsigned long long)completed, (scenario == SCENARIO_CPS ? "cps" : "rps"), completed / elapsed,
+               samples.Get(0.5), samples.Get(0.99), samples.Get(0.999));
+        if(scenario == SCENARIO_CPS)
+            printf(",\"metric\":\"cps\",\"value\":%.0f,\"higher_is_better\":true}\n", completed / elapsed);
+        else
+            printf(",\"metric\":\"p99_us\",\"value\":%u,\"higher_is_better\":false}\n", samples.Get(0.99));
+        break;
+    }
+}
+
+void CLoadGen::RunIdle()
+{
+    // Open the connections, every one with the echo through the proxy
+    uint64_t start = NowUs();
+    while(open_count + (int)errors < connections && connecting < MAX_CONNECTING && Open()) {}
+    Loop(start + SETUP_TIMEOUT * 1000);
+    double setup = (NowUs() - start) / 1e6;
+    int established = ready;
+
+    // Hold them idle, then ping every connection
+    holding = true;
+    Loop(NowUs() + (uint64_t)(duration * 1000000));
+    uint64_t rss = GetProxyRss();
+    holding = false;
+    checking = true;
+    for(int fd = 0; fd < conns_size; fd++)
+    {
+        if(conns[fd].open && conns[fd].connected)
+            Send(fd);
+    }
+    Loop(NowUs() + CHECK_TIMEOUT * 1000);
+
+    printf("{\"scenario\":\"idle\",\"connections\":%d,\"size\":%zu,\"duration_s\":%.2f,\"errors\":%llu"
+           ",\"established\":%d,\"setup_s\":%.2f,\"alive\":%d,\"proxy_rss_kib\":%llu"
+           ",\"metric\":\"alive\",\"value\":%d,\"higher_is_better\":true}\n",
+           connections, size, duration, (unsigned long long)errors, established, setup, alive,
+           (unsigned long long)rss, alive);
+}
+
+uint64_t CLoadGen::GetProxyRss() const
+{
+    if(proxy_pid <= 0)
+        return 0;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", proxy_pid);
+    FILE* f = fopen(path, "r");
+    if(f == nullptr)
+        return 0;
+
+    char line[256];
+    unsigned long long rss = 0;
+    while(fgets(line, sizeof(line), f) != nullptr)
+    {
+        if(sscanf(line, "VmRSS: %llu", &rss) == 1)
+            break;
+    }
+    fclose(f);
+    return rss;
+}
+
+int main(int argc, char** argv)
+{
+    CLoadGen gen;
+    const char* usage = "Usage: %s <throughput|latency|cps|idle> [-h host] [-p port] [-c connections]"
+                        " [-d duration, s] [-s size] [-P proxy pid] [-l event loop]\n";
+    if(argc < 2)
+    {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    gen.scenario = -1;
+    for(int i = 0; i < (int)(sizeof(SCENARIO_NAMES)/sizeof(SCENARIO_NAMES[0])); i++)
+    {
+        if(strcmp(argv[1], SCENARIO_NAMES[i]) == 0)
+            gen.scenario = i;
+    }
+    if(gen.scenario < 0)
+    {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    int opt = 0;
+    optind = 2;
+    while((opt = getopt(argc, argv, "h:p:c:d:s:P:l:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'h': gen.host = optarg; break;
+        case 'p': gen.port = (unsigned short)atoi(optarg); break;
+        case 'c': gen.connections = atoi(optarg); break;
+        case 'd': gen.duration = atof(optarg); break;
+        case 's': gen.size = (size_t)atol(optarg); break;
+        case 'P': gen.proxy_pid = atoi(optarg); break;
+        case 'l': gen.loop_name = optarg; break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    }
+    gen.connections = (gen.connections > 0 ? gen.connections : 1);
+
+    // Note: The log messages of the event loop go to stdout with the results
+    CLog::level = LOG_LEVEL_ERROR;
+    signal(SIGPIPE, SIG_IGN);
+
+    rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if(!gen.Init())
+        return 1;
+    gen.Run();
+    return 0;
+}
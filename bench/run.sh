@@ -0,0 +1,128 @@
+#!/bin/sh
+#
+# Benchmark of the proxy ("make bench"): runs the scenarios of loadgen (see
+# loadgen.cpp) through the proxy in front of the echo backend, once per event
+# loop, and prints the results as one JSON document. The first event loop is
+# the baseline: "vs_baseline" of every result is its metric relative to the
+# baseline one (above 1 is better, below 1 is a regression).
+#
+# Usage: bench/run.sh [event loop ...]        (default: select epoll)
+#
+# Environment:
+#   BENCH_BIN          Directory of echo_server and loadgen (default: _obj/bench)
+#   BENCH_PROXY        The proxy executable (default: ./tcproxy)
+#   BENCH_PORT         The proxy port, the echo backend is on the next one (default: 19000)
+#   BENCH_WORKERS      Proxy workers (default: 1)
+#   BENCH_DURATION     Seconds per scenario (default: 5)
+#   BENCH_CONNECTIONS  Connections of throughput/latency/cps (default: 64)
+#   BENCH_IDLE         Connections of the idle scenario (default: 10000). The proxy
+#                      takes two descriptors per session, see "ulimit -n"
+#
+# Note: select is limited to FD_SETSIZE descriptors, so the idle scenario is
+# skipped for it (and compared with the first loop that runs it).
+#
+BIN=${BENCH_BIN:-_obj/bench}
+PROXY=${BENCH_PROXY:-./tcproxy}
+PORT=${BENCH_PORT:-19000}
+ECHO_PORT=$((PORT + 1))
+WORKERS=${BENCH_WORKERS:-1}
+DURATION=${BENCH_DURATION:-5}
+CONNECTIONS=${BENCH_CONNECTIONS:-64}
+IDLE=${BENCH_IDLE:-10000}
+LOOPS=${*:-select epoll}
+
+# Note: The proxy runs under its own name, so its /tmp/<name>.cmd/.lock/.sock
+# don't clash with the proxy running on the host
+NAME=tcproxy-bench
+TMP=$(mktemp -d /tmp/$NAME.XXXXXX) || exit 1
+ln -s "$(cd "$(dirname "$PROXY")" && pwd)/$(basename "$PROXY")" "$TMP/$NAME"
+ECHO_PID=
+PROXY_PID=
+
+stop_proxy() {
+    [ -n "$PROXY_PID" ] || return
+    kill -0 "$PROXY_PID" 2>/dev/null && [ -p /tmp/$NAME.cmd ] && echo exit > /tmp/$NAME.cmd
+    wait "$PROXY_PID" 2>/dev/null
+    PROXY_PID=
+}
+
+cleanup() {
+    stop_proxy
+    [ -n "$ECHO_PID" ] && kill "$ECHO_PID" 2>/dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Wait for the proxy and the echo backend: one round trip with no errors
+wait_ready() {
+    i=0
+    while [ $i -lt 20 ]; do
+        "$BIN/loadgen" latency -p "$PORT" -c 1 -d 0.05 2>/dev/null | grep -q '"errors":0,' && return 0
+        kill -0 "$PROXY_PID" 2>/dev/null || return 1
+        sleep 0.1
+        i=$((i + 1))
+    done
+    return 1
+}
+
+"$BIN/echo_server" -p "$ECHO_PORT" -t "$(nproc 2>/dev/null || echo 2)" &
+ECHO_PID=$!
+
+# Results of the scenario: the JSON object printed by loadgen, with
+# "vs_baseline" added. The baseline values are kept in $TMP/<scenario>.base.
+result() {
+    json=$(grep '^{' "$TMP/out" | tail -n 1)
+    if [ -z "$json" ]; then
+        printf '{"scenario":"%s","error":"no result"}' "$1"
+        return
+    fi
+    value=$(echo "$json" | sed -n 's/.*"value":\([0-9.]*\).*/\1/p')
+    higher=$(echo "$json" | sed -n 's/.*"higher_is_better":\([a-z]*\).*/\1/p')
+    if [ ! -f "$TMP/$1.base" ]; then
+        echo "$value" > "$TMP/$1.base"
+    fi
+    ratio=$(awk -v v="$value" -v b="$(cat "$TMP/$1.base")" -v h="$higher" \
+        'BEGIN { if(v <= 0 || b <= 0) print "null"; else printf "%.3f", (h == "true" ? v / b : b / v) }')
+    echo "$json" | sed "s/}\$/,\"vs_baseline\":$ratio}/" | tr -d '\n'
+}
+
+printf '{"baseline":"%s","workers":%s,"duration_s":%s,"runs":[' "${LOOPS%% *}" "$WORKERS" "$DURATION"
+first_loop=1
+for loop in $LOOPS; do
+    cat > "$TMP/bench.conf" <<EOF
+port: $PORT
+workers: $WORKERS
+event_loop: $loop
+log_level: error
+listen_backlog: 4096
+route: default 127.0.0.1:$ECHO_PORT
+EOF
+    "$TMP/$NAME" "$TMP/bench.conf" > "$TMP/proxy.log" 2>&1 &
+    PROXY_PID=$!
+    if ! wait_ready; then
+        echo "run.sh: The proxy ($loop) doesn't relay to the echo backend on port $ECHO_PORT:" >&2
+        cat "$TMP/proxy.log" >&2
+        exit 1
+    fi
+
+    [ $first_loop -eq 1 ] || printf ','
+    first_loop=0
+    printf '\n{"event_loop":"%s","results":[' "$loop"
+
+    "$BIN/loadgen" throughput -p "$PORT" -c "$CONNECTIONS" -d "$DURATION" > "$TMP/out" 2>&1
+    printf '\n'; result throughput
+    "$BIN/loadgen" latency -p "$PORT" -c "$CONNECTIONS" -d "$DURATION" > "$TMP/out" 2>&1
+    printf ',\n'; result latency
+    "$BIN/loadgen" cps -p "$PORT" -c "$CONNECTIONS" -d "$DURATION" > "$TMP/out" 2>&1
+    printf ',\n'; result cps
+    if [ "$loop" = select ]; then
+        printf ',\n{"scenario":"idle","skipped":"select is limited to FD_SETSIZE"}'
+    else
+        "$BIN/loadgen" idle -p "$PORT" -c "$IDLE" -d "$DURATION" -P "$PROXY_PID" > "$TMP/out" 2>&1
+        printf ',\n'; result idle
+    fi
+    printf ']}'
+    stop_proxy
+done
+printf '\n]}\n'
@@ -0,0 +1,85 @@
+//
+//  bufferpool.cpp
+//
+#include <stdio.h>
+#include <new>              // std::nothrow
+#include "bufferpool.h"
+#include "log.h"
+
+CBufferPool::~CBufferPool()
+{
+    while(buckets != nullptr)
+    {
+        Bucket* b = buckets;
+        buckets = b->next;
+        while(b->free != nullptr)
+        {
+            FreeBuffer* f = b->free;
+            b->free = f->next;
+            delete [] (unsigned char*)f;
+        }
+        delete b;
+    }
+}
+
+unsigned char* CBufferPool::Get(size_t size)
+{
+    Bucket* b = GetBucket(size);
+    if(b != nullptr && b->free != nullptr)
+    {
+        FreeBuffer* f = b->free;
+        b->free = f->next;
+        free_bytes -= size;
+        used_bytes += size;
+        return (unsigned char*)f;
+    }
+
+    // Note: The buffer is not initialized, only the data read to it is used
+    unsigned char* buf = new (std::nothrow) unsigned char[size];
+    if(buf == nullptr)
+    {
+        LOG_ERROR("%s: Out of memory: size=%zu\n", __func__, size);
+        return nullptr;
+    }
+    used_bytes += size;
+    return buf;
+}
+
+void CBufferPool::Put(unsigned char* buf, size_t size)
+{
+    if(buf == nullptr)
+        return;
+
+    used_bytes -= size;
+
+    // Free the buffers above the limit, so the pool shrinks after the peak
+    Bucket* b = (free_bytes + size <= max_free && size >= sizeof(FreeBuffer) ? GetBucket(size) : nullptr);
+    if(b == nullptr)
+    {
+        delete [] buf;
+        return;
+    }
+
+    FreeBuffer* f = new (buf) FreeBuffer;
+    f->next = b->free;
+    b->free = f;
+    free_bytes += size;
+}
+
+CBufferPool::Bucket* CBufferPool::GetBucket(size_t size)
+{
+    Bucket* b = buckets;
+    while(b != nullptr && b->size != size)
+        b = b->next;
+
+    if(b == nullptr)
+    {
+        b = new (std::nothrow) Bucket;
+        if(b == nullptr)
+            return nullptr;
+        b->size = size;
+        b->next = buckets;
+        buckets = b;
+    }
+    return b;
+}
@@ -0,0 +1,55 @@
+//
+//  bufferpool.h
+//
+#ifndef __BUFFER_POOL__
+#define __BUFFER_POOL__
+
+#include <stddef.h>         // size_t
+
+//
+// Pool of READ/WRITE buffers shared by all the sockets of the event loop.
+// The sockets get a buffer only while they have the data to write and put
+// it back once the data is written out, so the idle connections hold no
+// buffers and the memory follows the data in flight, not the connections.
+//
+// Note: The free buffers are kept per buffer size (there are only a few
+// sizes: the default one and the routes' ones), up to max_free bytes in
+// total. Not thread safe, every worker has its own pool.
+//
+class CBufferPool
+{
+public:
+    CBufferPool(size_t max_free) : max_free(max_free) {}
+    ~CBufferPool();
+
+    // Get a free buffer of the size (or allocate a new one), nullptr if out of memory
+    unsigned char* Get(size_t size);
+
+    // Put the buffer back to the pool (or free it if the pool is full)
+    void Put(unsigned char* buf, size_t size);
+
+    size_t UsedBytes() const { return used_bytes; }
+    size_t FreeBytes() const { return free_bytes; }
+
+private:
+    struct FreeBuffer
+    {
+        FreeBuffer* next{nullptr};         // Note: Stored in the free buffer itself
+    };
+
+    struct Bucket
+    {
+        size_t size{0};                    // The size of the buffers
+        FreeBuffer* free{nullptr};         // Free buffers of the size
+        Bucket* next{nullptr};
+    };
+
+    Bucket* GetBucket(size_t size);
+
+    Bucket* buckets{nullptr};              // Buckets of the free buffers (by size)
+    size_t max_free{0};                    // The max size of the free buffers, bytes
+    size_t free_bytes{0};                  // The size of the free buffers, bytes
+    size_t used_bytes{0};                  // The size of the buffers in use, bytes
+};
+
+#endif // __BUFFER_POOL__
@@ -0,0 +1,368 @@
+//
+//  eventloop.cpp
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>        // strcasecmp
+#include <errno.h>
+#include <new>              // std::nothrow
+#include "eventloop.h"
+#include "log.h"
+
+CEventLoop* CEventLoop::Create(const char* name)
+{
+    CEventLoop* loop = nullptr;
+
+    if(name == nullptr || *name == '\0')
+    {
+        // Pick the best backend available
+#if defined(__linux__)
+        loop = new (std::nothrow) CEpollLoop;
+#elif defined(HAVE_KQUEUE)
+        loop = new (std::nothrow) CKqueueLoop;
+#else
+        loop = new (std::nothrow) CSelectLoop;
+#endif
+    }
+    else if(strcasecmp(name, "select") == 0)
+    {
+        loop = new (std::nothrow) CSelectLoop;
+    }
+#ifdef __linux__
+    else if(strcasecmp(name, "epoll") == 0)
+    {
+        loop = new (std::nothrow) CEpollLoop;
+    }
+#endif // __linux__
+#ifdef HAVE_KQUEUE
+    else if(strcasecmp(name, "kqueue") == 0)
+    {
+        loop = new (std::nothrow) CKqueueLoop;
+    }
+#endif // HAVE_KQUEUE
+    else
+    {
+        LOG_ERROR("%s: Event loop '%s' is not supported on this platform\n", __func__, name);
+        return nullptr;
+    }
+
+    if(loop == nullptr)
+    {
+        LOG_ERROR("%s: Out of memory: loop is NULL\n", __func__);
+        return nullptr;
+    }
+
+    if(!loop->Init())
+    {
+        delete loop;
+        return nullptr;
+    }
+
+    return loop;
+}
+
+//
+// select() backend
+//
+CSelectLoop::CSelectLoop()
+{
+    // Set fdset to have zero bits for all file descriptors
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+}
+
+bool CSelectLoop::Add(int fd, int events)
+{
+    // Note: select() can monitor only file descriptors numbers
+    // that are less than FD_SETSIZE (1024).
+    if(fd < 0 || fd >= FD_SETSIZE)
+    {
+        LOG_ERROR("%s: fd=%d exeedes the max file descriptor %d\n", __func__, fd, FD_SETSIZE-1);
+        return false;
+    }
+
+    // Set fd to be checked for readability
+    if(events & EVENT_READ)
+        FD_SET(fd, &rfds);
+
+    // Set fd to be checked for writability
+    if(events & EVENT_WRITE)
+        FD_SET(fd, &wfds);
+
+    // Update highest-numbered file descriptor in set
+    if(fd > fd_max)
+        fd_max = fd;
+    return true;
+}
+
+bool CSelectLoop::Modify(int fd, int events)
+{
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return false;
+
+    FD_CLR(fd, &rfds);
+    FD_CLR(fd, &wfds);
+    return Add(fd, events);
+}
+
+void CSelectLoop::Remove(int fd)
+{
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return;
+
+    FD_CLR(fd, &rfds);
+    FD_CLR(fd, &wfds);
+
+    // Update highest-numbered file descriptor in set
+    if(fd == fd_max)
+    {
+        // Find the previous highest-numbered file descriptor
+        while(--fd_max >= 0)
+        {
+            if(FD_ISSET(fd_max, &rfds) || FD_ISSET(fd_max, &wfds))
+                break;
+        }
+    }
+}
+
+int CSelectLoop::Wait(Event* events, int max_events, int timeout_ms)
+{
+    // Note: select will change fd_set passed, so we need to make a copy
+    fd_set trfds = rfds;
+    fd_set twfds = wfds;
+
+    timeval tv{timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+
+    int n = select(fd_max + 1, &trfds, &twfds, nullptr, (timeout_ms < 0 ? nullptr : &tv));
+    if(n < 0)
+    {
+        if(errno == EINTR)
+            return 0;
+        LOG_ERROR("select error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Collect all ready file descriptors
+    int count = 0;
+    for(int fd = 0; n > 0 && fd <= fd_max && count < max_events; fd++)
+    {
+        int ev = 0;
+        if(FD_ISSET(fd, &trfds))
+        {
+            ev |= EVENT_READ;
+            n--;
+        }
+        if(FD_ISSET(fd, &twfds))
+        {
+            ev |= EVENT_WRITE;
+            n--;
+        }
+        if(ev != 0)
+        {
+            events[count].fd = fd;
+            events[count].events = ev;
+            count++;
+        }
+    }
+    return count;
+}
+
+#ifdef __linux__
+//
+// epoll() backend
+//
+CEpollLoop::~CEpollLoop()
+{
+    if(epfd >= 0)
+        close(epfd);
+    delete [] ep_events;
+}
+
+bool CEpollLoop::Init()
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd < 0)
+    {
+        LOG_ERROR("%s: epoll_create1 error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool CEpollLoop::Add(int fd, int events)
+{
+    return Control(EPOLL_CTL_ADD, fd, events);
+}
+
+bool CEpollLoop::Modify(int fd, int events)
+{
+    // Note: EPOLL_CTL_MOD re-arms edge-triggered fd, so if it's
+    // already readable/writable it's reported by the next Wait().
+    return Control(EPOLL_CTL_MOD, fd, events);
+}
+
+bool CEpollLoop::Control(int op, int fd, int events)
+{
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    ev.events = EPOLLET;
+    if(events & EVENT_READ)
+        ev.events |= EPOLLIN;
+    if(events & EVENT_WRITE)
+        ev.events |= EPOLLOUT;
+
+    if(epoll_ctl(epfd, op, fd, &ev) < 0)
+    {
+        LOG_ERROR("%s: fd=%d, epoll_ctl(%s) error: %s\n", __func__, fd, 
+                  (op == EPOLL_CTL_ADD ? "EPOLL_CTL_ADD" : "EPOLL_CTL_MOD"), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void CEpollLoop::Remove(int fd)
+{
+    // Note: Closing the file descriptor removes it from the epoll set as well,
+    // so the error here is expected if fd is already closed.
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int CEpollLoop::Wait(Event* events, int max_events, int timeout_ms)
+{
+    if(ep_events_size < max_events)
+    {
+        delete [] ep_events;
+        ep_events = new (std::nothrow) epoll_event[max_events];
+        ep_events_size = (ep_events != nullptr ? max_events : 0);
+        if(ep_events == nullptr)
+        {
+            LOG_ERROR("%s: Out of memory: ep_events is NULL\n", __func__);
+            return -1;
+        }
+    }
+
+    int n = epoll_wait(epfd, ep_events, max_events, timeout_ms);
+    if(n < 0)
+    {
+        if(errno == EINTR)
+            return 0;
+        LOG_ERROR("epoll_wait error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for(int i = 0; i < n; i++)
+    {
+        const epoll_event& ev = ep_events[i];
+        events[i].fd = ev.data.fd;
+        events[i].events = 0;
+
+        // Note: Report errors and hang-ups as both readable and writable,
+        // so the callback would discover the error on the next read/write.
+        if(ev.events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            events[i].events |= EVENT_READ;
+        if(ev.events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            events[i].events |= EVENT_WRITE;
+    }
+    return n;
+}
+#endif // __linux__
+
+#ifdef HAVE_KQUEUE
+//
+// kqueue() backend
+//
+CKqueueLoop::~CKqueueLoop()
+{
+    if(kq >= 0)
+        close(kq);
+    delete [] kq_events;
+}
+
+bool CKqueueLoop::Init()
+{
+    kq = kqueue();
+    if(kq < 0)
+    {
+        LOG_ERROR("%s: kqueue error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool CKqueueLoop::Add(int fd, int events)
+{
+    // Note: Add both read and write filters, and keep the unwanted one
+    // disabled. So Modify() just needs to enable/disable the filters.
+    return Control(EV_ADD | EV_CLEAR, fd, events);
+}
+
+bool CKqueueLoop::Modify(int fd, int events)
+{
+    return Control(0, fd, events);
+}
+
+bool CKqueueLoop::Control(unsigned short flags, int fd, int events)
+{
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ,
+           flags | (events & EVENT_READ ? EV_ENABLE : EV_DISABLE), 0, 0, nullptr);
+    EV_SET(&changes[1], fd, EVFILT_WRITE,
+           flags | (events & EVENT_WRITE ? EV_ENABLE : EV_DISABLE), 0, 0, nullptr);
+
+    if(kevent(kq, changes, 2, nullptr, 0, nullptr) < 0)
+    {
+        LOG_ERROR("%s: fd=%d, kevent error: %s\n", __func__, fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void CKqueueLoop::Remove(int fd)
+{
+    // Note: Closing the file descriptor removes its events from the kqueue
+    // as well, so the error here is expected if fd is already closed.
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+    kevent(kq, changes, 2, nullptr, 0, nullptr);
+}
+
+int CKqueueLoop::Wait(Event* events, int max_events, int timeout_ms)
+{
+    if(kq_events_size < max_events)
+    {
+        delete [] kq_events;
+        kq_events = new (std::nothrow) struct kevent[max_events];
+        kq_events_size = (kq_events != nullptr ? max_events : 0);
+        if(kq_events == nullptr)
+        {
+            LOG_ERROR("%s: Out of memory: kq_events is NULL\n", __func__);
+            return -1;
+        }
+    }
+
+    timespec ts{timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+
+    int n = kevent(kq, nullptr, 0, kq_events, max_events, (timeout_ms < 0 ? nullptr : &ts));
+    if(n < 0)
+    {
+        if(errno == EINTR)
+            return 0;
+        LOG_ERROR("kevent error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Note: kqueue reports read and write filters as separate events,
+    // so the same fd may show up in the list twice.
+    for(int i = 0; i < n; i++)
+    {
+        const struct kevent& ev = kq_events[i];
+        events[i].fd = (int)ev.ident;
+        events[i].events = (ev.filter == EVFILT_READ ? EVENT_READ : EVENT_WRITE);
+    }
+    return n;
+}
+#endif // HAVE_KQUEUE
+
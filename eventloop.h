@@ -0,0 +1,131 @@
+//
+//  eventloop.h
+//
+#ifndef __EVENT_LOOP__
+#define __EVENT_LOOP__
+
+#include <sys/select.h>     // fd_set
+
+// Events the loop can be asked to monitor (and reports back as ready)
+#define EVENT_READ  0x01    // File descriptor is ready for reading
+#define EVENT_WRITE 0x02    // File descriptor is ready for writing
+
+//
+// Event loop backend interface. The backend only keeps track of the file
+// descriptors registered with it and reports those that are ready. It's up
+// to the caller to dispatch the ready file descriptors to the callbacks.
+//
+// Note: The epoll and kqueue backends are edge-triggered. A file descriptor
+// is reported once per readiness change, so the callbacks must read/write
+// until EAGAIN before waiting for a next event. Modify() re-arms the events,
+// so a file descriptor that is already ready is reported again.
+//
+class CEventLoop
+{
+public:
+    struct Event
+    {
+        int fd{-1};
+        int events{0};      // EVENT_READ and/or EVENT_WRITE
+    };
+
+    virtual ~CEventLoop() {}
+
+    // Create event loop backend by name ("epoll", "kqueue" or "select").
+    // The null or empty name selects the best backend for the platform.
+    static CEventLoop* Create(const char* name);
+
+    virtual const char* GetName() const = 0;
+    virtual bool Init() = 0;
+
+    // Register/unregister file descriptor, change the events to monitor
+    virtual bool Add(int fd, int events) = 0;
+    virtual bool Modify(int fd, int events) = 0;
+    virtual void Remove(int fd) = 0;
+
+    // Wait for ready file descriptors. Returns the number of the events
+    // stored in events[], 0 on timeout or signal, or -1 on error.
+    virtual int Wait(Event* events, int max_events, int timeout_ms) = 0;
+};
+
+//
+// select() backend: Portable, but limited to FD_SETSIZE file descriptors
+// and scans all of them on every wakeup.
+//
+class CSelectLoop : public CEventLoop
+{
+public:
+    CSelectLoop();
+
+    virtual const char* GetName() const override { return "select"; }
+    virtual bool Init() override { return true; }
+    virtual bool Add(int fd, int events) override;
+    virtual bool Modify(int fd, int events) override;
+    virtual void Remove(int fd) override;
+    virtual int Wait(Event* events, int max_events, int timeout_ms) override;
+
+private:
+    fd_set rfds;                  // Set of fds to be checked for readability
+    fd_set wfds;                  // Set of fds to be checked for writability
+    int fd_max{-1};               // Highest-numbered file descriptor in set
+};
+
+#ifdef __linux__
+#include <sys/epoll.h>
+
+//
+// epoll() backend (Linux, edge-triggered)
+//
+class CEpollLoop : public CEventLoop
+{
+public:
+    CEpollLoop() = default;
+    virtual ~CEpollLoop();
+
+    virtual const char* GetName() const override { return "epoll"; }
+    virtual bool Init() override;
+    virtual bool Add(int fd, int events) override;
+    virtual bool Modify(int fd, int events) override;
+    virtual void Remove(int fd) override;
+    virtual int Wait(Event* events, int max_events, int timeout_ms) override;
+
+private:
+    bool Control(int op, int fd, int events);
+
+    int epfd{-1};
+    epoll_event* ep_events{nullptr};
+    int ep_events_size{0};
+};
+#endif // __linux__
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#define HAVE_KQUEUE
+#include <sys/event.h>
+
+//
+// kqueue() backend (BSD/macOS, edge-triggered by EV_CLEAR)
+//
+class CKqueueLoop : public CEventLoop
+{
+public:
+    CKqueueLoop() = default;
+    virtual ~CKqueueLoop();
+
+    virtual const char* GetName() const override { return "kqueue"; }
+    virtual bool Init() override;
+    virtual bool Add(int fd, int events) override;
+    virtual bool Modify(int fd, int events) override;
+    virtual void Remove(int fd) override;
+    virtual int Wait(Event* events, int max_events, int timeout_ms) override;
+
+private:
+    bool Control(unsigned short flags, int fd, int events);
+
+    int kq{-1};
+    struct kevent* kq_events{nullptr};
+    int kq_events_size{0};
+};
+#endif // HAVE_KQUEUE
+
+#endif // __EVENT_LOOP__
+
@@ -0,0 +1,114 @@
+//
+//  ipaddr.h
+//
+#ifndef __IP_ADDR__
+#define __IP_ADDR__
+
+#include <sys/socket.h>
+#include <netinet/in.h>     // sockaddr_in, sockaddr_in6
+#include <arpa/inet.h>      // inet_ntop
+#include <string.h>         // memcmp
+#include <stdlib.h>         // strtol
+
+//
+// Binary IPv4/IPv6 address. Used as a key to lookup the routes, so it's
+// compared and hashed as raw bytes (only the first 4 bytes for IPv4).
+//
+struct IpAddr
+{
+    int family{0};                        // AF_INET or AF_INET6
+    unsigned char bytes[16]{};            // Address in network byte order
+
+    int Len() const { return (family == AF_INET ? 4 : 16); }
+
+    bool operator==(const IpAddr& other) const
+    {
+        return family == other.family && memcmp(bytes, other.bytes, Len()) == 0;
+    }
+
+    // FNV-1a hash of the address bytes
+    size_t Hash() const
+    {
+        size_t hash = 2166136261u;
+        for(int i = 0; i < Len(); i++)
+            hash = (hash ^ bytes[i]) * 16777619u;
+        return hash ^ (size_t)family;
+    }
+
+    // Set from socket address. Note: IPv4-mapped IPv6 address (::ffff:a.b.c.d)
+    // is converted to IPv4, so it matches the same routes as IPv4 client does.
+    bool Set(const sockaddr* sa)
+    {
+        if(sa->sa_family == AF_INET)
+        {
+            family = AF_INET;
+            memcpy(bytes, &((const sockaddr_in*)sa)->sin_addr, 4);
+            return true;
+        }
+        else if(sa->sa_family == AF_INET6)
+        {
+            const in6_addr& addr6 = ((const sockaddr_in6*)sa)->sin6_addr;
+            if(IN6_IS_ADDR_V4MAPPED(&addr6))
+            {
+                family = AF_INET;
+                memcpy(bytes, &addr6.s6_addr[12], 4);
+            }
+            else
+            {
+                family = AF_INET6;
+                memcpy(bytes, &addr6, 16);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Clear the bits after the prefix length
+    void Mask(int prefix_len)
+    {
+        for(int i = 0; i < Len(); i++, prefix_len -= 8)
+        {
+            if(prefix_len <= 0)
+                bytes[i] = 0;
+            else if(prefix_len < 8)
+                bytes[i] &= (unsigned char)(0xFF << (8 - prefix_len));
+        }
+    }
+
+    // Set from CIDR prefix string, i.e. "10.20.0.0/16" or "2001:db8::/32"
+    bool SetPrefix(const char* cidr, int& prefix_len)
+    {
+        char ip[INET6_ADDRSTRLEN]{};
+        const char* slash = strchr(cidr, '/');
+        if(slash == nullptr || slash == cidr || slash - cidr >= (long)sizeof(ip))
+            return false;
+        memcpy(ip, cidr, slash - cidr);
+
+        if(inet_pton(AF_INET, ip, bytes) == 1)
+            family = AF_INET;
+        else if(inet_pton(AF_INET6, ip, bytes) == 1)
+            family = AF_INET6;
+        else
+            return false;
+
+        char* end = nullptr;
+        long len = strtol(slash + 1, &end, 10);
+        if(end == slash + 1 || *end != '\0' || len < 0 || len > Len() * 8)
+            return false;
+
+        prefix_len = (int)len;
+        Mask(prefix_len);
+        return true;
+    }
+
+    // Format as a string, buf should be at least INET6_ADDRSTRLEN long
+    const char* ToString(char* buf, socklen_t size) const
+    {
+        if(inet_ntop(family, bytes, buf, size) == nullptr && size > 0)
+            *buf = '\0';
+        return buf;
+    }
+};
+
+#endif // __IP_ADDR__
+
@@ -0,0 +1,344 @@
+//
+//  log.cpp
+//
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>        // strcasecmp
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "log.h"
+
+int CLog::level = LOG_LEVEL_INFO;
+int CLog::format = LOG_FORMAT_TEXT;
+unsigned int CLog::rate = LOG_RATE;
+
+CLog::Slot CLog::ring[LOG_RING_SIZE];
+std::atomic<size_t> CLog::tail{0};
+size_t CLog::head = 0;
+std::atomic<size_t> CLog::dropped{0};
+std::atomic<bool> CLog::running{false};
+std::atomic<bool> CLog::sleeping{false};
+bool CLog::stop = false;
+pthread_t CLog::thread;
+pthread_mutex_t CLog::mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t CLog::cond = PTHREAD_COND_INITIALIZER;
+
+static const char* LEVEL_NAMES[] = {"error", "warning", "info", "debug"};
+static const char* LEVEL_TAGS[] = {"ERROR", "WARN ", "INFO ", "DEBUG"};
+
+bool CLog::Start()
+{
+    if(running)
+        return true;
+
+    // Note: The slot is free for the producer when its sequence number
+    // equals the position to write, and ready for the writer when it's
+    // the position plus one (bounded MPMC queue by Dmitry Vyukov).
+    for(size_t i = 0; i < LOG_RING_SIZE; i++)
+        ring[i].seq.store(i, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    head = 0;
+    stop = false;
+
+    int err = pthread_create(&thread, nullptr, &CLog::Thread, nullptr);
+    if(err != 0)
+    {
+        printf("%s: pthread_create error: %s\n", __func__, strerror(err));
+        return false;
+    }
+    running = true;
+    return true;
+}
+
+void CLog::Stop()
+{
+    if(!running)
+        return;
+
+    // Note: The messages written from now on are written synchronously,
+    // and the writer drains the ring before it exits (including the slots
+    // taken but not handed over yet, see Run).
+    running = false;
+    pthread_mutex_lock(&mutex);
+    stop = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread, nullptr);
+}
+
+void CLog::Write(int level, RateLimit& rl, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    VWrite(level, rl, nullptr, fmt, args);
+    va_end(args);
+}
+
+void CLog::Record(int level, RateLimit& rl, const char* event, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    VWrite(level, rl, event, fmt, args);
+    va_end(args);
+}
+
+void CLog::VWrite(int level, RateLimit& rl, const char* event, const char* fmt, va_list args)
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if(!Allow(rl, ts.tv_sec))
+        return;
+
+    // Take the slot to format the message into, or format it on the stack
+    // if the writer isn't running
+    Slot local;
+    Slot* s = &local;
+    size_t pos = 0;
+    bool async = running.load(std::memory_order_acquire);
+    if(async)
+    {
+        pos = tail.load(std::memory_order_relaxed);
+        while(true)
+        {
+            s = &ring[pos & (LOG_RING_SIZE - 1)];
+            size_t seq = s->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0)
+            {
+                if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if(diff < 0)
+            {
+                // The ring is full, don't wait for the writer
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            else
+            {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    s->time_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    s->level = level;
+    s->record = (event != nullptr);
+
+    int len = 0;
+    if(event != nullptr)
+        len = snprintf(s->text, sizeof(s->text), "event=%s ", event);
+    if(len >= 0 && (size_t)len < sizeof(s->text))
+    {
+        int n = vsnprintf(s->text + len, sizeof(s->text) - len, fmt, args);
+        len = (n < 0 ? len : len + n);
+    }
+    len = ((size_t)len < sizeof(s->text) ? len : sizeof(s->text) - 1);
+
+    // Note: The line end is added on output
+    while(len > 0 && (s->text[len - 1] == '\n' || s->text[len - 1] == ' '))
+        s->text[--len] = '\0';
+
+    unsigned int suppressed = rl.suppressed.exchange(0, std::memory_order_relaxed);
+    if(suppressed > 0)
+        snprintf(s->text + len, sizeof(s->text) - len, " (%u similar suppressed)", suppressed);
+
+    if(!async)
+    {
+        char buf[LOG_MSG_SIZE * 2];
+        Output(buf, Format(buf, sizeof(buf), *s));
+        return;
+    }
+
+    // Hand the slot over to the writer, and wake it up if it's waiting.
+    // Note: The fence (paired with the one in Run) keeps the flag from
+    // being loaded before the slot is stored, or the wakeup could be lost.
+    s->seq.store(pos + 1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(sleeping.load(std::memory_order_relaxed))
+    {
+        pthread_mutex_lock(&mutex);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+bool CLog::Allow(RateLimit& rl, uint64_t sec)
+{
+    if(rate == 0)
+        return true;
+
+    // Note: The races between the threads only let a few messages more
+    // or less through in the window, which is fine for a rate limit.
+    uint64_t window = rl.window.load(std::memory_order_relaxed);
+    if(window != sec && rl.window.compare_exchange_strong(window, sec, std::memory_order_relaxed))
+        rl.count.store(0, std::memory_order_relaxed);
+
+    if(rl.count.fetch_add(1, std::memory_order_relaxed) < rate)
+        return true;
+
+    rl.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void* CLog::Thread(void* arg)
+{
+    Run();
+    return nullptr;
+}
+
+void CLog::Run()
+{
+    // Note: Write out as many messages as we have in one write()
+    static char buf[64*1024];
+    while(true)
+    {
+        size_t len = 0;
+        while(len + LOG_MSG_SIZE * 8 < sizeof(buf))
+        {
+            Slot& s = ring[head & (LOG_RING_SIZE - 1)];
+            if(s.seq.load(std::memory_order_acquire) != head + 1)
+                break; // No more messages
+
+            len += Format(buf + len, sizeof(buf) - len, s);
+            s.seq.store(head + LOG_RING_SIZE, std::memory_order_release);
+            head++;
+        }
+
+        size_t n = dropped.exchange(0, std::memory_order_relaxed);
+        if(n > 0)
+            len += snprintf(buf + len, sizeof(buf) - len, "%s: %zu messages dropped (log ring is full)\n", __func__, n);
+
+        if(len > 0)
+        {
+            Output(buf, len);
+            continue;
+        }
+
+        // Wait for the messages. Note: The producers check the sleeping flag
+        // after the message is queued, so either the ring isn't empty on the
+        // check below, or the producer sees the flag and signals.
+        pthread_mutex_lock(&mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool empty = (ring[head & (LOG_RING_SIZE - 1)].seq.load(std::memory_order_acquire) != head + 1);
+        
+        // Note: Exit only once the slots taken are written too (the producer
+        // that took the slot before Stop signals when it's handed over)
+        if(empty && stop && tail.load(std::memory_order_acquire) == head)
+        {
+            sleeping = false;
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+        if(empty)
+            pthread_cond_wait(&cond, &mutex);
+        sleeping = false;
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+size_t CLog::Format(char* buf, size_t size, const Slot& s)
+{
+    // Local time with milliseconds
+    time_t sec = (time_t)(s.time_ms / 1000);
+    tm t;
+    localtime_r(&sec, &t);
+    char time_str[32]{};
+    size_t n = strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &t);
+    snprintf(time_str + n, sizeof(time_str) - n, ".%03u", (unsigned int)(s.time_ms % 1000));
+
+    int level = (s.level >= LOG_LEVEL_ERROR && s.level <= LOG_LEVEL_DEBUG ? s.level : LOG_LEVEL_DEBUG);
+    int len = 0;
+    if(format == LOG_FORMAT_TEXT)
+    {
+        len = snprintf(buf, size, "%s %s %s\n", time_str, LEVEL_TAGS[level], s.text);
+    }
+    else
+    {
+        len = snprintf(buf, size, "{\"time\":\"%s\",\"level\":\"%s\"", time_str, LEVEL_NAMES[level]);
+        const char* p = s.text;
+        if(!s.record)
+        {
+            // The message as a string
+            len += snprintf(buf + len, size - len, ",\"msg\":\"");
+            for(; *p != '\0' && (size_t)len + 8 < size; p++)
+            {
+                if(*p == '"' || *p == '\\')
+                    len += snprintf(buf + len, size - len, "\\%c", *p);
+                else if((unsigned char)*p < 0x20)
+                    len += snprintf(buf + len, size - len, "\\u%04x", (unsigned int)(unsigned char)*p);
+                else
+                    buf[len++] = *p;
+            }
+            len += snprintf(buf + len, size - len, "\"");
+        }
+        else
+        {
+            // The key=value pairs as the fields. Note: The numbers are not quoted.
+            while(*p != '\0')
+            {
+                const char* end = strchr(p, ' ');
+                size_t pair_len = (end != nullptr ? end - p : strlen(p));
+                if((size_t)len + pair_len + 16 >= size)
+                    break; // Truncated
+                const char* eq = (const char*)memchr(p, '=', pair_len);
+                if(eq != nullptr)
+                {
+                    int key_len = (int)(eq - p);
+                    int val_len = (int)(pair_len - key_len - 1);
+                    bool number = (val_len > 0 && strspn(eq + 1, "0123456789") == (size_t)val_len);
+                    len += snprintf(buf + len, size - len, (number ? ",\"%.*s\":%.*s" : ",\"%.*s\":\"%.*s\""),
+                                    key_len, p, val_len, eq + 1);
+                }
+                p += pair_len;
+                while(*p == ' ')
+                    p++;
+            }
+        }
+        len += snprintf(buf + len, size - len, "}\n");
+    }
+    return ((size_t)len < size ? (size_t)len : size - 1);
+}
+
+void CLog::Output(const char* buf, size_t len)
+{
+    // Note: stdout might be a pipe, so write everything out
+    while(len > 0)
+    {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            break; // Nowhere to report it
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+bool CLog::ParseLevel(const char* str, int& level)
+{
+    for(int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++)
+    {
+        if(strcasecmp(str, LEVEL_NAMES[i]) == 0)
+        {
+            level = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CLog::ParseFormat(const char* str, int& format)
+{
+    if(strcasecmp(str, "text") == 0)
+        format = LOG_FORMAT_TEXT;
+    else if(strcasecmp(str, "json") == 0)
+        format = LOG_FORMAT_JSON;
+    else
+        return false;
+    return true;
+}
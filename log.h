@@ -0,0 +1,126 @@
+//
+//  log.h
+//
+#ifndef __LOG__
+#define __LOG__
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // uint64_t
+#include <stdarg.h>         // va_list
+#include <pthread.h>
+#include <atomic>
+
+// Log levels (the lower, the more important)
+enum LogLevel
+{
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+// Log output formats
+enum LogFormat
+{
+    LOG_FORMAT_TEXT = 0,            // <time> <level> <message>
+    LOG_FORMAT_JSON                 // {"time":"<time>","level":"<level>","msg":"<message>"}
+};
+
+#define LOG_MSG_SIZE  256           // The max length of the message (longer ones are truncated)
+#define LOG_RING_SIZE 4096          // The number of the messages queued (power of 2)
+#define LOG_RATE      1000          // The default max number of messages per call site per second
+
+// The max level compiled in (-DLOG_MAX_LEVEL=LOG_LEVEL_INFO in the release
+// build), the call sites above it are compiled out with their arguments
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+//
+// Logging off the event loop. The messages are formatted by the caller
+// into the lock-free ring buffer and written out by the background writer
+// thread, so the event loop never blocks on stdout. The message is dropped
+// (and counted) if the ring is full, rather than waiting for the writer.
+//
+// Every call site (see LOG macro) is rate-limited on its own, so a flood
+// of one message doesn't push out the others. The number of suppressed
+// messages is reported with the next message let through.
+//
+// Note: The messages are written synchronously until the writer is started
+// and after it's stopped (i.e. while reading the config and shutting down).
+//
+class CLog
+{
+public:
+    // Per call site rate limit state
+    struct RateLimit
+    {
+        std::atomic<uint64_t> window{0};   // Current window, seconds
+        std::atomic<unsigned int> count{0}; // Messages in the window
+        std::atomic<unsigned int> suppressed{0}; // Messages suppressed since the last one
+    };
+
+    static bool Start();
+    static void Stop();
+
+    // Write the message: "<func>: <text>"
+    static void Write(int level, RateLimit& rl, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+
+    // Write the structured record: "event=<event> <key>=<value> ..."
+    // Note: The values must not have spaces, they are not quoted in text format.
+    static void Record(int level, RateLimit& rl, const char* event, const char* fmt, ...) __attribute__((format(printf, 4, 5)));
+
+    static bool ParseLevel(const char* str, int& level);
+    static bool ParseFormat(const char* str, int& format);
+
+    static int level;                      // Max level to log
+    static int format;                     // Output format
+    static unsigned int rate;              // Max messages per call site per second (0 - no limit)
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> seq{0};        // Sequence number of the slot (see Push/Pop)
+        uint64_t time_ms{0};               // Wall clock time of the message, ms
+        int level{0};
+        bool record{false};                // Structured record (key=value pairs)
+        char text[LOG_MSG_SIZE]{};
+    };
+
+    static void VWrite(int level, RateLimit& rl, const char* event, const char* fmt, va_list args);
+    static bool Allow(RateLimit& rl, uint64_t sec);
+    static void* Thread(void* arg);
+    static void Run();
+    static size_t Format(char* buf, size_t size, const Slot& s);
+    static void Output(const char* buf, size_t len);
+
+    static Slot ring[LOG_RING_SIZE];
+    static std::atomic<size_t> tail;       // Next slot to write (producers)
+    static size_t head;                    // Next slot to read (writer thread only)
+    static std::atomic<size_t> dropped;    // Messages dropped since reported last time
+    static std::atomic<bool> running;      // Is writer thread started?
+    static std::atomic<bool> sleeping;     // Is writer thread waiting for the messages?
+    static bool stop;                      // Tell writer thread to exit
+    static pthread_t thread;
+    static pthread_mutex_t mutex;          // Protects the wait for the messages only
+    static pthread_cond_t cond;
+};
+
+// Log the message if the level is enabled. Note: Every call site has its
+// own rate limit, and the arguments are not evaluated if level is disabled.
+#define LOG(lvl, ...) \
+    do { \
+        if((lvl) <= LOG_MAX_LEVEL && (lvl) <= CLog::level) { static CLog::RateLimit log_rl_; CLog::Write((lvl), log_rl_, __VA_ARGS__); } \
+    } while(0)
+
+#define LOG_RECORD(lvl, event, ...) \
+    do { \
+        if((lvl) <= LOG_MAX_LEVEL && (lvl) <= CLog::level) { static CLog::RateLimit log_rl_; CLog::Record((lvl), log_rl_, (event), __VA_ARGS__); } \
+    } while(0)
+
+#define LOG_ERROR(...)   LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARNING(...) LOG(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_INFO(...)    LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)   LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif // __LOG__
@@ -2,6 +2,7 @@
 // TCP Proxy
 //
 #include <stdio.h>
+#include <string.h>
 #include "tcproxy.h"
 
 void SetStdOut()
@@ -63,9 +64,14 @@ int main(int argc, char** argv)
     if(argc < 2)
     {
         printf("%s: No configuration file specified.\n", __func__);
+        printf("Usage: %s <config file> [--upgrade]\n", argv[0]);
         return 1;
     }
     
+    // Upgrade: Take over the listening sockets of the running instance,
+    // which drains its sessions and exits
+    bool upgrade = (argc > 2 && strcmp(argv[2], "--upgrade") == 0);
+    
     // Set stdout and stoerr to "line buffered": On output, data is written when
     // a newline character is inserted into the stream or when the buffer is full
     // (or flushed), whatever happens first.
@@ -73,7 +79,7 @@ int main(int argc, char** argv)
     
     // Start listening
     CTcpProxy proxy(argv[0] /*path*/, argv[1] /*config file*/);
-    if(!proxy.Start())
+    if(!proxy.Start(upgrade))
         return 1;
     
     printf("%s: Done\n", __func__);
@@ -0,0 +1,207 @@
+//
+//  prefixtrie.cpp
+//
+#include <stdio.h>
+#include <string.h>
+#include <new>              // std::nothrow
+#include "prefixtrie.h"
+#include "log.h"
+
+const int32_t MIN_TRIE_NODES = 64;  // Initial size of nodes array
+
+bool CPrefixTrie::Insert(const uint8_t* key, int len, void* value)
+{
+    if(len < 0 || len > max_bits)
+        return false;
+    
+    // Make the root node (empty prefix)
+    if(node_count == 0 && NewNode(key, 0) < 0)
+        return false;
+    
+    // Note: Use indexes rather than Node pointers, since NewNode()
+    // might reallocate the nodes array.
+    int32_t n = 0;
+    while(true)
+    {
+        if(nodes[n].len == len)
+        {
+            // Got the node for the prefix
+            if(nodes[n].value == nullptr && value != nullptr)
+                count++;
+            else if(nodes[n].value != nullptr && value == nullptr)
+                count--;
+            nodes[n].value = value;
+            return true;
+        }
+        
+        int bit = GetBit(key, nodes[n].len);
+        int32_t c = nodes[n].child[bit];
+        if(c < 0)
+        {
+            // No child on this side, add the prefix as a new leaf
+            int32_t leaf = NewNode(key, len);
+            if(leaf < 0)
+                return false;
+            nodes[leaf].value = value;
+            nodes[n].child[bit] = leaf;
+            if(value != nullptr)
+                count++;
+            return true;
+        }
+        
+        int child_len = nodes[c].len;
+        int common = CommonBits(key, nodes[c].key, (len < child_len ? len : child_len));
+        if(common == child_len)
+        {
+            // The child prefix is a prefix of the key, go down
+            n = c;
+            continue;
+        }
+        
+        // The key branches off in the middle of the child's compressed path.
+        // Split the path by the node for the common part of both prefixes.
+        int32_t split = NewNode(key, common);
+        if(split < 0)
+            return false;
+        nodes[split].child[GetBit(nodes[c].key, common)] = c;
+        nodes[n].child[bit] = split;
+        n = split;
+    }
+}
+
+void CPrefixTrie::Remove(const uint8_t* key, int len)
+{
+    int32_t n = Lookup(key, len);
+    if(n >= 0 && nodes[n].value != nullptr)
+    {
+        nodes[n].value = nullptr;
+        count--;
+    }
+}
+
+void* CPrefixTrie::Find(const uint8_t* key, int len) const
+{
+    int32_t n = Lookup(key, len);
+    return (n >= 0 ? nodes[n].value : nullptr);
+}
+
+void* CPrefixTrie::Match(const uint8_t* addr) const
+{
+    if(node_count == 0)
+        return nullptr;
+    
+    void* best = nullptr;
+    int32_t n = 0;
+    while(n >= 0)
+    {
+        const Node& node = nodes[n];
+        
+        // Note: The compressed path skips the bits, so make sure
+        // all the node prefix bits match the address.
+        if(!IsPrefix(node.key, addr, node.len))
+            break;
+        
+        if(node.value != nullptr)
+            best = node.value; // The longest prefix so far
+        
+        if(node.len >= max_bits)
+            break;
+        
+        n = node.child[GetBit(addr, node.len)];
+    }
+    return best;
+}
+
+void CPrefixTrie::Clear()
+{
+    delete [] nodes;
+    nodes = nullptr;
+    node_count = 0;
+    node_size = 0;
+    count = 0;
+}
+
+int32_t CPrefixTrie::Lookup(const uint8_t* key, int len) const
+{
+    int32_t n = (node_count > 0 ? 0 : -1);
+    while(n >= 0)
+    {
+        const Node& node = nodes[n];
+        if(node.len > len || !IsPrefix(node.key, key, node.len))
+            return -1;
+        
+        if(node.len == len)
+            return n;
+        
+        n = node.child[GetBit(key, node.len)];
+    }
+    return -1;
+}
+
+int32_t CPrefixTrie::NewNode(const uint8_t* key, int len)
+{
+    if(node_count == node_size)
+    {
+        // Grow nodes array
+        int32_t new_size = (node_size > 0 ? node_size * 2 : MIN_TRIE_NODES);
+        Node* new_nodes = new (std::nothrow) Node[new_size];
+        if(new_nodes == nullptr)
+        {
+            LOG_ERROR("%s: Out of memory: new_size=%d\n", __func__, new_size);
+            return -1;
+        }
+        
+        for(int32_t i = 0; i < node_count; i++)
+            new_nodes[i] = nodes[i];
+        
+        delete [] nodes;
+        nodes = new_nodes;
+        node_size = new_size;
+    }
+    
+    // Copy the key bits up to the prefix length, leave the rest 0
+    Node& node = nodes[node_count];
+    node = Node();
+    memcpy(node.key, key, len / 8);
+    if(len % 8)
+        node.key[len / 8] = key[len / 8] & (uint8_t)(0xFF << (8 - len % 8));
+    node.len = (uint8_t)len;
+    
+    return node_count++;
+}
+
+int CPrefixTrie::CommonBits(const uint8_t* key1, const uint8_t* key2, int len)
+{
+    int bits = 0;
+    for(int i = 0; bits < len; i++)
+    {
+        uint8_t diff = key1[i] ^ key2[i];
+        if(diff == 0)
+        {
+            bits += 8;
+            continue;
+        }
+        
+        // Count the equal leading bits of this byte
+        while(!(diff & 0x80))
+        {
+            diff <<= 1;
+            bits++;
+        }
+        break;
+    }
+    return (bits < len ? bits : len);
+}
+
+bool CPrefixTrie::IsPrefix(const uint8_t* prefix, const uint8_t* key, int len)
+{
+    if(memcmp(prefix, key, len / 8) != 0)
+        return false;
+    
+    if(len % 8 == 0)
+        return true;
+    
+    uint8_t mask = (uint8_t)(0xFF << (8 - len % 8));
+    return (prefix[len / 8] == (key[len / 8] & mask));
+}
+
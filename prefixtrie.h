@@ -0,0 +1,64 @@
+//
+//  prefixtrie.h
+//
+#ifndef __PREFIX_TRIE__
+#define __PREFIX_TRIE__
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // uint8_t, int32_t
+
+//
+// Path-compressed binary trie (Patricia) for the longest prefix match
+// of IPv4 (32 bits) or IPv6 (128 bits) addresses. Only the nodes where
+// the prefixes branch off are stored, so lookup visits at most one node
+// per branching bit rather than one node per address bit.
+//
+// Note: The nodes are kept in one contiguous array and linked by index,
+// which keeps them close in memory and makes the trie cheap to clear.
+//
+class CPrefixTrie
+{
+    struct Node
+    {
+        uint8_t key[16]{};          // Prefix bits (the bits after len are 0)
+        int32_t child[2]{-1, -1};   // Child nodes by the bit after prefix
+        void* value{nullptr};       // Value stored for the prefix (if any)
+        uint8_t len{0};             // Prefix length in bits
+    };
+
+public:
+    CPrefixTrie(int max_bits) : max_bits(max_bits) {}
+    ~CPrefixTrie() { delete [] nodes; }
+
+    // Set value for the prefix (replaces the existing one)
+    bool Insert(const uint8_t* key, int len, void* value);
+
+    // Set the prefix value to nullptr. Note: The node is kept in the trie.
+    void Remove(const uint8_t* key, int len);
+
+    // Get the value for the exact prefix
+    void* Find(const uint8_t* key, int len) const;
+
+    // Get the value of the longest prefix matching the address (max_bits long)
+    void* Match(const uint8_t* addr) const;
+
+    void Clear();
+
+    size_t Count() const { return count; }
+
+private:
+    int32_t Lookup(const uint8_t* key, int len) const;
+    int32_t NewNode(const uint8_t* key, int len);
+    static int GetBit(const uint8_t* key, int bit) { return (key[bit >> 3] >> (7 - (bit & 7))) & 1; }
+    static int CommonBits(const uint8_t* key1, const uint8_t* key2, int len);
+    static bool IsPrefix(const uint8_t* prefix, const uint8_t* key, int len);
+
+    int max_bits{0};                // 32 for IPv4, 128 for IPv6
+    Node* nodes{nullptr};           // Array of nodes (the root is nodes[0])
+    int32_t node_count{0};          // The number of nodes in use
+    int32_t node_size{0};           // The size of nodes array
+    size_t count{0};                // The number of prefixes with value
+};
+
+#endif // __PREFIX_TRIE__
+
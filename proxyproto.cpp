@@ -0,0 +1,209 @@
+//
+//  proxyproto.cpp
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "proxyproto.h"
+
+static const unsigned char V2_SIGNATURE[12] = {'\r', '\n', '\r', '\n', '\0', '\r', '\n', 'Q', 'U', 'I', 'T', '\n'};
+static const char V1_PREFIX[] = "PROXY ";
+static const size_t V1_MAX = 107;       // The max length of the v1 line, with CRLF
+
+static const unsigned char V2_LOCAL = 0x20;   // Version 2, LOCAL command
+static const unsigned char V2_PROXY = 0x21;   // Version 2, PROXY command
+static const unsigned char V2_UNSPEC = 0x00;
+static const unsigned char V2_TCP4 = 0x11;
+static const unsigned char V2_TCP6 = 0x21;
+
+// Convert the IPv4-mapped IPv6 address (of the dual-stack socket) to IPv4
+static sockaddr_storage Unmap(const sockaddr_storage& sa)
+{
+    const sockaddr_in6& addr6 = (const sockaddr_in6&)sa;
+    if(sa.ss_family != AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&addr6.sin6_addr))
+        return sa;
+
+    sockaddr_storage res{};
+    sockaddr_in& addr4 = (sockaddr_in&)res;
+    addr4.sin_family = AF_INET;
+    addr4.sin_port = addr6.sin6_port;
+    memcpy(&addr4.sin_addr, &addr6.sin6_addr.s6_addr[12], 4);
+    return res;
+}
+
+void ProxyHeader::Set(const sockaddr_storage& src, const sockaddr_storage& dst)
+{
+    source = Unmap(src);
+    dest = Unmap(dst);
+    if(source.ss_family != dest.ss_family || (source.ss_family != AF_INET && source.ss_family != AF_INET6))
+    {
+        memset(&source, 0, sizeof(source));
+        memset(&dest, 0, sizeof(dest));
+    }
+}
+
+size_t ProxyHeader::Format(int version, unsigned char* buf, size_t size) const
+{
+    const sockaddr_in& src4 = (const sockaddr_in&)source;
+    const sockaddr_in& dst4 = (const sockaddr_in&)dest;
+    const sockaddr_in6& src6 = (const sockaddr_in6&)source;
+    const sockaddr_in6& dst6 = (const sockaddr_in6&)dest;
+    int family = source.ss_family;
+
+    if(version == 1)
+    {
+        if(family != AF_INET && family != AF_INET6)
+        {
+            int n = snprintf((char*)buf, size, "PROXY UNKNOWN\r\n");
+            return (n > 0 && (size_t)n < size ? (size_t)n : 0);
+        }
+
+        char src_ip[INET6_ADDRSTRLEN]{};
+        char dst_ip[INET6_ADDRSTRLEN]{};
+        inet_ntop(family, (family == AF_INET ? (const void*)&src4.sin_addr : (const void*)&src6.sin6_addr),
+                  src_ip, sizeof(src_ip));
+        inet_ntop(family, (family == AF_INET ? (const void*)&dst4.sin_addr : (const void*)&dst6.sin6_addr),
+                  dst_ip, sizeof(dst_ip));
+        int n = snprintf((char*)buf, size, "PROXY %s %s %s %hu %hu\r\n", (family == AF_INET ? "TCP4" : "TCP6"),
+                         src_ip, dst_ip, ntohs(family == AF_INET ? src4.sin_port : src6.sin6_port),
+                         ntohs(family == AF_INET ? dst4.sin_port : dst6.sin6_port));
+        return (n > 0 && (size_t)n < size ? (size_t)n : 0);
+    }
+
+    // Version 2: the signature, command, family, the length of the
+    // addresses (network byte order) and the addresses
+    size_t addr_len = (family == AF_INET ? 12 : (family == AF_INET6 ? 36 : 0));
+    if(size < 16 + addr_len)
+        return 0;
+
+    memcpy(buf, V2_SIGNATURE, sizeof(V2_SIGNATURE));
+    buf[12] = V2_PROXY;
+    buf[13] = (family == AF_INET ? V2_TCP4 : (family == AF_INET6 ? V2_TCP6 : V2_UNSPEC));
+    buf[14] = (unsigned char)(addr_len >> 8);
+    buf[15] = (unsigned char)addr_len;
+
+    unsigned char* p = buf + 16;
+    if(family == AF_INET)
+    {
+        memcpy(p, &src4.sin_addr, 4);
+        memcpy(p + 4, &dst4.sin_addr, 4);
+        memcpy(p + 8, &src4.sin_port, 2);
+        memcpy(p + 10, &dst4.sin_port, 2);
+    }
+    else if(family == AF_INET6)
+    {
+        memcpy(p, &src6.sin6_addr, 16);
+        memcpy(p + 16, &dst6.sin6_addr, 16);
+        memcpy(p + 32, &src6.sin6_port, 2);
+        memcpy(p + 34, &dst6.sin6_port, 2);
+    }
+    return 16 + addr_len;
+}
+
+int ProxyHeader::Parse(const unsigned char* data, size_t len)
+{
+    memset(&source, 0, sizeof(source));
+    memset(&dest, 0, sizeof(dest));
+    if(len == 0)
+        return 0;
+
+    // Note: The versions differ in the first byte
+    if(data[0] == V1_PREFIX[0])
+        return ParseV1(data, len);
+    if(data[0] == V2_SIGNATURE[0])
+        return ParseV2(data, len);
+    return -1;
+}
+
+int ProxyHeader::ParseV1(const unsigned char* data, size_t len)
+{
+    size_t prefix_len = strlen(V1_PREFIX);
+    if(memcmp(data, V1_PREFIX, (len < prefix_len ? len : prefix_len)) != 0)
+        return -1;
+
+    // The line up to CRLF
+    size_t end = 0;
+    while(end + 1 < len && end + 2 <= V1_MAX && !(data[end] == '\r' && data[end+1] == '\n'))
+        end++;
+    if(end + 1 >= len || data[end] != '\r' || data[end+1] != '\n')
+        return (len >= V1_MAX ? -1 : 0);
+
+    char line[V1_MAX+1]{};
+    memcpy(line, data, end);
+    int header_len = (int)end + 2;
+
+    // "PROXY UNKNOWN[ ...]": the addresses are unknown
+    char proto[8]{}, src_ip[INET6_ADDRSTRLEN]{}, dst_ip[INET6_ADDRSTRLEN]{}, src_port[8]{}, dst_port[8]{};
+    int pos = 0;
+    int n = sscanf(line + prefix_len, "%7s %45s %45s %7s %7s%n", proto, src_ip, dst_ip, src_port, dst_port, &pos);
+    if(n >= 1 && strcmp(proto, "UNKNOWN") == 0)
+        return header_len;
+    if(n != 5 || line[prefix_len + pos] != '\0')
+        return -1;
+
+    int family = (strcmp(proto, "TCP4") == 0 ? AF_INET : (strcmp(proto, "TCP6") == 0 ? AF_INET6 : 0));
+    sockaddr_storage* addrs[] = {&source, &dest};
+    const char* ips[] = {src_ip, dst_ip};
+    const char* ports[] = {src_port, dst_port};
+    for(int i = 0; i < 2; i++)
+    {
+        char* port_end = nullptr;
+        unsigned long port = strtoul(ports[i], &port_end, 10);
+        sockaddr_in& addr4 = (sockaddr_in&)*addrs[i];
+        sockaddr_in6& addr6 = (sockaddr_in6&)*addrs[i];
+        void* addr = (family == AF_INET ? (void*)&addr4.sin_addr : (void*)&addr6.sin6_addr);
+        if(family == 0 || *port_end != '\0' || port > 65535 || inet_pton(family, ips[i], addr) != 1)
+        {
+            memset(&source, 0, sizeof(source));
+            memset(&dest, 0, sizeof(dest));
+            return -1;
+        }
+        addrs[i]->ss_family = family;
+        (family == AF_INET ? addr4.sin_port : addr6.sin6_port) = htons((unsigned short)port);
+    }
+    return header_len;
+}
+
+int ProxyHeader::ParseV2(const unsigned char* data, size_t len)
+{
+    size_t sig_len = sizeof(V2_SIGNATURE);
+    if(memcmp(data, V2_SIGNATURE, (len < sig_len ? len : sig_len)) != 0)
+        return -1;
+    if(len < 16)
+        return 0;
+
+    unsigned char cmd = data[12];
+    unsigned char family = data[13];
+    size_t addr_len = ((size_t)data[14] << 8) | data[15];
+    if((cmd != V2_LOCAL && cmd != V2_PROXY) || 16 + addr_len > PROXY_HEADER_MAX)
+        return -1;
+    if(len < 16 + addr_len)
+        return 0;
+
+    // Note: The addresses of the LOCAL connection and of the other families
+    // (i.e. Unix or UDP) are unknown, the TLVs after the addresses are skipped
+    const unsigned char* p = data + 16;
+    if(cmd == V2_PROXY && family == V2_TCP4 && addr_len >= 12)
+    {
+        sockaddr_in& src = (sockaddr_in&)source;
+        sockaddr_in& dst = (sockaddr_in&)dest;
+        src.sin_family = dst.sin_family = AF_INET;
+        memcpy(&src.sin_addr, p, 4);
+        memcpy(&dst.sin_addr, p + 4, 4);
+        memcpy(&src.sin_port, p + 8, 2);
+        memcpy(&dst.sin_port, p + 10, 2);
+    }
+    else if(cmd == V2_PROXY && family == V2_TCP6 && addr_len >= 36)
+    {
+        sockaddr_in6& src = (sockaddr_in6&)source;
+        sockaddr_in6& dst = (sockaddr_in6&)dest;
+        src.sin6_family = dst.sin6_family = AF_INET6;
+        memcpy(&src.sin6_addr, p, 16);
+        memcpy(&dst.sin6_addr, p + 16, 16);
+        memcpy(&src.sin6_port, p + 32, 2);
+        memcpy(&dst.sin6_port, p + 34, 2);
+    }
+    return (int)(16 + addr_len);
+}
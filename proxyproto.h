@@ -0,0 +1,44 @@
+//
+//  proxyproto.h
+//
+#ifndef __PROXY_PROTO__
+#define __PROXY_PROTO__
+
+#include <stddef.h>         // size_t
+#include <sys/socket.h>     // sockaddr_storage
+
+#define PROXY_HEADER_MAX 536    // The max size of the header (v2 with the TLVs, v1 is up to 107)
+
+//
+// PROXY protocol header (haproxy.org/download/2.0/doc/proxy-protocol.txt):
+// the addresses of the client connection, sent to the target before the
+// relayed data, so the target sees the client rather than the proxy. The
+// text version 1 is a line ("PROXY TCP4 <src> <dst> <sport> <dport>\r\n"),
+// the binary version 2 starts with the 12 bytes signature.
+//
+// Note: The addresses are unknown (ss_family 0) for the clients of the Unix
+// socket, and for the LOCAL (health check) connections of the balancer.
+//
+struct ProxyHeader
+{
+    sockaddr_storage source{};          // Client address
+    sockaddr_storage dest{};            // Address the client connected to
+
+    // Set the addresses of the connection (the IPv4-mapped ones as IPv4).
+    // The addresses not of the same IP family are unknown.
+    void Set(const sockaddr_storage& src, const sockaddr_storage& dst);
+
+    // Format the header of the version (1 or 2). Returns its length, or 0 if
+    // the buffer is too small.
+    size_t Format(int version, unsigned char* buf, size_t size) const;
+
+    // Parse the header (either version) at the start of the data. Returns
+    // its length, 0 if more data is needed, or -1 if it's invalid.
+    int Parse(const unsigned char* data, size_t len);
+
+private:
+    int ParseV1(const unsigned char* data, size_t len);
+    int ParseV2(const unsigned char* data, size_t len);
+};
+
+#endif // __PROXY_PROTO__
@@ -0,0 +1,139 @@
+//
+//  ratelimit.cpp
+//
+#include <stdio.h>
+#include <new>              // std::nothrow
+#include "ratelimit.h"
+#include "log.h"
+
+const size_t MIN_SOURCE_BUCKETS = 256;  // Initial number of hash buckets
+
+void TokenBucket::Refill(uint64_t now_ms)
+{
+    // Note: The credit is kept in 1/1000 of a byte (a byte per second adds
+    // 1 per ms), so the low rates don't lose the fractions on the frequent
+    // refills.
+    if(now_ms <= last_ms)
+        return;
+    
+    uint64_t max_credit = rate * 1000;
+    uint64_t elapsed = now_ms - last_ms;
+    last_ms = now_ms;
+    credit = (elapsed >= 1000 || credit + elapsed * rate >= max_credit ? max_credit : credit + elapsed * rate);
+}
+
+CSourceCounts::~CSourceCounts()
+{
+    for(size_t i = 0; i < bucket_count; i++)
+    {
+        while(buckets[i] != nullptr)
+        {
+            Entry* e = buckets[i];
+            buckets[i] = e->next;
+            delete e;
+        }
+    }
+    delete [] buckets;
+}
+
+size_t CSourceCounts::Hash(const void* route, const IpAddr& addr)
+{
+    // Note: The low bits of the route pointer are the same (alignment)
+    return (addr.Hash() ^ ((size_t)route >> 4)) * 16777619u;
+}
+
+size_t CSourceCounts::Get(const void* route, const IpAddr& addr) const
+{
+    if(bucket_count == 0)
+        return 0;
+    
+    for(const Entry* e = buckets[Hash(route, addr) & (bucket_count - 1)]; e != nullptr; e = e->next)
+    {
+        if(e->route == route && e->addr == addr)
+            return e->count;
+    }
+    return 0;
+}
+
+bool CSourceCounts::Add(const void* route, const IpAddr& addr)
+{
+    if(bucket_count > 0)
+    {
+        for(Entry* e = buckets[Hash(route, addr) & (bucket_count - 1)]; e != nullptr; e = e->next)
+        {
+            if(e->route == route && e->addr == addr)
+            {
+                e->count++;
+                return true;
+            }
+        }
+    }
+    
+    // New source. Keep the load factor at most 1 entry per bucket
+    if(count + 1 > bucket_count && !Rehash(count + 1))
+        return false;
+    
+    Entry* e = new (std::nothrow) Entry;
+    if(e == nullptr)
+    {
+        LOG_ERROR("%s: Out of memory: entry is NULL\n", __func__);
+        return false;
+    }
+    
+    size_t i = Hash(route, addr) & (bucket_count - 1);
+    e->route = route;
+    e->addr = addr;
+    e->count = 1;
+    e->next = buckets[i];
+    buckets[i] = e;
+    count++;
+    return true;
+}
+
+void CSourceCounts::Remove(const void* route, const IpAddr& addr)
+{
+    if(bucket_count == 0)
+        return;
+    
+    Entry** p = &buckets[Hash(route, addr) & (bucket_count - 1)];
+    while(*p != nullptr && !((*p)->route == route && (*p)->addr == addr))
+        p = &(*p)->next;
+    if(*p == nullptr || --(*p)->count > 0)
+        return;
+    
+    // The last session of the source
+    Entry* e = *p;
+    *p = e->next;
+    delete e;
+    count--;
+}
+
+bool CSourceCounts::Rehash(size_t new_count)
+{
+    size_t new_bucket_count = (bucket_count > 0 ? bucket_count : MIN_SOURCE_BUCKETS);
+    while(new_bucket_count < new_count)
+        new_bucket_count *= 2;
+    
+    Entry** new_buckets = new (std::nothrow) Entry*[new_bucket_count]();
+    if(new_buckets == nullptr)
+    {
+        LOG_ERROR("%s: Out of memory: new_bucket_count=%zu\n", __func__, new_bucket_count);
+        return false;
+    }
+    
+    for(size_t i = 0; i < bucket_count; i++)
+    {
+        while(buckets[i] != nullptr)
+        {
+            Entry* e = buckets[i];
+            buckets[i] = e->next;
+            size_t k = Hash(e->route, e->addr) & (new_bucket_count - 1);
+            e->next = new_buckets[k];
+            new_buckets[k] = e;
+        }
+    }
+    delete [] buckets;
+    buckets = new_buckets;
+    bucket_count = new_bucket_count;
+    return true;
+}
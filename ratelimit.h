@@ -0,0 +1,95 @@
+//
+//  ratelimit.h
+//
+#ifndef __RATE_LIMIT__
+#define __RATE_LIMIT__
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // uint64_t
+#include "ipaddr.h"
+
+//
+// Token bucket of the bytes relayed. The bucket is refilled at the rate
+// (bytes per second) up to its size (one second worth of the rate), and
+// the bytes read are taken out of it. Once it's empty, the reader stops
+// until the bucket has refilled a part of it (see WaitMs).
+//
+// Note: Not thread safe, every worker has its own copy of the routes
+// with their buckets.
+//
+struct TokenBucket
+{
+    uint64_t rate{0};                   // Bytes per second (0 - no limit)
+    uint64_t credit{0};                 // Bytes available now, 1/1000 of a byte
+    uint64_t last_ms{0};                // Refilled up to the time, ms
+
+    void Init(uint64_t bytes_per_sec, uint64_t now_ms)
+    {
+        rate = bytes_per_sec;
+        credit = rate * 1000;
+        last_ms = now_ms;
+    }
+
+    // The number of bytes that can be read now
+    size_t Available(uint64_t now_ms)
+    {
+        if(rate == 0)
+            return SIZE_MAX;
+        Refill(now_ms);
+        return (size_t)(credit / 1000);
+    }
+
+    void Consume(size_t n)
+    {
+        credit = ((uint64_t)n * 1000 < credit ? credit - (uint64_t)n * 1000 : 0);
+    }
+
+    // Time to wait until the empty bucket has refilled 1/8 of its size, ms
+    uint64_t WaitMs() const
+    {
+        uint64_t need = (rate >= 8 ? rate / 8 : 1) * 1000;
+        return (credit >= need ? 0 : (need - credit + rate - 1) / rate);
+    }
+
+private:
+    void Refill(uint64_t now_ms);
+};
+
+//
+// The number of sessions per source address of a route. The counts are
+// hashed by the route and the address, and removed once they drop to
+// zero, so only the sources with the sessions open take the memory.
+//
+// Note: Not thread safe, every worker counts its own sessions.
+//
+class CSourceCounts
+{
+public:
+    CSourceCounts() = default;
+    CSourceCounts(const CSourceCounts&) = delete;
+    CSourceCounts& operator=(const CSourceCounts&) = delete;
+    ~CSourceCounts();
+
+    // Note: The route is only the key, it's never dereferenced
+    size_t Get(const void* route, const IpAddr& addr) const;
+    bool Add(const void* route, const IpAddr& addr);    // Returns false if out of memory
+    void Remove(const void* route, const IpAddr& addr);
+
+private:
+    struct Entry
+    {
+        const void* route{nullptr};
+        IpAddr addr;
+        size_t count{0};
+        Entry* next{nullptr};           // Next entry in the hash bucket
+    };
+
+    static size_t Hash(const void* route, const IpAddr& addr);
+    bool Rehash(size_t new_count);
+
+    Entry** buckets{nullptr};           // Hash buckets (power of 2)
+    size_t bucket_count{0};
+    size_t count{0};                    // The number of entries
+};
+
+#endif // __RATE_LIMIT__
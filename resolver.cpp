@@ -0,0 +1,306 @@
+//
+//  resolver.cpp
+//
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>          // O_NONBLOCK
+#include <netdb.h>          // getaddrinfo
+#include <new>              // std::nothrow
+#include "resolver.h"
+#include "log.h"
+
+const int RETRY_INTERVAL = 5;       // Retry failed resolution in 5 seconds
+
+CResolver::CResolver(int refresh_sec) : refresh(refresh_sec)
+{
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&cond, nullptr);
+}
+
+CResolver::~CResolver()
+{
+    Stop();
+
+    for(int fd : notify_fds)
+    {
+        if(fd >= 0)
+            close(fd);
+    }
+
+    while(hosts != nullptr)
+    {
+        Host* h = hosts;
+        hosts = h->next;
+        delete h;
+    }
+
+    while(results != nullptr)
+    {
+        ResultNode* r = results;
+        results = r->next;
+        delete r;
+    }
+
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+bool CResolver::Start()
+{
+    // Make a pipe to notify the event loop on the results. Note: Both ends
+    // are non-blocking, so the resolver never blocks on the full pipe.
+    if(pipe(notify_fds) < 0)
+    {
+        LOG_ERROR("%s: pipe error: %s\n", __func__, strerror(errno));
+        notify_fds[0] = notify_fds[1] = -1;
+        return false;
+    }
+
+    for(int fd : notify_fds)
+    {
+        int n = fcntl(fd, F_GETFL);
+        if(n < 0 || fcntl(fd, F_SETFL, n | O_NONBLOCK) < 0)
+        {
+            LOG_ERROR("%s: fcntl(O_NONBLOCK) error: %s\n", __func__, strerror(errno));
+            return false;
+        }
+    }
+
+    int err = pthread_create(&thread, nullptr, &CResolver::Thread, this);
+    if(err != 0)
+    {
+        LOG_ERROR("%s: pthread_create error: %s\n", __func__, strerror(err));
+        return false;
+    }
+    running = true;
+    return true;
+}
+
+void CResolver::Stop()
+{
+    if(!running)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    stop = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    // Note: The thread may be in getaddrinfo() that can't be interrupted,
+    // so it may take up to the resolver timeout to join.
+    pthread_join(thread, nullptr);
+    running = false;
+}
+
+bool CResolver::Add(const char* host)
+{
+    if(host == nullptr || *host == '\0' || strlen(host) > HOST_NAME_MAX)
+        return false;
+
+    pthread_mutex_lock(&mutex);
+
+    Host* h = FindHost(host);
+    if(h != nullptr)
+    {
+        // Already resolved (or pending). Note: The cached address goes to
+        // the new targets of the host, the old ones already have it.
+        if(h->ip[0] != '\0')
+            PushResult(h);
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    h = new (std::nothrow) Host;
+    if(h == nullptr)
+    {
+        pthread_mutex_unlock(&mutex);
+        LOG_ERROR("%s: Out of memory: host is NULL\n", __func__);
+        return false;
+    }
+
+    // Resolve it as soon as possible
+    strcpy(h->name, host);
+    h->next = hosts;
+    hosts = h;
+    pthread_cond_signal(&cond);
+
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+void CResolver::Remove(const char* host)
+{
+    pthread_mutex_lock(&mutex);
+    for(Host** next = &hosts; *next != nullptr; next = &(*next)->next)
+    {
+        if(strcmp((*next)->name, host) == 0)
+        {
+            Host* h = *next;
+            *next = h->next;
+            delete h;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+bool CResolver::GetResult(Result& result)
+{
+    // Drain the notify pipe. Note: Results are queued before the pipe is
+    // written, so all of them are seen after the pipe is drained.
+    char buf[64];
+    while(read(notify_fds[0], buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock(&mutex);
+    ResultNode* r = results;
+    if(r != nullptr)
+    {
+        results = r->next;
+        if(results == nullptr)
+            results_tail = nullptr;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if(r == nullptr)
+        return false;
+
+    result = r->result;
+    delete r;
+    return true;
+}
+
+void* CResolver::Thread(void* arg)
+{
+    ((CResolver*)arg)->Run();
+    return nullptr;
+}
+
+void CResolver::Run()
+{
+    pthread_mutex_lock(&mutex);
+    while(!stop)
+    {
+        // Find the host to resolve next
+        Host* next = nullptr;
+        for(Host* h = hosts; h != nullptr; h = h->next)
+        {
+            if(h->next_time >= 0 && (next == nullptr || h->next_time < next->next_time))
+                next = h;
+        }
+
+        time_t now = time(nullptr);
+        if(next == nullptr || next->next_time > now)
+        {
+            // Wait for the host refresh time, new host or stop
+            if(next == nullptr)
+            {
+                pthread_cond_wait(&cond, &mutex);
+            }
+            else
+            {
+                timespec ts{next->next_time, 0};
+                pthread_cond_timedwait(&cond, &mutex, &ts);
+            }
+            continue;
+        }
+
+        // Resolve without holding the lock. Note: The host may be removed
+        // in the meanwhile, so look it up again by name afterwards.
+        char name[HOST_NAME_MAX+1]{};
+        strcpy(name, next->name);
+        pthread_mutex_unlock(&mutex);
+
+        char ip[INET6_ADDRSTRLEN]{};
+        bool res = Resolve(name, ip, sizeof(ip));
+
+        pthread_mutex_lock(&mutex);
+        Host* h = FindHost(name);
+        if(h == nullptr)
+            continue;
+
+        now = time(nullptr);
+        if(!res)
+        {
+            // Keep the cached address (if any) and retry soon
+            h->next_time = now + (refresh > 0 && refresh < RETRY_INTERVAL ? refresh : RETRY_INTERVAL);
+            continue;
+        }
+
+        // Note: Resolve once if refresh is disabled (-1 is never)
+        h->next_time = (refresh > 0 ? now + refresh : -1);
+        if(strcmp(h->ip, ip) != 0)
+        {
+            LOG_INFO("%s: %s resolved to %s%s%s\n", __func__, name, ip,
+                     (h->ip[0] != '\0' ? ", was " : ""), h->ip);
+            strcpy(h->ip, ip);
+            PushResult(h);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+bool CResolver::Resolve(const char* host, char* ip, size_t ip_size)
+{
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;        // Allow IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM;    // TCP (connection-based protocol)
+
+    addrinfo* addr = nullptr;
+    int status = getaddrinfo(host, nullptr, &hints, &addr);
+    if(status != 0)
+    {
+        LOG_ERROR("%s: getaddrinfo(%s) error: %s\n", __func__, host, gai_strerror(status));
+        return false;
+    }
+
+    // Note: getaddrinfo() returns a list of address structures
+    // Get first AF_INET or AF_INET6 addr.
+    bool res = false;
+    for(const addrinfo* next = addr; next && !res; next = next->ai_next)
+    {
+        if(next->ai_family == AF_INET)
+            res = (inet_ntop(AF_INET, &((sockaddr_in*)next->ai_addr)->sin_addr, ip, ip_size) != nullptr);
+        else if(next->ai_family == AF_INET6)
+            res = (inet_ntop(AF_INET6, &((sockaddr_in6*)next->ai_addr)->sin6_addr, ip, ip_size) != nullptr);
+    }
+    freeaddrinfo(addr);
+
+    if(!res)
+        LOG_ERROR("%s: No IPv4 nor IPv6 addresses available for '%s'\n", __func__, host);
+    return res;
+}
+
+CResolver::Host* CResolver::FindHost(const char* host) const
+{
+    Host* h = hosts;
+    while(h != nullptr && strcmp(h->name, host) != 0)
+        h = h->next;
+    return h;
+}
+
+void CResolver::PushResult(const Host* h)
+{
+    ResultNode* r = new (std::nothrow) ResultNode;
+    if(r == nullptr)
+    {
+        LOG_ERROR("%s: Out of memory: result is NULL\n", __func__);
+        return;
+    }
+
+    strcpy(r->result.host, h->name);
+    strcpy(r->result.ip, h->ip);
+    if(results_tail != nullptr)
+        results_tail->next = r;
+    else
+        results = r;
+    results_tail = r;
+
+    // Wake up the event loop. Note: The full pipe is fine, it's readable.
+    char c = 1;
+    if(write(notify_fds[1], &c, 1) < 0 && errno != EAGAIN)
+        LOG_ERROR("%s: write error: %s\n", __func__, strerror(errno));
+}
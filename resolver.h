@@ -0,0 +1,86 @@
+//
+//  resolver.h
+//
+#ifndef __RESOLVER__
+#define __RESOLVER__
+
+#include <arpa/inet.h>      // INET6_ADDRSTRLEN
+#include <limits.h>         // HOST_NAME_MAX
+#include <pthread.h>
+#include <time.h>
+
+//
+// Asynchronous host name resolver. Host names are resolved with the
+// blocking getaddrinfo() on the resolver thread, so a slow DNS server
+// doesn't stall the event loop. The resolved addresses are cached and
+// refreshed periodically, and the new (changed) addresses are queued
+// as the results. The notify pipe becomes readable when there are the
+// results to get.
+//
+// Note: getaddrinfo() doesn't report the record TTL, so the cache entries
+// are refreshed by the configured interval instead.
+//
+class CResolver
+{
+public:
+    struct Result
+    {
+        char host[HOST_NAME_MAX+1]{};
+        char ip[INET6_ADDRSTRLEN]{};       // The first IPv4 or IPv6 address
+    };
+
+    // Refresh the resolved addresses every refresh_sec seconds (0 - never)
+    CResolver(int refresh_sec);
+    ~CResolver();
+
+    bool Start();
+    void Stop();
+
+    // Read end of the notify pipe to add to the event loop
+    int GetFd() const { return notify_fds[0]; }
+
+    // Add host to resolve and refresh. If the host is already resolved,
+    // the cached address is queued as the result right away.
+    bool Add(const char* host);
+
+    // Stop refreshing the host (no longer used)
+    void Remove(const char* host);
+
+    // Get the next result (called when the notify pipe is readable)
+    bool GetResult(Result& result);
+
+private:
+    struct Host
+    {
+        char name[HOST_NAME_MAX+1]{};
+        char ip[INET6_ADDRSTRLEN]{};       // Cached address (empty if not resolved yet)
+        time_t next_time{0};               // When to resolve next time
+        Host* next{nullptr};
+    };
+
+    struct ResultNode
+    {
+        Result result;
+        ResultNode* next{nullptr};
+    };
+
+    static void* Thread(void* arg);
+    void Run();
+    bool Resolve(const char* host, char* ip, size_t ip_size);
+    Host* FindHost(const char* host) const;
+    void PushResult(const Host* h);       // Note: mutex must be locked
+
+    int refresh{0};                        // Refresh interval, seconds
+    int notify_fds[2]{-1, -1};             // Notify pipe (read/write ends)
+    pthread_t thread;
+    bool running{false};                   // Is resolver thread started?
+    bool stop{false};                      // Tell resolver thread to exit
+
+    pthread_mutex_t mutex;                 // Protects all below
+    pthread_cond_t cond;                   // Signaled on new host or stop
+    Host* hosts{nullptr};                  // Hosts to resolve (the cache)
+    ResultNode* results{nullptr};          // Queue of the results
+    ResultNode* results_tail{nullptr};
+};
+
+#endif // __RESOLVER__
@@ -0,0 +1,157 @@
+//
+//  routetable.cpp
+//
+#include <stdio.h>
+#include "tcproxy.h"
+
+const size_t MIN_ROUTE_BUCKETS = 64;    // Initial number of hash buckets
+
+bool CTcpProxy::RouteTable::Insert(Route* rt)
+{
+    const IpAddr& addr = rt->source_addr;
+    
+    if(rt->source_prefix_len < addr.Len() * 8)
+    {
+        // CIDR route
+        CPrefixTrie& trie = (addr.family == AF_INET ? trie4 : trie6);
+        if(!trie.Insert(addr.bytes, rt->source_prefix_len, rt))
+            return false;
+    }
+    else
+    {
+        // Host route. Keep the load factor at most 1 route per bucket
+        if(host_count + 1 > bucket_count && !Rehash(host_count + 1))
+            return false;
+        
+        // Add to the hash bucket
+        size_t i = addr.Hash() & (bucket_count - 1);
+        rt->hash_next = buckets[i];
+        buckets[i] = rt;
+        host_count++;
+    }
+    
+    // Add to the list of all routes
+    rt->next = list;
+    list = rt;
+    count++;
+    return true;
+}
+
+void CTcpProxy::RouteTable::Remove(Route* rt)
+{
+    const IpAddr& addr = rt->source_addr;
+    
+    if(rt->source_prefix_len < addr.Len() * 8)
+    {
+        // CIDR route
+        CPrefixTrie& trie = (addr.family == AF_INET ? trie4 : trie6);
+        trie.Remove(addr.bytes, rt->source_prefix_len);
+    }
+    else if(bucket_count > 0)
+    {
+        // Host route
+        Route** p = &buckets[addr.Hash() & (bucket_count - 1)];
+        while(*p != nullptr && *p != rt)
+            p = &(*p)->hash_next;
+        if(*p != nullptr)
+        {
+            *p = rt->hash_next;
+            host_count--;
+        }
+    }
+    
+    // Remove from the list of all routes
+    Route** p = &list;
+    while(*p != nullptr && *p != rt)
+        p = &(*p)->next;
+    if(*p != nullptr)
+    {
+        *p = rt->next;
+        count--;
+    }
+    rt->next = nullptr;
+    rt->hash_next = nullptr;
+}
+
+CTcpProxy::Route* CTcpProxy::RouteTable::Find(const IpAddr& addr, int prefix_len) const
+{
+    if(prefix_len < addr.Len() * 8)
+    {
+        const CPrefixTrie& trie = (addr.family == AF_INET ? trie4 : trie6);
+        return (Route*)trie.Find(addr.bytes, prefix_len);
+    }
+    
+    if(bucket_count == 0)
+        return nullptr;
+    
+    Route* rt = buckets[addr.Hash() & (bucket_count - 1)];
+    while(rt != nullptr)
+    {
+        if(rt->source_addr == addr)
+            break;
+        rt = rt->hash_next;
+    }
+    return rt;
+}
+
+CTcpProxy::Route* CTcpProxy::RouteTable::Match(const IpAddr& addr) const
+{
+    // Host route is the longest prefix, so check it first
+    Route* rt = Find(addr, addr.Len() * 8);
+    if(rt != nullptr)
+        return rt;
+    
+    const CPrefixTrie& trie = (addr.family == AF_INET ? trie4 : trie6);
+    return (Route*)trie.Match(addr.bytes);
+}
+
+void CTcpProxy::RouteTable::Clear()
+{
+    Route* rt = list;
+    while(rt != nullptr)
+    {
+        Route* rt_next = rt->next;
+        delete rt;
+        rt = rt_next;
+    }
+    
+    delete [] buckets;
+    buckets = nullptr;
+    bucket_count = 0;
+    host_count = 0;
+    list = nullptr;
+    count = 0;
+    trie4.Clear();
+    trie6.Clear();
+}
+
+bool CTcpProxy::RouteTable::Rehash(size_t new_count)
+{
+    size_t new_bucket_count = (bucket_count > 0 ? bucket_count : MIN_ROUTE_BUCKETS);
+    while(new_bucket_count < new_count)
+        new_bucket_count *= 2;
+    
+    Route** new_buckets = new (std::nothrow) Route*[new_bucket_count]();
+    if(new_buckets == nullptr)
+    {
+        LOG_ERROR("%s: Out of memory: new_bucket_count=%zu\n", __func__, new_bucket_count);
+        return false;
+    }
+    
+    // Re-insert all host routes into the new buckets
+    for(Route* rt = list; rt != nullptr; rt = rt->next)
+    {
+        if(rt->source_prefix_len < rt->source_addr.Len() * 8)
+            continue; // CIDR route
+        
+        size_t i = rt->source_addr.Hash() & (new_bucket_count - 1);
+        rt->hash_next = new_buckets[i];
+        new_buckets[i] = rt;
+    }
+    
+    delete [] buckets;
+    buckets = new_buckets;
+    bucket_count = new_bucket_count;
+    return true;
+}
+
@@ -0,0 +1,104 @@
+//
+//  slab.h
+//
+#ifndef __SLAB__
+#define __SLAB__
+
+#include <stddef.h>         // size_t
+#include <new>              // std::nothrow, placement new
+
+//
+// Slab allocator of the objects of the same type. The objects are carved
+// out of the chunks of CHUNK_SIZE objects each, so they sit densely in
+// memory instead of all over the heap, and allocation/free is O(1) from
+// the free list. More chunks are added as the number of objects grows.
+//
+// Note: The chunks are never moved, so the pointers to the objects stay
+// valid (they are linked into the intrusive lists and the timer wheel).
+// The free chunks are kept for reuse until the slab is destroyed. Not
+// thread safe, every worker has its own slab.
+//
+template<typename T, size_t CHUNK_SIZE = 256>
+class CSlab
+{
+    union Slot
+    {
+        Slot* next;                        // Next free slot
+        alignas(T) unsigned char object[sizeof(T)];
+    };
+
+    struct Chunk
+    {
+        Slot slots[CHUNK_SIZE];
+        Chunk* next{nullptr};
+    };
+
+public:
+    CSlab() = default;
+    CSlab(const CSlab&) = delete;
+    CSlab& operator=(const CSlab&) = delete;
+
+    // Note: The objects still allocated are not destroyed
+    ~CSlab()
+    {
+        while(chunks != nullptr)
+        {
+            Chunk* c = chunks;
+            chunks = c->next;
+            delete c;
+        }
+    }
+
+    // Construct a new object, nullptr if out of memory
+    T* Alloc()
+    {
+        if(free_slots == nullptr && !Grow())
+            return nullptr;
+
+        Slot* s = free_slots;
+        free_slots = s->next;
+        count++;
+        return new (s->object) T;
+    }
+
+    void Free(T* obj)
+    {
+        if(obj == nullptr)
+            return;
+
+        obj->~T();
+        Slot* s = (Slot*)obj;
+        s->next = free_slots;
+        free_slots = s;
+        count--;
+    }
+
+    size_t Count() const { return count; }                          // Objects allocated
+    size_t Capacity() const { return chunk_count * CHUNK_SIZE; }    // Objects fit in the chunks
+
+private:
+    bool Grow()
+    {
+        Chunk* c = new (std::nothrow) Chunk;
+        if(c == nullptr)
+            return false;
+
+        // Note: Link the slots in order, so the objects are allocated
+        // from the start of the chunk
+        for(size_t i = 0; i < CHUNK_SIZE; i++)
+            c->slots[i].next = (i + 1 < CHUNK_SIZE ? &c->slots[i + 1] : free_slots);
+        free_slots = &c->slots[0];
+
+        c->next = chunks;
+        chunks = c;
+        chunk_count++;
+        return true;
+    }
+
+    Chunk* chunks{nullptr};                // All chunks
+    Slot* free_slots{nullptr};             // Free slots of all chunks
+    size_t chunk_count{0};                 // The number of chunks
+    size_t count{0};                       // The number of objects allocated
+};
+
+#endif // __SLAB__
@@ -0,0 +1,48 @@
+//
+//  stats.cpp
+//
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <new>              // std::nothrow
+#include "stats.h"
+#include "log.h"
+
+const uint64_t STAT_LATENCY_BOUNDS[STAT_LATENCY_BUCKETS-1] =
+    {1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000};
+
+bool TextBuffer::Printf(const char* fmt, ...)
+{
+    while(true)
+    {
+        va_list args;
+        va_start(args, fmt);
+        int n = (size > len ? vsnprintf(data + len, size - len, fmt, args) : 0);
+        va_end(args);
+
+        if(n < 0)
+            return false;
+        if(size > len && (size_t)n < size - len)
+        {
+            len += n;
+            return true;
+        }
+
+        // Grow the buffer and format again
+        size_t new_size = (size > 0 ? size * 2 : 4096);
+        while(new_size < len + n + 1)
+            new_size *= 2;
+
+        char* new_data = new (std::nothrow) char[new_size];
+        if(new_data == nullptr)
+        {
+            LOG_ERROR("%s: Out of memory: new_size=%zu\n", __func__, new_size);
+            return false;
+        }
+        if(len > 0)
+            memcpy(new_data, data, len);
+        delete [] data;
+        data = new_data;
+        size = new_size;
+    }
+}
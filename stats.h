@@ -0,0 +1,122 @@
+//
+//  stats.h
+//
+#ifndef __STATS__
+#define __STATS__
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // uint64_t
+#include <atomic>
+
+//
+// Counter updated by its worker thread only, and read by the thread that
+// collects the stats. The update is a plain load and store (not a locked
+// read-modify-write), so it costs the same as the non-atomic one.
+//
+// Note: The counters are copied by value with the structures they are in
+// (i.e. the routes copied to the workers).
+//
+struct StatCounter
+{
+    StatCounter() = default;
+    StatCounter(const StatCounter& other) : value(other.Get()) {}
+    StatCounter& operator=(const StatCounter& other) { value.store(other.Get(), std::memory_order_relaxed); return *this; }
+
+    void Add(uint64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void Sub(uint64_t n) { value.store(value.load(std::memory_order_relaxed) - n, std::memory_order_relaxed); }
+    uint64_t Get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+// Histogram of the latencies, ms (or us, see the user). The last bucket is +Inf
+#define STAT_LATENCY_BUCKETS 14
+extern const uint64_t STAT_LATENCY_BOUNDS[STAT_LATENCY_BUCKETS-1];
+
+struct StatHistogram
+{
+    StatCounter buckets[STAT_LATENCY_BUCKETS];  // Note: Not cumulative
+    StatCounter sum;                            // Sum of the values
+    StatCounter count;
+
+    void Add(uint64_t value)
+    {
+        int i = 0;
+        while(i < STAT_LATENCY_BUCKETS - 1 && value > STAT_LATENCY_BOUNDS[i])
+            i++;
+        buckets[i].Add(1);
+        sum.Add(value);
+        count.Add(1);
+    }
+};
+
+// Traffic of the route's target (per worker)
+struct TargetStats
+{
+    StatCounter sessions_active;           // Sessions open now
+    StatCounter sessions_total;            // Sessions ever open
+    StatCounter bytes_in;                  // Bytes from the sources to the target
+    StatCounter bytes_out;                 // Bytes from the target to the sources
+    StatCounter connect_errors;            // Failed or timed out connects
+    StatCounter ejections;                 // Ejected after consecutive connect errors
+    StatHistogram connect_latency;         // Connect time of the completed connects, ms
+
+    // Take over the counters of the target of the replaced route, so they
+    // go on from there (see CTcpProxy::SetRoute). Note: The sessions still
+    // open are counted by the old one until closed, and then merged.
+    void TakeOver(TargetStats& old)
+    {
+        Merge(old);
+        uint64_t active = old.sessions_active.Get();
+        old = TargetStats();
+        old.sessions_active.Add(active);
+    }
+
+    void Merge(const TargetStats& old)
+    {
+        StatCounter* counters[] = {&sessions_total, &bytes_in, &bytes_out, &connect_errors, &ejections,
+                                   &connect_latency.sum, &connect_latency.count};
+        const StatCounter* old_counters[] = {&old.sessions_total, &old.bytes_in, &old.bytes_out, &old.connect_errors,
+                                             &old.ejections, &old.connect_latency.sum, &old.connect_latency.count};
+        for(size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+            counters[i]->Add(old_counters[i]->Get());
+        for(int i = 0; i < STAT_LATENCY_BUCKETS; i++)
+            connect_latency.buckets[i].Add(old.connect_latency.buckets[i].Get());
+    }
+};
+
+// Stats of the worker not related to the routes
+struct WorkerStats
+{
+    StatCounter accepted;                  // Connections accepted
+    StatCounter rejected;                  // Connections closed with no route or target
+    StatCounter limited;                   // Connections closed by the route's session limits
+    StatHistogram loop_dispatch;           // Dispatch time of the event loop iterations, us (see loop_histogram)
+};
+
+//
+// Growing text buffer to format the stats into
+//
+struct TextBuffer
+{
+    char* data{nullptr};
+    size_t size{0};
+    size_t len{0};
+
+    TextBuffer() = default;
+    TextBuffer(const TextBuffer&) = delete;
+    TextBuffer& operator=(const TextBuffer&) = delete;
+    ~TextBuffer() { delete [] data; }
+
+    // Append formatted text. Returns false if out of memory.
+    bool Printf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    // Free the data
+    void Clear() { delete [] data; data = nullptr; size = len = 0; }
+    
+    // Take the data out (the caller deletes it), the buffer is empty then
+    char* Detach() { char* p = data; data = nullptr; size = len = 0; return p; }
+};
+
+#endif // __STATS__
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>    // TCP_NODELAY and other TCP_* options
 #include <netdb.h>
 #include <memory.h>
 #include <errno.h>
@@ -17,22 +18,88 @@
 #include <signal.h>
 #include <sys/time.h>       // gettimeofday
 #include <time.h>           // localtime
+#include <sys/resource.h>   // getrlimit
+#include <sched.h>          // sched_getaffinity
 #include "tcproxy.h"
 
-const int MAX_LISTEN_BACKLOG = 100;
+const int MAX_EVENTS = 256;         // Max number of events to handle per loop iteration
+const int MIN_CALLBACKS = 64;       // Initial size of callbacks array
+const int MAX_WORKERS = 1024;       // Max number of workers (event loops)
+const unsigned int TIMER_TICK_MS = 10; // Resolution of the session timers
 
 const char* CONFIG_NAME_PORT  = "port:";
+const char* CONFIG_NAME_LISTEN = "listen:";
+const char* LISTEN_OPTION_PROXY_PROTOCOL = "proxy_protocol"; // listen: <address> proxy_protocol
+const char* CONFIG_NAME_LISTEN_BACKLOG = "listen_backlog:";
+const char* CONFIG_NAME_ACCEPT_BATCH = "accept_batch:";
+const char* CONFIG_NAME_TCP_FASTOPEN = "tcp_fastopen:";
+const char* CONFIG_NAME_DEFER_ACCEPT = "defer_accept:";
+const char* CONFIG_NAME_SOCKET_OPTIONS = "socket_options:";
 const char* CONFIG_NAME_ROUTE = "route:";
+const char* CONFIG_NAME_EVENT_LOOP = "event_loop:";
+const char* CONFIG_NAME_BUFFER_SIZE = "buffer_size:";
+const char* CONFIG_NAME_RELAY = "relay:";
+const char* CONFIG_NAME_WORKERS = "workers:";
+const char* CONFIG_NAME_CPU_AFFINITY = "cpu_affinity:";
+const char* CONFIG_NAME_LOOP_HISTOGRAM = "loop_histogram:";
+const char* CONFIG_NAME_DNS_REFRESH = "dns_refresh:";
+const char* CONFIG_NAME_CONNECT_TIMEOUT = "connect_timeout:";
+const char* CONFIG_NAME_IDLE_TIMEOUT = "idle_timeout:";
+const char* CONFIG_NAME_MAX_LIFETIME = "max_lifetime:";
+const char* CONFIG_NAME_DRAIN_TIMEOUT = "drain_timeout:";
+const char* CONFIG_NAME_HEALTH_CHECK = "health_check:";
+const char* CONFIG_NAME_MAX_FAILS = "max_fails:";
+const char* CONFIG_NAME_EJECT_TIME = "eject_time:";
+const char* CONFIG_NAME_LOG_LEVEL = "log_level:";
+const char* CONFIG_NAME_LOG_FORMAT = "log_format:";
+const char* CONFIG_NAME_LOG_RATE = "log_rate:";
+const char* CONFIG_NAME_METRICS = "metrics:";
+const char* CONFIG_NAME_ADMIN_SOCKET = "admin_socket:";
+
+// Route options: route: <source host> <target host>:<port> [name=value ...]
+const char* ROUTE_OPTION_BUFFER_SIZE = "buffer_size=";
+const char* ROUTE_OPTION_RELAY = "relay=";
+const char* ROUTE_OPTION_BALANCE = "balance=";
+const char* ROUTE_OPTION_POOL = "pool=";
+const char* ROUTE_OPTION_CONNECT_TIMEOUT = "connect_timeout=";
+const char* ROUTE_OPTION_IDLE_TIMEOUT = "idle_timeout=";
+const char* ROUTE_OPTION_MAX_LIFETIME = "max_lifetime=";
+const char* ROUTE_OPTION_DRAIN_TIMEOUT = "drain_timeout=";
+const char* ROUTE_OPTION_MAX_SESSIONS = "max_sessions=";
+const char* ROUTE_OPTION_MAX_SOURCE_SESSIONS = "max_source_sessions=";
+const char* ROUTE_OPTION_RATE_IN = "rate_in=";
+const char* ROUTE_OPTION_RATE_OUT = "rate_out=";
+const char* ROUTE_OPTION_NODELAY = "nodelay=";
+const char* ROUTE_OPTION_QUICKACK = "quickack=";
+const char* ROUTE_OPTION_RCVBUF = "rcvbuf=";
+const char* ROUTE_OPTION_SNDBUF = "sndbuf=";
+const char* ROUTE_OPTION_KEEPALIVE = "keepalive=";
+const char* ROUTE_OPTION_TOS = "tos=";
+const char* ROUTE_OPTION_FASTOPEN = "fastopen=";
+const char* ROUTE_OPTION_LISTEN = "listen=";
+const char* ROUTE_OPTION_PROXY_PROTOCOL = "proxy_protocol=";
+const char* ROUTE_SOURCE_DEFAULT = "default";   // Matches any client address
+
+const char* ADMIN_UPGRADE_SUFFIX = ".new";  // The admin socket of the new instance until the handoff
 
 const char* CMD_EXIT = "exit";
 const char* CMD_ROUTE  = "route:";
+const char* CMD_RESOLVED = "resolved:";     // Worker only: "resolved: <host> <ip>"
+const char* CMD_HEALTH = "health:";         // Worker only: "health: <host> <port> up|down"
+const char* CMD_BEGIN = "begin";            // The routes up to "commit" are applied at once
+const char* CMD_COMMIT = "commit";
+const char* CMD_REPLACE = "replace";        // Commit, and remove the routes not in the batch
+const char* CMD_ABORT = "abort";            // Drop the routes of the batch (see OnCommand)
+const char* CMD_STATS = "stats";            // Admin socket only: metrics in Prometheus text format
+const char* CMD_SESSIONS = "sessions";      // Admin socket only: the live sessions, one per line
+const char* CMD_RELOAD = "reload";          // Re-read the routes of the config file (see SIGHUP)
+const char* CMD_HANDOFF = "handoff";        // Admin socket only: Pass the listeners to the new instance
+const char* CMD_DRAIN = "drain";            // Stop accepting, and exit when the sessions are closed
+
+int CTcpProxy::signal_fds[2] = {-1, -1};
 
 CTcpProxy::CTcpProxy(const char* program_name, const char* config_file)
 {
-    // Set fdset to have zero bits for all file descriptors
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    
     // Writing to an unconnected socket will cause a process to receive a SIGPIPE
     // signal. We don't want to die if this happens, so we ignore SIGPIPE.
     signal(SIGPIPE, SIG_IGN);
@@ -49,159 +116,358 @@ CTcpProxy::CTcpProxy(const char* program_name, const char* config_file)
     // Remember config file name
     size_t len = sizeof(conf_name) - 1;
     strncpy(conf_name, config_file, len);
+    
+    // Note: Nagle's algorithm on the proxied small requests waits for the
+    // delayed ACK of the peer (up to 40 ms), so it's off by default
+    sock_opts.nodelay = 1;
 }
 
-CTcpProxy::~CTcpProxy()
+CTcpProxy::CTcpProxy(const CTcpProxy& parent, int id)
 {
-    // Delete routes
-    Route* rt = route;
-    while(rt != nullptr)
+    strcpy(base_name, parent.base_name);
+    strcpy(conf_name, parent.conf_name);
+    strcpy(loop_name, parent.loop_name);
+    listen_backlog = parent.listen_backlog;
+    accept_batch = parent.accept_batch;
+    tcp_fastopen = parent.tcp_fastopen;
+    defer_accept = parent.defer_accept;
+    sock_opts = parent.sock_opts;
+    buffer_size = parent.buffer_size;
+    relay = parent.relay;
+    worker_id = id;
+    worker_count = parent.worker_count;
+    cpu_affinity = parent.cpu_affinity;
+    loop_histogram = parent.loop_histogram;
+    dns_refresh = parent.dns_refresh;
+    connect_timeout = parent.connect_timeout;
+    idle_timeout = parent.idle_timeout;
+    max_lifetime = parent.max_lifetime;
+    drain_timeout = parent.drain_timeout;
+    max_fails = parent.max_fails;
+    eject_time = parent.eject_time;
+    
+    // Listen on the same addresses. Note: The worker takes the id-th of the
+    // sockets taken over for the address (if any).
+    listener_count = parent.listener_count;
+    for(int i = 0; i < listener_count; i++)
     {
-        Route* rt_next = rt->next;
-        delete rt;
-        rt = rt_next;
+        Listener& l = listeners[i];
+        memcpy(l.name, parent.listeners[i].name, sizeof(l.name));
+        l.addr = parent.listeners[i].addr;
+        l.addr_len = parent.listeners[i].addr_len;
+        l.dual_stack = parent.listeners[i].dual_stack;
+        l.proxy_protocol = parent.listeners[i].proxy_protocol;
+        l.inherited_fd = parent.InheritedFd(i, id);
     }
     
-    // Delete callbacks
-    for(int fd = 0; fd < FD_SETSIZE; fd++)
+    // Make a copy of the routes, so the worker can update its routes
+    // without locking. Route commands are forwarded to every worker.
+    for(const Route* rt = parent.FirstRoute(); rt != nullptr; rt = parent.NextRoute(rt))
     {
-        if(FD_ISSET(fd, &rfds) || FD_ISSET(fd, &wfds))
+        Route* new_route = new (std::nothrow) Route(*rt);
+        if(new_route == nullptr)
         {
-            CallbackRemove(fd);
-            close(fd);
+            LOG_ERROR("%s: Out of memory: new_route is NULL\n", __func__);
+            break;
+        }
+        new_route->sessions = nullptr;
+        new_route->session_count = 0;
+        for(Target& t : new_route->targets)
+        {
+            t.session_count = 0;
+            t.pool = nullptr;
+            t.pool_count = 0;
+        }
+        if(!listeners[rt->opts.listener].routes.Insert(new_route))
+        {
+            delete new_route;
+            break;
         }
     }
 }
 
-void CTcpProxy::CallbackAdd(int fd, int peer_fd, CALLBACK_FUNC read_fn, CALLBACK_FUNC write_fn)
+CTcpProxy::~CTcpProxy()
+{
+    // Stop workers (if any)
+    StopWorkers();
+    
+    // Stop resolver. Note: The resolver owns its notify pipe.
+    if(resolver != nullptr)
+    {
+        if(resolver->GetFd() >= 0 && resolver->GetFd() < cb_size)
+            CallbackRemove(resolver->GetFd());
+        delete resolver;
+    }
+    
+    // Delete callbacks (and the sessions)
+    for(int fd = 0; fd < cb_size; fd++)
+    {
+        if(cb[fd].read_fn != nullptr || cb[fd].write_fn != nullptr)
+            CloseSock(fd);
+    }
+    delete [] cb;
+    if(metrics_fd >= 0)
+        close(metrics_fd);
+    delete [] inherited_fds;
+    delete [] inherited_listeners;
+    while(probes != nullptr)
+    {
+        Probe* next = probes->next;
+        delete probes;
+        probes = next;
+    }
+    delete timers;
+    delete loop;
+}
+
+bool CTcpProxy::CallbackAdd(int fd, int peer_fd, CALLBACK_FUNC read_fn, CALLBACK_FUNC write_fn,
+                            int events, size_t buf_size)
 {
-    printf("%s: fd=%d\n", __func__, fd);
+    LOG_DEBUG("%s: fd=%d\n", __func__, fd);
     
-    assert(fd >= 0 && fd < FD_SETSIZE);
+    if(!CallbackReserve(fd))
+        return false;
     
     Callback& c = cb[fd];
     assert(c.read_fn == nullptr && c.write_fn == nullptr && c.peer_fd < 0 && c.len == 0);
     c.Reset();
     
+    // Register fd to be checked for readability/writability
+    if(!loop->Add(fd, events))
+        return false;
+    
+    // Note: The buffer of the data to write to fd is taken from the pool
+    // only when there is the data to write (see GetBuffer).
+    c.size = buf_size;
+    
     c.read_fn = read_fn;
     c.write_fn = write_fn;
     c.peer_fd = peer_fd;
+    c.events = events;
+    return true;
+}
+
+bool CTcpProxy::CallbackModify(int fd, int events)
+{
+    Callback* c = GetCallback(fd);
+    if(c == nullptr)
+        return false;
     
-    // Set fd to be checked for readability
-    if(c.read_fn != nullptr)
-        FD_SET(fd, &rfds);
+    if(c->events == events)
+        return true; // Nothing to change
     
-    // Set fd to be checked for writability
-    if(c.write_fn != nullptr)
-        FD_SET(fd, &wfds);
-
-    // Update highest-numbered file descriptor in set
-    if(fd > fd_max)
-        fd_max = fd;
-    if(peer_fd > fd_max)
-        fd_max = peer_fd;
+    if(!loop->Modify(fd, events))
+        return false;
+    
+    c->events = events;
+    return true;
 }
 
 void CTcpProxy::CallbackRemove(int fd)
 {
-    printf("%s: fd=%d\n", __func__, fd);
+    LOG_DEBUG("%s: fd=%d\n", __func__, fd);
     
-    assert(fd >= 0 && fd < FD_SETSIZE);
+    assert(fd >= 0 && fd < cb_size);
+    if(fd < 0 || fd >= cb_size)
+        return;
 
     Callback& c = cb[fd];
+    if(c.read_fn != nullptr || c.write_fn != nullptr)
+        loop->Remove(fd);
+    if(c.header != nullptr)
+    {
+        // Unlink the client waiting for its PROXY header
+        HeaderWait* w = c.header;
+        (w->prev != nullptr ? w->prev->next : header_waits) = w->next;
+        (w->next != nullptr ? w->next->prev : header_waits_tail) = w->prev;
+        delete w;
+    }
+    c.len = 0;
+    if(c.owned)
+        delete [] c.buf;
+    else
+        PutBuffer(&c);
     c.Reset();
-    
-    FD_CLR(fd, &rfds);
-    FD_CLR(fd, &wfds);
+}
 
-    // Update highest-numbered file descriptor in set
-    if(fd == fd_max)
+bool CTcpProxy::CallbackReserve(int fd)
+{
+    if(fd < 0)
+        return false;
+    
+    if(fd < cb_size)
+        return true;
+    
+    // Grow callbacks array to fit fd. Note: it invalidates any
+    // Callback pointers obtained before by GetCallback().
+    int new_size = (cb_size > 0 ? cb_size : MIN_CALLBACKS);
+    while(new_size <= fd)
+        new_size *= 2;
+    
+    Callback* new_cb = new (std::nothrow) Callback[new_size];
+    if(new_cb == nullptr)
     {
-        // Find the previous highest-numbered file descriptor
-        while(--fd_max > 0)
-        {
-            if(FD_ISSET(fd_max, &rfds) || FD_ISSET(fd_max, &wfds))
-                break;
-        }
-
-        // printf("#### old fd_max=%d, new fd_max=%d\n", fd, fd_max);
+        LOG_ERROR("%s: Out of memory: fd=%d, new_size=%d\n", __func__, fd, new_size);
+        return false;
     }
+    
+    for(int i = 0; i < cb_size; i++)
+        new_cb[i] = cb[i];
+    
+    delete [] cb;
+    cb = new_cb;
+    cb_size = new_size;
+    return true;
 }
 
 void CTcpProxy::CallbackSelect()
 {
-    // Note: select will change fd_set passed, so we need to make a copy
-    fd_set trfds = rfds;
-    fd_set twfds = wfds;
-
-    int n = select(fd_max + 1, &trfds, &twfds, nullptr, nullptr);
-    if(n < 0)
-    {
-        printf("select error: %s\n", strerror(errno));
-        return;
-    }
+    CEventLoop::Event events[MAX_EVENTS];
+    
+    // Wait until the next timer might expire (or forever if there are none).
+    // Note: The draining main worker checks the workers from time to time.
+    int timeout = timers->NextTimeout(now_ms);
+    if(draining && (timeout < 0 || timeout > DRAIN_CHECK_MS))
+        timeout = DRAIN_CHECK_MS;
+    // Note: The loop mutex is released while waiting, so the other threads
+    // see the sessions of the worker consistent (see FormatSessions)
+    pthread_mutex_unlock(&loop_mutex);
+    int n = loop->Wait(events, MAX_EVENTS, timeout);
+    pthread_mutex_lock(&loop_mutex);
+    now_ms = GetTimeMs();
+    uint64_t start_us = (loop_histogram ? GetTimeUs() : 0);
     
     // Call callbacks for all ready file descriptors
-    // Note: Start from file descriptors 3 since 0, 1, and 2 are stdin, stdout, and stderr.
-    //for(int i = 0; n && i < FD_SETSIZE; i++)
-    for(int i = 3; n && i < FD_SETSIZE; i++)
+    for(int i = 0; i < n; i++)
     {
-        //printf("%s: entering FD_ISSEST...\n", __func__);
+        // Note: any callbacks might in turn remove other file descriptors
+        // by calling CallbackRemove or change the events they wait for.
+        // We need to check the callback we are about to call is still wanted.
+        int fd = events[i].fd;
         
-        // Note: any callbacks might in turn update rfds/wfds by calling
-        // CallbackRemove on a higher numbered file descriptor.
-        // We need to check rfds/wfds to make sure that callback we are
-        // about to call is still wanted.
-        
-        if(FD_ISSET(i, &trfds))
-        {
-            n--;
-            if(FD_ISSET(i, &rfds)) // Is callback still wanted?
-            {
-                //printf("%s: Calling read_fn for fd=%d\n", __func__, i);
-                (this->*cb[i].read_fn)(i);
-            }
-        }
+        if((events[i].events & EVENT_READ) && (cb[fd].events & EVENT_READ) && cb[fd].read_fn != nullptr)
+            (this->*cb[fd].read_fn)(fd);
         
-        if(FD_ISSET(i, &twfds))
-        {
-            n--;
-            if(FD_ISSET(i, &wfds)) // Is callback still wanted?
-            {
-                //printf("%s: Calling write_fn for fd=%d\n", __func__, i);
-                (this->*cb[i].write_fn)(i);
-            }
-        }
+        if((events[i].events & EVENT_WRITE) && (cb[fd].events & EVENT_WRITE) && cb[fd].write_fn != nullptr)
+            (this->*cb[fd].write_fn)(fd);
+    }
+    
+    // Call the expired timers. Note: Timer callbacks might cancel other
+    // timers, so pop the expired timers one by one.
+    timers->Advance(now_ms);
+    CTimerWheel::Timer* t = nullptr;
+    while((t = timers->PopExpired()) != nullptr)
+    {
+        if(t == &health_timer)
+            ProbeTargets();
+        else if(t == &header_timer)
+            ExpireHeaders();
+        else
+            OnTimer((Session*)t->data);
     }
+    
+    // The time spent on the callbacks and the timers of the iteration
+    if(loop_histogram)
+        stats.loop_dispatch.Add(GetTimeUs() - start_us);
 }
 
 inline CTcpProxy::Callback* CTcpProxy::GetCallback(int fd)
 {
-    assert(fd >= 0 && fd < FD_SETSIZE);
-    return (fd >= 0 && fd < FD_SETSIZE ? &cb[fd] : nullptr);
+    assert(fd >= 0 && fd < cb_size);
+    return (fd >= 0 && fd < cb_size ? &cb[fd] : nullptr);
 }
 
-bool CTcpProxy::MakeAsync(int fd)
+inline void CTcpProxy::CountBytes(Session* s, int fd, size_t n)
+{
+    // Count the bytes read from fd (the source or the target) to relay
+    if(s == nullptr)
+        return;
+    
+    TargetStats& st = s->route->targets[s->target].stats;
+    if(fd == s->source_fd)
+    {
+        if(s->first_in_ms == 0)
+            s->first_in_ms = now_ms;
+        s->bytes_in += n;
+        st.bytes_in.Add(n);
+        s->route->shape_in.Consume(n);
+    }
+    else
+    {
+        if(s->first_out_ms == 0)
+            s->first_out_ms = now_ms;
+        s->bytes_out += n;
+        st.bytes_out.Add(n);
+        s->route->shape_out.Consume(n);
+    }
+}
+
+inline size_t CTcpProxy::ShapeLimit(Session* s, int fd)
+{
+    // The max number of bytes to read from fd now (the rate limit of the route)
+    if(s == nullptr)
+        return SIZE_MAX;
+    return (fd == s->source_fd ? s->route->shape_in : s->route->shape_out).Available(now_ms);
+}
+
+bool CTcpProxy::MakeEventLoop()
+{
+    // Raise the limit of open files to the max allowed, so we can
+    // handle more connections than the default soft limit (1024).
+    rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &rl) != 0)
+            LOG_ERROR("%s: setrlimit(RLIMIT_NOFILE) error: %s\n", __func__, strerror(errno));
+    }
+    
+    loop = CEventLoop::Create(loop_name);
+    if(loop == nullptr)
+        return false;
+    
+    now_ms = GetTimeMs();
+    timers = new (std::nothrow) CTimerWheel(now_ms, TIMER_TICK_MS);
+    if(timers == nullptr)
+    {
+        LOG_ERROR("%s: Out of memory: timers is NULL\n", __func__);
+        return false;
+    }
+    
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0)
+        LOG_INFO("%s: Using %s event loop, max open files %lu\n", __func__, 
+                 loop->GetName(), (unsigned long)rl.rlim_cur);
+    return true;
+}
+
+bool CTcpProxy::MakeNonBlocking(int fd)
 {
     // Make file file descriptor nonblocking.
     int n = fcntl(fd, F_GETFL);
     if(n < 0)
     {
-        printf("fcntl(F_GETFL) error: %s\n", strerror(errno));
+        LOG_ERROR("fcntl(F_GETFL) error: %s\n", strerror(errno));
         return false;
     }
     
     if(fcntl(fd, F_SETFL, n | O_NONBLOCK) < 0)
     {
-        printf("fcntl(O_NONBLOCK) error: %s\n", strerror(errno));
+        LOG_ERROR("fcntl(O_NONBLOCK) error: %s\n", strerror(errno));
         return false;
     }
+    return true;
+}
+
+bool CTcpProxy::MakeAsync(int fd)
+{
+    if(!MakeNonBlocking(fd))
+        return false;
     
     // Enable keepalives to make sockets time out if servers go away.
-    n = 1;
+    int n = 1;
     if(setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &n, sizeof(n)) < 0)
     {
-        printf("setsockopt(SO_KEEPALIVE) error: %s\n", strerror(errno));
+        LOG_ERROR("setsockopt(SO_KEEPALIVE) error: %s\n", strerror(errno));
         return false;
     }
     
@@ -210,7 +476,7 @@ bool CTcpProxy::MakeAsync(int fd)
     n = 1;
     if(setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &n, sizeof(n)) < 0)
     {
-        printf("setsockopt(SO_NOSIGPIPE) error: %s\n", strerror(errno));
+        LOG_ERROR("setsockopt(SO_NOSIGPIPE) error: %s\n", strerror(errno));
         return false;
     }
 #endif // SO_NOSIGPIPE
@@ -231,26 +497,26 @@ bool CTcpProxy::MakeAsync(int fd)
     
     if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &sn) < 0)
     {
-        printf("getsockopt(SO_TYPE) error: %s\n", strerror(errno));
+        LOG_ERROR("getsockopt(SO_TYPE) error: %s\n", strerror(errno));
         return false;
     }
     
     if(type != SOCK_STREAM)
     {
-        printf("getsockopt(SO_TYPE) != SOCK_STREAM\n");
+        LOG_ERROR("getsockopt(SO_TYPE) != SOCK_STREAM\n");
         return false;
     }
     
     n = 4;
     if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n)) < 0)
     {
-        printf("setsockopt(SO_RCVBUF) error: %s\n", strerror(errno));
+        LOG_ERROR("setsockopt(SO_RCVBUF) error: %s\n", strerror(errno));
         return false;
     }
     
     if(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &n, sizeof(n)) < 0)
     {
-        printf("setsockopt(SO_SNDBUF) error: %s\n", strerror(errno));
+        LOG_ERROR("setsockopt(SO_SNDBUF) error: %s\n", strerror(errno));
         return false;
     }
   #else  
@@ -261,733 +527,4819 @@ bool CTcpProxy::MakeAsync(int fd)
     return true;
 }
 
-bool CTcpProxy::AddRoute(const char* route_conf)
+void CTcpProxy::SetSocketOptions(int fd, int family, const SocketOptions& so)
+{
+    // Note: The tuning is best effort, the socket works without it
+    if(so.nodelay >= 0 && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &so.nodelay, sizeof(so.nodelay)) < 0)
+        LOG_WARNING("%s: fd=%d, setsockopt(TCP_NODELAY) error: %s\n", __func__, fd, strerror(errno));
+    
+#ifdef TCP_QUICKACK
+    // Note: The kernel leaves the quick ACK mode on its own, so it's only
+    // for the start of the connection (i.e. the first request/response)
+    if(so.quickack >= 0 && setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &so.quickack, sizeof(so.quickack)) < 0)
+        LOG_WARNING("%s: fd=%d, setsockopt(TCP_QUICKACK) error: %s\n", __func__, fd, strerror(errno));
+#endif
+    
+    // Note: The buffer sizes are set before connect (and on the listener),
+    // so the TCP window scale is negotiated for them
+    if(so.rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &so.rcvbuf, sizeof(so.rcvbuf)) < 0)
+        LOG_WARNING("%s: fd=%d, setsockopt(SO_RCVBUF) error: %s\n", __func__, fd, strerror(errno));
+    if(so.sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &so.sndbuf, sizeof(so.sndbuf)) < 0)
+        LOG_WARNING("%s: fd=%d, setsockopt(SO_SNDBUF) error: %s\n", __func__, fd, strerror(errno));
+    
+#if defined(TCP_KEEPIDLE)
+    if(so.keepidle > 0 && setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &so.keepidle, sizeof(so.keepidle)) < 0)
+        LOG_WARNING("%s: fd=%d, setsockopt(TCP_KEEPIDLE) error: %s\n", __func__, fd, strerror(errno));
+#elif defined(TCP_KEEPALIVE)
+    // macOS: The idle time is TCP_KEEPALIVE
+    if(so.keepidle > 0 && setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &so.keepidle, sizeof(so.keepidle)) < 0)
+        LOG_WARNING("%s: fd=%d, setsockopt(TCP_KEEPALIVE) error: %s\n", __func__, fd, strerror(errno));
+#endif
+#ifdef TCP_KEEPINTVL
+    if(so.keepintvl > 0 && setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &so.keepintvl, sizeof(so.keepintvl)) < 0)
+        LOG_WARNING("%s: fd=%d, setsockopt(TCP_KEEPINTVL) error: %s\n", __func__, fd, strerror(errno));
+#endif
+#ifdef TCP_KEEPCNT
+    if(so.keepcnt > 0 && setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &so.keepcnt, sizeof(so.keepcnt)) < 0)
+        LOG_WARNING("%s: fd=%d, setsockopt(TCP_KEEPCNT) error: %s\n", __func__, fd, strerror(errno));
+#endif
+    
+    // Note: IPv4 clients of the dual-stack socket use IP_TOS
+    if(so.tos >= 0)
+    {
+        if(family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &so.tos, sizeof(so.tos)) < 0)
+            LOG_WARNING("%s: fd=%d, setsockopt(IPV6_TCLASS) error: %s\n", __func__, fd, strerror(errno));
+        if(setsockopt(fd, IPPROTO_IP, IP_TOS, &so.tos, sizeof(so.tos)) < 0 && family == AF_INET)
+            LOG_WARNING("%s: fd=%d, setsockopt(IP_TOS) error: %s\n", __func__, fd, strerror(errno));
+    }
+}
+
+bool CTcpProxy::SetListenerOptions(int fd)
+{
+    // Note: The accepted sockets inherit the options of the listener, so
+    // the default ones are set once here rather than on every accept
+    sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int family = (getsockname(fd, (sockaddr*)&addr, &addr_len) == 0 ? addr.ss_family : AF_INET6);
+    if(family == AF_UNIX)
+        return true; // No TCP options
+    
+    SocketOptions so = sock_opts;
+    so.quickack = -1; // Not inherited
+    SetSocketOptions(fd, family, so);
+    
+    if(tcp_fastopen > 0)
+    {
+#ifdef TCP_FASTOPEN
+        // Note: The clients send the data with SYN once they have the cookie
+        if(setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &tcp_fastopen, sizeof(tcp_fastopen)) < 0)
+        {
+            LOG_ERROR("%s: setsockopt(TCP_FASTOPEN) error: %s\n", __func__, strerror(errno));
+            return false;
+        }
+#else
+        LOG_WARNING("%s: TCP_FASTOPEN is not supported on this platform\n", __func__);
+#endif
+    }
+    
+    if(defer_accept > 0)
+    {
+#ifdef TCP_DEFER_ACCEPT
+        // Note: The connection is accepted once the client sends the data
+        // (or after the time), so the protocols where the server speaks
+        // first are delayed by it
+        if(setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept)) < 0)
+        {
+            LOG_ERROR("%s: setsockopt(TCP_DEFER_ACCEPT) error: %s\n", __func__, strerror(errno));
+            return false;
+        }
+#else
+        LOG_WARNING("%s: TCP_DEFER_ACCEPT is not supported on this platform\n", __func__);
+#endif
+    }
+    return true;
+}
+
+bool CTcpProxy::AddRoute(const char* route_conf, bool apply, int listener)
 {
     if(route_conf == nullptr || *route_conf == '\0')
     {
-        printf("%s: Error: invalid (empty) route format string\n", __func__);
+        LOG_ERROR("%s: Error: invalid (empty) route format string\n", __func__);
         return false;
     }
 
-    // Route string expected format: "add 192.168.0.1 192.168.0.1:8080"
+    // Route string expected format:
+    // "192.168.0.1 192.168.0.1:8080[,192.168.0.2:8080 ...] [name=value ...]"
     // printf("%s: cmd=\"%s\"\n", __func__, routeStr);
 
     char source_host[HOST_NAME_MAX+1]{};
-    char target_host[HOST_NAME_MAX+1]{};
-    unsigned short target_port = 0;
+    char targets[MAX_TARGETS*(HOST_NAME_MAX+8)]{};
+    int options_pos = 0;
 
     // Compose format string to scan up to HOST_NAME_MAX for host name/ip
     char format[32]{};
-    sprintf(format, "%%%ds %%%d[^:]:%%hu", HOST_NAME_MAX, HOST_NAME_MAX);
+    sprintf(format, "%%%ds %%%ds%%n", HOST_NAME_MAX, (int)sizeof(targets) - 1);
 
-    if(sscanf(route_conf, format, source_host, target_host, &target_port) != 3)
+    if(sscanf(route_conf, format, source_host, targets, &options_pos) != 2)
     {
-        printf("%s: Invalid route configuration: \"%s\"\n", __func__, route_conf);
+        LOG_ERROR("%s: Invalid route configuration: \"%s\"\n", __func__, route_conf);
         return false;
     }
 
-    return AddRoute(TrimString(source_host), TrimString(target_host), target_port);
+    RouteOptions opts;
+    opts.listener = listener;
+    if(!ParseRouteOptions(route_conf + options_pos, opts))
+        return false;
+
+    return AddRoute(TrimString(source_host), TrimString(targets), opts, apply);
 }
 
-bool CTcpProxy::AddRoute(const char* source_host, const char* target_host, unsigned short target_port)
+bool CTcpProxy::ParseRouteOptions(const char* options, RouteOptions& opts)
 {
-    if(source_host == nullptr || *source_host == '\0' ||
-       target_host == nullptr || *target_host == '\0' || 
-       target_port == 0)
+    // Options expected format: "name=value name=value ..."
+    char option[HOST_NAME_MAX+1]{};
+    char format[16]{};
+    sprintf(format, "%%%ds%%n", HOST_NAME_MAX);
+    
+    int pos = 0;
+    while(sscanf(options, format, option, &pos) == 1)
     {
-        printf("%s: Error: invalid arguments\n", __func__);
-        return false;
+        options += pos;
+        
+        size_t buffer_size_len = strlen(ROUTE_OPTION_BUFFER_SIZE);
+        size_t relay_len = strlen(ROUTE_OPTION_RELAY);
+        size_t balance_len = strlen(ROUTE_OPTION_BALANCE);
+        size_t pool_len = strlen(ROUTE_OPTION_POOL);
+        size_t connect_timeout_len = strlen(ROUTE_OPTION_CONNECT_TIMEOUT);
+        size_t idle_timeout_len = strlen(ROUTE_OPTION_IDLE_TIMEOUT);
+        size_t max_lifetime_len = strlen(ROUTE_OPTION_MAX_LIFETIME);
+        size_t drain_timeout_len = strlen(ROUTE_OPTION_DRAIN_TIMEOUT);
+        size_t max_sessions_len = strlen(ROUTE_OPTION_MAX_SESSIONS);
+        size_t max_source_sessions_len = strlen(ROUTE_OPTION_MAX_SOURCE_SESSIONS);
+        size_t rate_in_len = strlen(ROUTE_OPTION_RATE_IN);
+        size_t rate_out_len = strlen(ROUTE_OPTION_RATE_OUT);
+        size_t nodelay_len = strlen(ROUTE_OPTION_NODELAY);
+        size_t quickack_len = strlen(ROUTE_OPTION_QUICKACK);
+        size_t rcvbuf_len = strlen(ROUTE_OPTION_RCVBUF);
+        size_t sndbuf_len = strlen(ROUTE_OPTION_SNDBUF);
+        size_t keepalive_len = strlen(ROUTE_OPTION_KEEPALIVE);
+        size_t tos_len = strlen(ROUTE_OPTION_TOS);
+        size_t fastopen_len = strlen(ROUTE_OPTION_FASTOPEN);
+        size_t listen_len = strlen(ROUTE_OPTION_LISTEN);
+        size_t proxy_protocol_len = strlen(ROUTE_OPTION_PROXY_PROTOCOL);
+        
+        if(strncasecmp(option, ROUTE_OPTION_BUFFER_SIZE, buffer_size_len) == 0)
+        {
+            if(!ParseSize(option + buffer_size_len, opts.buffer_size) ||
+               opts.buffer_size < MIN_BUFSIZE || opts.buffer_size > MAX_BUFSIZE)
+            {
+                LOG_ERROR("%s: Invalid route buffer size: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_RELAY, relay_len) == 0)
+        {
+            if(!ParseRelayMode(option + relay_len, opts.relay))
+            {
+                LOG_ERROR("%s: Invalid route relay mode: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_BALANCE, balance_len) == 0)
+        {
+            if(!ParseBalanceMode(option + balance_len, opts.balance))
+            {
+                LOG_ERROR("%s: Invalid route balance mode: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_POOL, pool_len) == 0)
+        {
+            char* end = nullptr;
+            long pool = strtol(option + pool_len, &end, 10);
+            if(end == option + pool_len || *end != '\0' || pool < 0 || pool > MAX_POOL)
+            {
+                LOG_ERROR("%s: Invalid route pool size: '%s'\n", __func__, option);
+                return false;
+            }
+            opts.pool = (int)pool;
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_CONNECT_TIMEOUT, connect_timeout_len) == 0)
+        {
+            if(!ParseTimeout(option + connect_timeout_len, opts.connect_timeout))
+            {
+                LOG_ERROR("%s: Invalid route connect timeout: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_IDLE_TIMEOUT, idle_timeout_len) == 0)
+        {
+            if(!ParseTimeout(option + idle_timeout_len, opts.idle_timeout))
+            {
+                LOG_ERROR("%s: Invalid route idle timeout: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_MAX_LIFETIME, max_lifetime_len) == 0)
+        {
+            if(!ParseTimeout(option + max_lifetime_len, opts.max_lifetime))
+            {
+                LOG_ERROR("%s: Invalid route max lifetime: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_DRAIN_TIMEOUT, drain_timeout_len) == 0)
+        {
+            if(!ParseTimeout(option + drain_timeout_len, opts.drain_timeout))
+            {
+                LOG_ERROR("%s: Invalid route drain timeout: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_MAX_SESSIONS, max_sessions_len) == 0 ||
+                strncasecmp(option, ROUTE_OPTION_MAX_SOURCE_SESSIONS, max_source_sessions_len) == 0)
+        {
+            bool source = (strncasecmp(option, ROUTE_OPTION_MAX_SOURCE_SESSIONS, max_source_sessions_len) == 0);
+            const char* value = option + (source ? max_source_sessions_len : max_sessions_len);
+            char* end = nullptr;
+            long count = strtol(value, &end, 10);
+            if(end == value || *end != '\0' || count < 0)
+            {
+                LOG_ERROR("%s: Invalid route max sessions: '%s'\n", __func__, option);
+                return false;
+            }
+            (source ? opts.max_source_sessions : opts.max_sessions) = (size_t)count;
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_RATE_IN, rate_in_len) == 0 ||
+                strncasecmp(option, ROUTE_OPTION_RATE_OUT, rate_out_len) == 0)
+        {
+            // Note: The rate is bytes/sec (K/M suffix allowed)
+            bool in = (strncasecmp(option, ROUTE_OPTION_RATE_IN, rate_in_len) == 0);
+            size_t rate = 0;
+            if(!ParseSize(option + (in ? rate_in_len : rate_out_len), rate))
+            {
+                LOG_ERROR("%s: Invalid route rate: '%s'\n", __func__, option);
+                return false;
+            }
+            (in ? opts.rate_in : opts.rate_out) = rate;
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_NODELAY, nodelay_len) == 0)
+        {
+            if(!ParseFlag(option + nodelay_len, opts.sock.nodelay))
+            {
+                LOG_ERROR("%s: Invalid route nodelay: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_QUICKACK, quickack_len) == 0)
+        {
+            if(!ParseFlag(option + quickack_len, opts.sock.quickack))
+            {
+                LOG_ERROR("%s: Invalid route quickack: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_FASTOPEN, fastopen_len) == 0)
+        {
+            if(!ParseFlag(option + fastopen_len, opts.sock.fastopen))
+            {
+                LOG_ERROR("%s: Invalid route fastopen: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_RCVBUF, rcvbuf_len) == 0 ||
+                strncasecmp(option, ROUTE_OPTION_SNDBUF, sndbuf_len) == 0)
+        {
+            bool rcv = (strncasecmp(option, ROUTE_OPTION_RCVBUF, rcvbuf_len) == 0);
+            size_t size = 0;
+            if(!ParseSize(option + (rcv ? rcvbuf_len : sndbuf_len), size) || size == 0 || size > MAX_SOCKBUF)
+            {
+                LOG_ERROR("%s: Invalid route socket buffer size: '%s'\n", __func__, option);
+                return false;
+            }
+            (rcv ? opts.sock.rcvbuf : opts.sock.sndbuf) = (int)size;
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_KEEPALIVE, keepalive_len) == 0)
+        {
+            // Expected format: <idle>[,<interval>[,<count>]], i.e. 60s,10s,5
+            char idle[32]{}, intvl[32]{};
+            int count = 0;
+            int n = sscanf(option + keepalive_len, "%31[^,],%31[^,],%d", idle, intvl, &count);
+            uint64_t idle_ms = 0, intvl_ms = 0;
+            if(n < 1 || !ParseTime(idle, idle_ms) || idle_ms < 1000 ||
+               (n >= 2 && (!ParseTime(intvl, intvl_ms) || intvl_ms < 1000)) || (n == 3 && count < 1))
+            {
+                LOG_ERROR("%s: Invalid route keepalive: '%s'\n", __func__, option);
+                return false;
+            }
+            opts.sock.keepidle = (int)(idle_ms / 1000);
+            opts.sock.keepintvl = (int)(intvl_ms / 1000);
+            opts.sock.keepcnt = count;
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_TOS, tos_len) == 0)
+        {
+            // Note: Hex (0x..) allowed, i.e. tos=0x10 (low delay)
+            char* end = nullptr;
+            long tos = strtol(option + tos_len, &end, 0);
+            if(end == option + tos_len || *end != '\0' || tos < 0 || tos > 255)
+            {
+                LOG_ERROR("%s: Invalid route tos: '%s'\n", __func__, option);
+                return false;
+            }
+            opts.sock.tos = (int)tos;
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_LISTEN, listen_len) == 0)
+        {
+            // Note: The listeners are not added on reload (restart or upgrade)
+            opts.listener = FindListener(option + listen_len);
+            if(opts.listener < 0)
+            {
+                LOG_ERROR("%s: Unknown route listener: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else if(strncasecmp(option, ROUTE_OPTION_PROXY_PROTOCOL, proxy_protocol_len) == 0)
+        {
+            const char* version = option + proxy_protocol_len;
+            opts.proxy_protocol = (strcasecmp(version, "v1") == 0 ? 1 : (strcasecmp(version, "v2") == 0 ? 2 : 0));
+            if(opts.proxy_protocol == 0)
+            {
+                LOG_ERROR("%s: Invalid route proxy protocol: '%s'\n", __func__, option);
+                return false;
+            }
+        }
+        else
+        {
+            LOG_ERROR("%s: Unknown route option: '%s'\n", __func__, option);
+            return false;
+        }
     }
+    return true;
+}
 
-    //
-    // Get the target host addr
-    //
-    addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;        // Allow IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM;    // TCP (connection-based protocol)
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;              // Any protocol
-
-    addrinfo* addr = nullptr;
-    int status = getaddrinfo(target_host, nullptr, &hints, &addr);
-    if(status != 0)
+bool CTcpProxy::AddRoute(const char* source_host, const char* targets, const RouteOptions& opts, bool apply)
+{
+    if(source_host == nullptr || *source_host == '\0' ||
+       targets == nullptr || *targets == '\0')
     {
-        printf("%s: getaddrinfo(%s) error: %s\n", __func__, target_host, gai_strerror(status));
+        LOG_ERROR("%s: Error: invalid arguments\n", __func__);
         return false;
     }
 
-    int target_ip_family{0};
-    char target_ip[INET6_ADDRSTRLEN]{};
+    // Route settings shared by all the source addrs
+    Route conf;
+    conf.opts = opts;
+    conf.shape_in.Init(WorkerShare(opts.rate_in), now_ms);
+    conf.shape_out.Init(WorkerShare(opts.rate_out), now_ms);
 
-    // Note: getaddrinfo() returns a list of address structures
-    // Get first AF_INET or AF_INET6 addr.
-    for(const addrinfo* next = addr; next; next = next->ai_next)
+    //
+    // Get the target addrs: "host:port[,host:port ...]"
+    //
+    const char* target = targets;
+    while(*target != '\0')
     {
-        if(next->ai_family == AF_INET)
+        char target_host[HOST_NAME_MAX+8]{};
+        size_t len = strcspn(target, ",");
+        if(len == 0 || len >= sizeof(target_host))
         {
-            target_ip_family = AF_INET;
-            const struct in_addr& target_addr = ((sockaddr_in*)next->ai_addr)->sin_addr;
-            inet_ntop(AF_INET, &target_addr, target_ip, INET_ADDRSTRLEN);
-            break;
+            LOG_ERROR("%s: Invalid route target list: '%s'\n", __func__, targets);
+            return false;
         }
-        else if(next->ai_family == AF_INET6)
+        if(conf.target_count == MAX_TARGETS)
         {
-            target_ip_family = AF_INET6;
-            const struct in6_addr& target6_addr = ((sockaddr_in6*)next->ai_addr)->sin6_addr;
-            inet_ntop(AF_INET6, &target6_addr, target_ip, INET6_ADDRSTRLEN);
-            break;
+            LOG_ERROR("%s: Too many route targets (max %d): '%s'\n", __func__, MAX_TARGETS, targets);
+            return false;
         }
-    }
-    freeaddrinfo(addr);
-
-    if(target_ip_family == 0)
-    {
-        printf("%s: No IPv4 nor IPv6 addresses available for '%s'\n", __func__, target_host);
-        return false;
+        memcpy(target_host, target, len);
+        
+        if(!ParseTarget(target_host, conf.targets[conf.target_count], apply))
+            return false;
+        conf.target_count++;
+        
+        target += len;
+        if(*target == ',')
+            target++;
     }
 
     //
-    // Get the source host addr
+    // Get the source addr(s): "default", CIDR prefix or host name/ip
     //
-    addr = nullptr;
-    status = getaddrinfo(source_host, nullptr, &hints, &addr);
-    if(status != 0)
-    {
-        printf("%s: getaddrinfo(%s) error: %s\n", __func__, source_host, gai_strerror(status));
-        return false;
-    }
-
-    // Note: getaddrinfo() returns a list of address structures
-    // Add new route for every AF_INET or AF_INET6 addr.
     int newRouteCount = 0;
-    for(const addrinfo* next = addr; next; next = next->ai_next)
+    if(strcasecmp(source_host, ROUTE_SOURCE_DEFAULT) == 0)
     {
-        int source_ip_family{0};
-        char source_ip[INET6_ADDRSTRLEN]{};
-
-        if(next->ai_family == AF_INET)
+        // Default route matches any IPv4 and IPv6 client
+        for(int family : {AF_INET, AF_INET6})
         {
-            source_ip_family = AF_INET;
-            const struct in_addr& source_addr = ((sockaddr_in*)next->ai_addr)->sin_addr;
-            inet_ntop(AF_INET, &source_addr, source_ip, INET_ADDRSTRLEN); 
+            IpAddr source_addr;
+            source_addr.family = family;
+            if(!apply || SetRoute(source_host, source_addr, 0, conf))
+                newRouteCount++;
         }
-        else if(next->ai_family == AF_INET6)
+    }
+    else if(strchr(source_host, '/') != nullptr)
+    {
+        IpAddr source_addr;
+        int prefix_len = 0;
+        if(!source_addr.SetPrefix(source_host, prefix_len))
         {
-            source_ip_family = AF_INET6;
-            const struct in6_addr& source6_addr = ((sockaddr_in6*)next->ai_addr)->sin6_addr;
-            inet_ntop(AF_INET6, &source6_addr, source_ip, INET6_ADDRSTRLEN); 
+            LOG_ERROR("%s: Invalid source prefix: '%s'\n", __func__, source_host);
+            return false;
         }
-        else
-        {
-            continue;
-        }
-
-        // Create new route
-        Route* new_route = new (std::nothrow) Route;
-        if(new_route == nullptr)
-        {
-            printf("%s: Out of memory: new_route is NULL\n", __func__);
-            freeaddrinfo(addr);
-            return false;
-        }
-        newRouteCount++;
-
-        new_route->source_ip_family = source_ip_family;
-        strcpy(new_route->source_ip, source_ip);  
-        new_route->target_ip_family = target_ip_family;
-        strcpy(new_route->target_ip, target_ip);
-        new_route->target_port = target_port;
-
-        printf("%s: Adding route %s (%s) --> %s:%hu (%s)\n", __func__,
-               source_host, new_route->source_ip,
-               target_host, target_port, new_route->target_ip);
+        if(!apply || SetRoute(source_host, source_addr, prefix_len, conf))
+            newRouteCount++;
+    }
+    else
+    {
+        // Note: The source host names are resolved at startup only, since
+        // getaddrinfo() would block the event loop. At runtime only the
+        // addresses are, and the name updates the routes resolved from it
+        // (i.e. on reload).
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;        // Allow IPv4 or IPv6
+        hints.ai_socktype = SOCK_STREAM;    // TCP (connection-based protocol)
+        hints.ai_flags = (keep_running ? AI_NUMERICHOST : 0);
 
-        // Set new route
-        if(route == nullptr)
-        {
-            route = new_route;
-            continue;
-        }
-        
-        Route* rt = GetRoute(new_route->source_ip);
-        if(rt == nullptr)
+        addrinfo* addr = nullptr;
+        int status = getaddrinfo(source_host, nullptr, &hints, &addr);
+        if(status != 0 && keep_running)
         {
-            new_route->next = route;
-            route = new_route;
-            continue;
+            for(Route* rt = listeners[opts.listener].routes.list; rt != nullptr; rt = rt->next)
+            {
+                if(strcasecmp(rt->source_host, source_host) == 0 &&
+                   (!apply || SetRoute(source_host, rt->source_addr, rt->source_prefix_len, conf)))
+                    newRouteCount++;
+            }
+            if(newRouteCount == 0)
+            {
+                LOG_ERROR("%s: Source host name '%s' is only resolved at startup, use its address\n", 
+                          __func__, source_host);
+                return false;
+            }
         }
-        
-        // The route is duplicated. Is it already connected?
-        if(rt->source_fd < 0)
+        else if(status != 0)
         {
-            // The route is not connected. Just update target ip/port
-            strcpy(rt->target_ip, new_route->target_ip);
-            rt->target_port = new_route->target_port;
-            delete new_route;
-            continue;
+            LOG_ERROR("%s: getaddrinfo(%s) error: %s\n", __func__, source_host, gai_strerror(status));
+            return false;
         }
-        
-        // The route is already connected.
-        printf("%s: Duplicated route for %s --> %s:%hu\n", __func__,
-               source_host, target_host, target_port);
-        
-        // Get the route's target socket
-        Callback* cb = GetCallback(rt->source_fd);
-        if(cb == nullptr)
+
+        // Note: getaddrinfo() returns a list of address structures
+        // Add new route for every AF_INET or AF_INET6 addr.
+        strcpy(conf.source_host, source_host);
+        for(const addrinfo* next = addr; next; next = next->ai_next)
         {
-            printf("%s: fd=%d, callback is NULL\n", __func__, rt->source_fd);
-            delete new_route;
-            newRouteCount--; // Since we can't proceed for this route
-            continue;
+            IpAddr source_addr;
+            if(source_addr.Set(next->ai_addr) && 
+               (!apply || SetRoute(source_host, source_addr, source_addr.Len() * 8, conf)))
+                newRouteCount++;
         }
-        
-        // Close both source and target sockets (and remove associated callbacks)
-        // Note: it will reset rt->source_fd to -1
-        CloseSock(rt->source_fd, cb->peer_fd);
-        assert(rt->source_fd < 0);
-
-        // Update target ip/port
-        strcpy(rt->target_ip, new_route->target_ip);
-        rt->target_port = new_route->target_port;
-        rt->source_fd = -1;
-        delete new_route;
+        if(addr != nullptr)
+            freeaddrinfo(addr);
     }
-    freeaddrinfo(addr);
 
     if(newRouteCount == 0)
     {
-        printf("%s: Error adding new route for '%s'\n", __func__, source_host);
+        LOG_ERROR("%s: Error adding new route for '%s'\n", __func__, source_host);
     }
-    else
+    else if(apply)
     {
-        printf("%s: %d new route(s) added: %s --> %s:%hu\n", __func__,
-               newRouteCount, source_host, target_host, target_port);
+        LOG_INFO("%s: %d new route(s) added: %s --> %s (%d target(s))\n", __func__,
+                 newRouteCount, source_host, targets, conf.target_count);
     }
 
     return (newRouteCount > 0);
 }
 
-CTcpProxy::Route* CTcpProxy::GetRoute(const char* source_ip)
+bool CTcpProxy::ParseTarget(const char* target, Target& t, bool apply)
 {
-    if(source_ip == nullptr)
-        return nullptr;
+    // Target expected format: "host:port" or "[IPv6 address]:port"
+    char target_host[HOST_NAME_MAX+1]{};
+    const char* colon = strrchr(target, ':');
+    const char* host = target;
+    size_t host_len = (colon != nullptr ? colon - target : 0);
+    if(*target == '[' && host_len > 2 && target[host_len - 1] == ']')
+    {
+        host++;
+        host_len -= 2;
+    }
+    if(host_len == 0 || host_len > HOST_NAME_MAX)
+    {
+        LOG_ERROR("%s: Invalid route target: '%s'\n", __func__, target);
+        return false;
+    }
+    memcpy(target_host, host, host_len);
     
-    Route* rt = route;
-    while(rt != nullptr)
+    char* end = nullptr;
+    unsigned long port = strtoul(colon + 1, &end, 10);
+    if(end == colon + 1 || *end != '\0' || port == 0 || port > 65535)
     {
-        if(strcmp(rt->source_ip, source_ip) == 0)
-            break;
-        rt = rt->next;
+        LOG_ERROR("%s: Invalid route target port: '%s'\n", __func__, target);
+        return false;
     }
-    return rt;
-}
-
-CTcpProxy::Route* CTcpProxy::GetRoute(int source_fd)
-{
-    assert(source_fd >= 0 && source_fd < FD_SETSIZE);
+    t.port = (unsigned short)port;
     
-    if(source_fd < 0 || source_fd >= FD_SETSIZE)
-        return nullptr;
+    strcpy(t.host, target_host);
+    t.ip_family = 0;
+    t.ip[0] = '\0';
     
-    Route* rt = route;
-    while(rt != nullptr)
+    // Note: Only numeric address is resolved here. Host name is resolved
+    // by the resolver thread, so a slow DNS doesn't block the event loop.
+    // The route only checked (see RunBatch) isn't resolved at all.
+    if(!SetTargetAddr(t, target_host))
     {
-        if(rt->source_fd == source_fd)
-            break;
-        rt = rt->next;
+        if(apply && resolver != nullptr && !resolver->Add(target_host))
+            return false;
     }
-    return rt;
+    
+    // FNV-1a hash of host and port, so the consistent hashing doesn't
+    // depend on the order of the targets or the host name address.
+    t.hash = 2166136261u;
+    for(const char* c = t.host; *c != '\0'; c++)
+        t.hash = (t.hash ^ (unsigned char)*c) * 16777619u;
+    t.hash = (t.hash ^ t.port) * 16777619u;
+    return true;
 }
 
-bool CTcpProxy::ReadConfig(const char* configFile)
+bool CTcpProxy::SetTargetAddr(Target& t, const char* ip)
 {
-    if(configFile == nullptr || *configFile == '\0')
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    
+    sockaddr_in& addr4 = (sockaddr_in&)addr;
+    sockaddr_in6& addr6 = (sockaddr_in6&)addr;
+    if(inet_pton(AF_INET, ip, &addr4.sin_addr) == 1)
     {
-        printf("%s: Error: invalid (empty) config file name\n", __func__);
-        return false;
+        addr4.sin_family = AF_INET;
+        addr4.sin_port = htons(t.port);
+        t.addr_len = sizeof(sockaddr_in);
     }
-
-    // Open config file
-    FILE* stream = fopen(configFile, "r");
-    if(!stream) 
+    else if(inet_pton(AF_INET6, ip, &addr6.sin6_addr) == 1)
+    {
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_port = htons(t.port);
+        t.addr_len = sizeof(sockaddr_in6);
+    }
+    else
     {
-        printf("%s: fopen(%s) error: %s\n", __func__, configFile, strerror(errno));
         return false;
     }
+    
+    t.addr = addr;
+    t.ip_family = addr.ss_family;
+    inet_ntop(t.ip_family, (t.ip_family == AF_INET ? (void*)&addr4.sin_addr : (void*)&addr6.sin6_addr),
+              t.ip, sizeof(t.ip));
+    return true;
+}
 
-    // Read config file
-    char* line{nullptr};
-    size_t len{0};
-    ssize_t nread{0};
-    bool res = true;
-
-    size_t port_len = strlen(CONFIG_NAME_PORT);
-    size_t route_len = strlen(CONFIG_NAME_ROUTE);
-
-    while((nread = getline(&line, &len, stream)) != -1) 
+int CTcpProxy::UpdateTargets(const char* host, const char* ip)
+{
+    // Note: The routes are only used by the event loop thread, so the new
+    // address is seen by all the new sessions at once.
+    int count = 0;
+    for(Route* rt = FirstRoute(); rt != nullptr; rt = NextRoute(rt))
     {
-        char* ptr = TrimString(line);
-
-        if(port == 0 && strncasecmp(ptr, CONFIG_NAME_PORT, port_len) == 0)
+        for(int i = 0; i < rt->target_count; i++)
         {
-            // Got a port
-            if(sscanf(ptr + port_len, "%hu", &port) != 1)
-            {
-                printf("%s: Invalid port number specified: '%s'\n", __func__, ptr);
-                res = false;
-                break;
-            }
+            Target& t = rt->targets[i];
+            if(strcmp(t.host, host) != 0)
+                continue;
+            
+            count++;
+            if(t.ip_family != 0 && strcmp(t.ip, ip) == 0)
+                continue; // Not changed
+            
+            // Re-connect pooled sockets to the new address
+            ClosePool(t);
+            pthread_mutex_lock(&routes_mutex);
+            bool res = SetTargetAddr(t, ip);
+            pthread_mutex_unlock(&routes_mutex);
+            if(res && keep_running)
+                FillPool(rt, i);
+        }
+    }
+    return count;
+}
 
-            // Print the startup message
-            timeval tv;
-            gettimeofday(&tv,nullptr);
-            char time_str[40]{};
-            strftime(time_str, sizeof(time_str), "%Y.%m.%d %H:%M:%S", localtime(&tv.tv_sec));
-            printf("------- Starting TCP proxy on port %d at %s ------- \n", port, time_str);
+int CTcpProxy::SelectTarget(Route* rt, const IpAddr& source_addr)
+{
+    // Note: Skip the targets which host names are not resolved yet,
+    // and the ones ejected or failed the health check (see IsTargetUp)
+    int target = -1;
+    switch(rt->opts.balance)
+    {
+    case BALANCE_LEASTCONN:
+    {
+        // The least number of sessions, starting from the round-robin
+        // position, so the ties are spread over the targets.
+        int start = rt->rr_next++ % rt->target_count;
+        for(int i = 0; i < rt->target_count; i++)
+        {
+            int next = (start + i) % rt->target_count;
+            if(IsTargetUp(rt->targets[next]) && 
+               (target < 0 || rt->targets[next].session_count < rt->targets[target].session_count))
+                target = next;
         }
-        else if(strncasecmp(ptr, CONFIG_NAME_ROUTE, route_len) == 0)
+        break;
+    }
+        
+    case BALANCE_HASH:
+    {
+        // Rendezvous (highest random weight) hashing: the source goes to the
+        // target with the highest score, so adding or removing a target only
+        // moves the sources of that target.
+        size_t source_hash = source_addr.Hash();
+        size_t best_score = 0;
+        for(int i = 0; i < rt->target_count; i++)
         {
-            // Got a route
-            if(!AddRoute(ptr + route_len))
+            if(!IsTargetUp(rt->targets[i]))
+                continue;
+            
+            size_t score = (source_hash ^ rt->targets[i].hash) * 0x9E3779B97F4A7C15ull;
+            score ^= score >> 29;
+            if(target < 0 || score > best_score)
             {
-                res = false;
-                break;
+                best_score = score;
+                target = i;
             }
         }
+        break;
+    }
+        
+    default:
+        for(int i = 0; i < rt->target_count && target < 0; i++)
+        {
+            int next = rt->rr_next++ % rt->target_count;
+            if(IsTargetUp(rt->targets[next]))
+                target = next;
+        }
+        break;
     }
+    return target;
+}
 
-    free(line);
-    fclose(stream);
-    return res;
+bool CTcpProxy::IsTargetUp(const Target& t) const
+{
+    return (t.ip_family != 0 && !t.probe_down && t.ejected_until <= now_ms);
 }
 
-bool CTcpProxy::MakeCmdPipe()
+void CTcpProxy::TargetConnected(Target& t, uint64_t latency_ms)
 {
-    if(base_name[0] == '\0')
-        return false;
+    t.stats.connect_latency.Add(latency_ms);
+    t.fails = 0;
+    if(t.ejections > 0)
+    {
+        LOG_INFO("%s: %s:%hu is back after %d ejection(s)\n", __func__, t.host, t.port, t.ejections);
+        t.ejections = 0;
+    }
+}
 
-    // Open fifo to listen on the commands sent to the process
-    char fifo_name[PATH_MAX]{};
-    sprintf(fifo_name, "/tmp/%s.cmd", base_name);
+void CTcpProxy::TargetFailed(Target& t)
+{
+    // Note: The connects pending when the target was ejected don't eject it again
+    t.stats.connect_errors.Add(1);
+    if(max_fails == 0 || ++t.fails < max_fails || t.ejected_until > now_ms)
+        return;
     
-    // Remove fifo if existed from previous run. It's OK if it doesn't exist
-    unlink(fifo_name);
+    // Eject the target, doubling the time on every consecutive ejection. It's
+    // retried once the time is out, and the next error ejects it again.
+    uint64_t time = eject_time;
+    for(int i = 0; i < t.ejections && time < MAX_EJECT_TIME; i++)
+        time *= 2;
+    time = (time < MAX_EJECT_TIME ? time : MAX_EJECT_TIME);
+    t.ejected_until = now_ms + time;
+    t.ejections++;
+    t.fails = max_fails - 1;
+    t.stats.ejections.Add(1);
+    LOG_WARNING("%s: worker=%d, %s:%hu is ejected for %llu ms (%d time(s) in a row)\n", __func__,
+                worker_id, t.host, t.port, (unsigned long long)time, t.ejections);
+}
+
+bool CTcpProxy::SetRoute(const char* source_host, const IpAddr& source_addr, int prefix_len, 
+                         const Route& conf)
+{
+    char source_ip[INET6_ADDRSTRLEN]{};
+    source_addr.ToString(source_ip, sizeof(source_ip));
     
-    // Make fifo
-    if(mkfifo(fifo_name, S_IRUSR | S_IWUSR | S_IWGRP) == -1 && errno != EEXIST)
+    LOG_INFO("%s: Adding route %s (%s/%d) --> %s:%hu%s\n", __func__,
+             source_host, source_ip, prefix_len, conf.targets[0].host, conf.targets[0].port,
+             (conf.target_count > 1 ? ", ..." : ""));
+    
+    RouteTable& routes = listeners[conf.opts.listener].routes;
+    Route* rt = routes.Find(source_addr, prefix_len);
+    if(rt != nullptr && rt->opts == conf.opts && rt->target_count == conf.target_count)
+    {
+        // Nothing to do if the route is not changed (i.e. config reload)
+        bool same = true;
+        for(int i = 0; i < rt->target_count && same; i++)
+            same = (rt->targets[i].port == conf.targets[i].port && strcmp(rt->targets[i].host, conf.targets[i].host) == 0);
+        if(same)
+        {
+            rt->mark = true;
+            return true;
+        }
+    }
+    
+    // Create new route. Note: The changed route is replaced by the new one
+    // (i.e. config reload), so a changed option or target doesn't close
+    // its sessions: They go on with the old route, retired until the last
+    // one is closed, and the new connections get the new route.
+    Route* new_route = new (std::nothrow) Route(conf);
+    if(new_route == nullptr)
     {
-        printf("%s: mkfifo error: %s\n", __func__, strerror(errno));
+        LOG_ERROR("%s: Out of memory: new_route is NULL\n", __func__);
         return false;
     }
     
-    // Open nonblocking
-    int fifo = open(fifo_name, O_RDONLY | O_NONBLOCK);
-    if(fifo == -1)
+    new_route->source_addr = source_addr;
+    new_route->source_prefix_len = prefix_len;
+    new_route->mark = true;
+    strcpy(new_route->source_ip, source_ip);
+    if(prefix_len < source_addr.Len() * 8)
+    {
+        size_t len = strlen(source_ip);
+        snprintf(new_route->source_ip + len, sizeof(new_route->source_ip) - len, "/%d", prefix_len);
+    }
+    
+    // The targets not changed keep their address and health, so they
+    // don't wait for the resolver and the health check again
+    int kept[MAX_TARGETS];
+    for(int i = 0; i < new_route->target_count; i++)
+    {
+        kept[i] = -1;
+        Target& t = new_route->targets[i];
+        for(int k = 0; rt != nullptr && k < rt->target_count && kept[i] < 0; k++)
+        {
+            const Target& old = rt->targets[k];
+            if(old.port != t.port || strcmp(old.host, t.host) != 0)
+                continue;
+            
+            kept[i] = k;
+            if(t.ip_family == 0 && old.ip_family != 0)
+            {
+                t.ip_family = old.ip_family;
+                strcpy(t.ip, old.ip);
+                t.addr = old.addr;
+                t.addr_len = old.addr_len;
+            }
+            t.fails = old.fails;
+            t.ejections = old.ejections;
+            t.ejected_until = old.ejected_until;
+            t.probe_down = old.probe_down;
+        }
+    }
+    
+    // Note: The stats of the kept targets move to the new route in one go
+    // with the route, so the scrape doesn't see them drop (see FormatStats).
+    // The same host and port listed twice takes them over once.
+    pthread_mutex_lock(&routes_mutex);
+    if(rt != nullptr)
+        routes.Remove(rt);
+    bool res = routes.Insert(new_route);
+    bool restored = (!res && rt != nullptr && routes.Insert(rt));
+    for(int i = 0; res && rt != nullptr && i < new_route->target_count; i++)
+    {
+        if(kept[i] >= 0 && FindTarget(new_route, new_route->targets[i]) == i)
+            new_route->targets[i].stats.TakeOver(rt->targets[kept[i]].stats);
+    }
+    pthread_mutex_unlock(&routes_mutex);
+    
+    if(!res)
     {
-        printf("%s: open error: %s\n", __func__, strerror(errno));
+        delete new_route;
+        if(rt != nullptr && !restored)
+        {
+            LOG_ERROR("%s: Route %s is lost, can't put it back\n", __func__, rt->source_ip);
+            RetireRoute(rt);
+        }
         return false;
     }
+    if(rt != nullptr)
+    {
+        LOG_INFO("%s: Route %s is changed, %zu session(s) left to finish with the old one\n", __func__,
+                 rt->source_ip, rt->session_count);
+        rt->replaced = true;
+        RetireRoute(rt);
+    }
     
-    // Add fifo callback
-    CallbackAdd(fifo, -1, &CTcpProxy::OnCommand, nullptr);
+    // Note: The new route's pools are filled when the event loop starts
+    if(keep_running)
+    {
+        for(int i = 0; i < new_route->target_count; i++)
+            FillPool(new_route, i);
+    }
     return true;
 }
 
-bool CTcpProxy::Start()
+int CTcpProxy::FindTarget(const Route* rt, const Target& t)
 {
-    // Make sure we have a valid base name
-    if(base_name[0] == '\0')
-        return false;
-
-    // Make sure that no other instances of TcpProxy are running
-    if(IsProcessRunning())
-        return false;
-
-    // Read configuration (port, routes, etc.).
-    // Open fifo to listen on the commands sent to the process.
-    bool res = false;
-    if(ReadConfig(conf_name) && MakeCmdPipe())
+    // The first target of the route with the same host and port (-1 - none)
+    for(int i = 0; i < rt->target_count; i++)
     {
-        // Start to listen
-        keep_running = true;
-        res = Listen();
+        if(rt->targets[i].port == t.port && strcmp(rt->targets[i].host, t.host) == 0)
+            return i;
     }
+    return -1;
+}
 
-    // Remove command fifo & lock file
-    char fname[PATH_MAX]{};
-    sprintf(fname, "/tmp/%s.cmd", base_name);
-    unlink(fname);
+void CTcpProxy::MergeStats(Route* old)
+{
+    // Add the counters of the replaced route to the route in the table now
+    pthread_mutex_lock(&routes_mutex);
+    Route* rt = listeners[old->opts.listener].routes.Find(old->source_addr, old->source_prefix_len);
+    for(int j = 0; rt != nullptr && j < old->target_count; j++)
+    {
+        int i = FindTarget(rt, old->targets[j]);
+        if(i >= 0 && FindTarget(old, old->targets[j]) == j)
+            rt->targets[i].stats.Merge(old->targets[j].stats);
+    }
+    pthread_mutex_unlock(&routes_mutex);
+}
 
-    sprintf(fname, "/tmp/%s.lock", base_name);
-    unlink(fname);
+uint64_t CTcpProxy::WorkerShare(uint64_t limit) const
+{
+    // Every worker has its own sessions and buckets of the route, so the
+    // route's limit is divided between them (at least 1 per worker). The
+    // workers get the connections in about equal parts (SO_REUSEPORT).
+    if(limit == 0 || worker_count <= 1)
+        return limit;
+    return (limit >= (uint64_t)worker_count ? limit / worker_count : 1);
+}
 
-    return res;
+CTcpProxy::Route* CTcpProxy::GetRoute(int listener, const IpAddr& source_addr)
+{
+    return listeners[listener].routes.Match(source_addr);
 }
- 
-bool CTcpProxy::Listen()
+
+CTcpProxy::Route* CTcpProxy::FirstRoute(int listener) const
 {
-    if(!keep_running)
+    for(int i = listener; i < listener_count; i++)
     {
-        // We failed somewhere during initializatin and should't be running
-        return false;
+        if(listeners[i].routes.list != nullptr)
+            return listeners[i].routes.list;
     }
+    return nullptr;
+}
 
-    // Open up the TCP socket the proxy listens on
-    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if(sock < 0)
-    {
-        printf("%s: socket error: %s\n", __func__, strerror(errno));
-        return false;
-    }
-    
-    // Bind the socket to all local addresses
-    struct sockaddr_in proxy_addr;
-    memset(&proxy_addr, 0, sizeof(struct sockaddr_in));
-    proxy_addr.sin_family = AF_INET;
-    proxy_addr.sin_addr.s_addr = INADDR_ANY; // bind to all local addresses
-    proxy_addr.sin_port = htons(port);
-    
-    int flag = 1;
-    if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0)
+CTcpProxy::Route* CTcpProxy::NextRoute(const Route* rt) const
+{
+    return (rt->next != nullptr ? rt->next : FirstRoute(rt->opts.listener + 1));
+}
+
+bool CTcpProxy::ReadConfig(const char* configFile)
+{
+    if(configFile == nullptr || *configFile == '\0')
     {
-        printf("%s: setsockopt(SO_REUSEADDR) error: %s\n", __func__, strerror(errno));
-        close(sock);
+        LOG_ERROR("%s: Error: invalid (empty) config file name\n", __func__);
         return false;
     }
-    
-    if(bind(sock, (struct sockaddr*)&proxy_addr, sizeof(proxy_addr)) < 0)
+
+    // Open config file
+    FILE* stream = fopen(configFile, "r");
+    if(!stream) 
     {
-        printf("%s: bind error: %s\n", __func__, strerror(errno));
-        //printf("%s: bind error: %s\n", __func__, hstrerror(h_errno));
-        close(sock);
+        LOG_ERROR("%s: fopen(%s) error: %s\n", __func__, configFile, strerror(errno));
         return false;
     }
-    
-    // Make the socket async
-    if(!MakeAsync(sock))
+
+    // Read config file
+    char* line{nullptr};
+    size_t len{0};
+    ssize_t nread{0};
+    bool res = true;
+
+    size_t port_len = strlen(CONFIG_NAME_PORT);
+    size_t listen_len = strlen(CONFIG_NAME_LISTEN);
+    size_t route_len = strlen(CONFIG_NAME_ROUTE);
+    size_t event_loop_len = strlen(CONFIG_NAME_EVENT_LOOP);
+    size_t buffer_size_len = strlen(CONFIG_NAME_BUFFER_SIZE);
+    size_t relay_len = strlen(CONFIG_NAME_RELAY);
+    size_t workers_len = strlen(CONFIG_NAME_WORKERS);
+    size_t listen_backlog_len = strlen(CONFIG_NAME_LISTEN_BACKLOG);
+    size_t accept_batch_len = strlen(CONFIG_NAME_ACCEPT_BATCH);
+    size_t tcp_fastopen_len = strlen(CONFIG_NAME_TCP_FASTOPEN);
+    size_t defer_accept_len = strlen(CONFIG_NAME_DEFER_ACCEPT);
+    size_t socket_options_len = strlen(CONFIG_NAME_SOCKET_OPTIONS);
+    size_t cpu_affinity_len = strlen(CONFIG_NAME_CPU_AFFINITY);
+    size_t loop_histogram_len = strlen(CONFIG_NAME_LOOP_HISTOGRAM);
+    size_t dns_refresh_len = strlen(CONFIG_NAME_DNS_REFRESH);
+    size_t connect_timeout_len = strlen(CONFIG_NAME_CONNECT_TIMEOUT);
+    size_t idle_timeout_len = strlen(CONFIG_NAME_IDLE_TIMEOUT);
+    size_t max_lifetime_len = strlen(CONFIG_NAME_MAX_LIFETIME);
+    size_t drain_timeout_len = strlen(CONFIG_NAME_DRAIN_TIMEOUT);
+    size_t health_check_len = strlen(CONFIG_NAME_HEALTH_CHECK);
+    size_t max_fails_len = strlen(CONFIG_NAME_MAX_FAILS);
+    size_t eject_time_len = strlen(CONFIG_NAME_EJECT_TIME);
+    size_t log_level_len = strlen(CONFIG_NAME_LOG_LEVEL);
+    size_t log_format_len = strlen(CONFIG_NAME_LOG_FORMAT);
+    size_t log_rate_len = strlen(CONFIG_NAME_LOG_RATE);
+    size_t metrics_len = strlen(CONFIG_NAME_METRICS);
+    size_t admin_socket_len = strlen(CONFIG_NAME_ADMIN_SOCKET);
+
+    // The routes go to the listener of the last "listen:" line (the first
+    // listener if before any)
+    int block = 0;
+    while((nread = getline(&line, &len, stream)) != -1) 
     {
-        printf("%s: make_async(proxy_sock) failed\n", __func__);
-        close(sock);
-        return false;
-    }
+        char* ptr = TrimString(line);
+
+        if(strncasecmp(ptr, CONFIG_NAME_PORT, port_len) == 0 ||
+           strncasecmp(ptr, CONFIG_NAME_LISTEN, listen_len) == 0)
+        {
+            // Got a listener: "<address> [option ...]". Note: "port: <port>"
+            // is "listen: <port>".
+            char* name = TrimString(ptr + (tolower(*ptr) == 'p' ? port_len : listen_len));
+            char* options = name + strcspn(name, " \t");
+            if(*options != '\0')
+                *options++ = '\0';
+            if(!AddListener(name, TrimString(options)))
+            {
+                res = false;
+                break;
+            }
+            block = listener_count - 1;
+
+            // Print the startup message
+            if(listener_count == 1)
+            {
+                timeval tv;
+                gettimeofday(&tv,nullptr);
+                char time_str[40]{};
+                strftime(time_str, sizeof(time_str), "%Y.%m.%d %H:%M:%S", localtime(&tv.tv_sec));
+                LOG_INFO("------- Starting TCP proxy on %s%s at %s ------- \n",
+                         (listeners[0].dual_stack ? "port " : ""), name, time_str);
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_ROUTE, route_len) == 0)
+        {
+            // Got a route
+            if(!AddRoute(ptr + route_len, true, block))
+            {
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_EVENT_LOOP, event_loop_len) == 0)
+        {
+            // Got an event loop backend name
+            char format[16]{};
+            sprintf(format, "%%%zus", sizeof(loop_name) - 1);
+            if(sscanf(ptr + event_loop_len, format, loop_name) != 1)
+            {
+                LOG_ERROR("%s: Invalid event loop specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_BUFFER_SIZE, buffer_size_len) == 0)
+        {
+            // Got a default buffer size
+            if(!ParseSize(TrimString(ptr + buffer_size_len), buffer_size) ||
+               buffer_size < MIN_BUFSIZE || buffer_size > MAX_BUFSIZE)
+            {
+                LOG_ERROR("%s: Invalid buffer size specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_RELAY, relay_len) == 0)
+        {
+            // Got a default relay mode
+            if(!ParseRelayMode(TrimString(ptr + relay_len), relay))
+            {
+                LOG_ERROR("%s: Invalid relay mode specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_WORKERS, workers_len) == 0)
+        {
+            // Got a number of workers
+            if(sscanf(ptr + workers_len, "%d", &worker_count) != 1 ||
+               worker_count < 1 || worker_count > MAX_WORKERS)
+            {
+                LOG_ERROR("%s: Invalid number of workers specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_LISTEN_BACKLOG, listen_backlog_len) == 0)
+        {
+            // Got a listen backlog
+            if(sscanf(ptr + listen_backlog_len, "%d", &listen_backlog) != 1 || listen_backlog < 1)
+            {
+                LOG_ERROR("%s: Invalid listen backlog specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_ACCEPT_BATCH, accept_batch_len) == 0)
+        {
+            // Got a number of connections to accept per loop iteration
+            if(sscanf(ptr + accept_batch_len, "%d", &accept_batch) != 1 || accept_batch < 1)
+            {
+                LOG_ERROR("%s: Invalid accept batch specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_TCP_FASTOPEN, tcp_fastopen_len) == 0)
+        {
+            // Got a TCP Fast Open queue length of the listener
+            if(sscanf(ptr + tcp_fastopen_len, "%d", &tcp_fastopen) != 1 || tcp_fastopen < 0)
+            {
+                LOG_ERROR("%s: Invalid TCP fast open queue specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_DEFER_ACCEPT, defer_accept_len) == 0)
+        {
+            // Got a time to wait for the data before accepting the connection
+            uint64_t ms = 0;
+            if(!ParseTime(TrimString(ptr + defer_accept_len), ms))
+            {
+                LOG_ERROR("%s: Invalid defer accept time specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+            defer_accept = (int)((ms + 999) / 1000);
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_SOCKET_OPTIONS, socket_options_len) == 0)
+        {
+            // Got the default socket options, the same as the route ones
+            RouteOptions opts;
+            if(!ParseRouteOptions(ptr + socket_options_len, opts))
+            {
+                res = false;
+                break;
+            }
+            SocketOptions sock = opts.sock;
+            opts.sock = SocketOptions();
+            if(!(opts == RouteOptions()))
+            {
+                LOG_ERROR("%s: Only socket options allowed: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+            sock_opts = sock.Merge(sock_opts);
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_CPU_AFFINITY, cpu_affinity_len) == 0)
+        {
+            // Got CPU affinity flag
+            const char* val = TrimString(ptr + cpu_affinity_len);
+            if(strcasecmp(val, "on") == 0 || strcasecmp(val, "true") == 0)
+                cpu_affinity = true;
+            else if(strcasecmp(val, "off") == 0 || strcasecmp(val, "false") == 0)
+                cpu_affinity = false;
+            else
+            {
+                LOG_ERROR("%s: Invalid CPU affinity specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_LOOP_HISTOGRAM, loop_histogram_len) == 0)
+        {
+            // Got the event loop dispatch time histogram flag
+            int flag = 0;
+            if(!ParseFlag(TrimString(ptr + loop_histogram_len), flag))
+            {
+                LOG_ERROR("%s: Invalid loop histogram flag specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+            loop_histogram = (flag != 0);
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_DNS_REFRESH, dns_refresh_len) == 0)
+        {
+            // Got a host names refresh interval
+            if(sscanf(ptr + dns_refresh_len, "%d", &dns_refresh) != 1 || dns_refresh < 0)
+            {
+                LOG_ERROR("%s: Invalid DNS refresh interval specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_CONNECT_TIMEOUT, connect_timeout_len) == 0)
+        {
+            // Got a default connect timeout
+            if(!ParseTime(TrimString(ptr + connect_timeout_len), connect_timeout))
+            {
+                LOG_ERROR("%s: Invalid connect timeout specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_IDLE_TIMEOUT, idle_timeout_len) == 0)
+        {
+            // Got a default idle timeout
+            if(!ParseTime(TrimString(ptr + idle_timeout_len), idle_timeout))
+            {
+                LOG_ERROR("%s: Invalid idle timeout specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_MAX_LIFETIME, max_lifetime_len) == 0)
+        {
+            // Got a default max session lifetime
+            if(!ParseTime(TrimString(ptr + max_lifetime_len), max_lifetime))
+            {
+                LOG_ERROR("%s: Invalid max lifetime specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_DRAIN_TIMEOUT, drain_timeout_len) == 0)
+        {
+            // Got a default drain timeout
+            if(!ParseTime(TrimString(ptr + drain_timeout_len), drain_timeout))
+            {
+                LOG_ERROR("%s: Invalid drain timeout specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_HEALTH_CHECK, health_check_len) == 0)
+        {
+            // Got a target health check interval
+            if(!ParseTime(TrimString(ptr + health_check_len), health_interval))
+            {
+                LOG_ERROR("%s: Invalid health check interval specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_MAX_FAILS, max_fails_len) == 0)
+        {
+            // Got a number of connect errors to eject the target
+            if(sscanf(ptr + max_fails_len, "%d", &max_fails) != 1 || max_fails < 0)
+            {
+                LOG_ERROR("%s: Invalid max fails specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_EJECT_TIME, eject_time_len) == 0)
+        {
+            // Got a time to eject the target for
+            if(!ParseTime(TrimString(ptr + eject_time_len), eject_time) || eject_time == 0)
+            {
+                LOG_ERROR("%s: Invalid eject time specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_LOG_LEVEL, log_level_len) == 0)
+        {
+            // Got a log level
+            if(!CLog::ParseLevel(TrimString(ptr + log_level_len), CLog::level))
+            {
+                LOG_ERROR("%s: Invalid log level specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+            if(CLog::level > LOG_MAX_LEVEL)
+                LOG_WARNING("%s: The messages above log level %d are compiled out of this build: '%s'\n",
+                            __func__, (int)LOG_MAX_LEVEL, ptr);
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_LOG_FORMAT, log_format_len) == 0)
+        {
+            // Got a log format
+            if(!CLog::ParseFormat(TrimString(ptr + log_format_len), CLog::format))
+            {
+                LOG_ERROR("%s: Invalid log format specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_LOG_RATE, log_rate_len) == 0)
+        {
+            // Got a log rate limit
+            if(sscanf(ptr + log_rate_len, "%u", &CLog::rate) != 1)
+            {
+                LOG_ERROR("%s: Invalid log rate specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_METRICS, metrics_len) == 0)
+        {
+            // Got a metrics listener address. Note: It's checked on start (see MakeMetrics)
+            const char* val = TrimString(ptr + metrics_len);
+            if(*val == '\0' || strlen(val) >= sizeof(metrics_addr))
+            {
+                LOG_ERROR("%s: Invalid metrics address specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+            strcpy(metrics_addr, val);
+        }
+        else if(strncasecmp(ptr, CONFIG_NAME_ADMIN_SOCKET, admin_socket_len) == 0)
+        {
+            // Got the admin socket path
+            const char* val = TrimString(ptr + admin_socket_len);
+            if(*val == '\0' || strlen(val) >= sizeof(admin_path))
+            {
+                LOG_ERROR("%s: Invalid admin socket path specified: '%s'\n", __func__, ptr);
+                res = false;
+                break;
+            }
+            strcpy(admin_path, val);
+        }
+    }
+
+    if(res && listener_count == 0)
+    {
+        LOG_ERROR("%s: No port to listen on specified\n", __func__);
+        res = false;
+    }
+    
+    // Note: The routes read before "workers:" got the whole rate
+    for(Route* rt = FirstRoute(); rt != nullptr && res; rt = NextRoute(rt))
+    {
+        rt->shape_in.Init(WorkerShare(rt->opts.rate_in), now_ms);
+        rt->shape_out.Init(WorkerShare(rt->opts.rate_out), now_ms);
+    }
+
+    // The default admin socket path (see MakeAdminSocket)
+    if(res && admin_path[0] == '\0' &&
+       snprintf(admin_path, sizeof(admin_path), "/tmp/%s.sock", base_name) >= (int)sizeof(admin_path))
+    {
+        LOG_ERROR("%s: Admin socket path is too long\n", __func__);
+        res = false;
+    }
+
+    free(line);
+    fclose(stream);
+    return res;
+}
+
+bool CTcpProxy::MakeResolver()
+{
+    resolver = new (std::nothrow) CResolver(dns_refresh);
+    if(resolver == nullptr)
+    {
+        LOG_ERROR("%s: Out of memory: resolver is NULL\n", __func__);
+        return false;
+    }
+    
+    if(!resolver->Start() || 
+       !CallbackAdd(resolver->GetFd(), -1, &CTcpProxy::OnResolve, nullptr, EVENT_READ, 0))
+    {
+        LOG_ERROR("%s: Failed to start resolver\n", __func__);
+        return false;
+    }
+    
+    // Resolve the host names of the configured targets
+    for(Route* rt = FirstRoute(); rt != nullptr; rt = NextRoute(rt))
+    {
+        for(int i = 0; i < rt->target_count; i++)
+        {
+            if(rt->targets[i].ip_family == 0 && !resolver->Add(rt->targets[i].host))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool CTcpProxy::MakeSignalPipe()
+{
+    // Note: The signal handler only writes the signal number to the pipe,
+    // and the event loop handles it (see OnSignal)
+    if(pipe(signal_fds) < 0)
+    {
+        LOG_ERROR("%s: pipe error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    
+    if(!MakeNonBlocking(signal_fds[0]) || !MakeNonBlocking(signal_fds[1]) ||
+       !CallbackAdd(signal_fds[0], -1, &CTcpProxy::OnSignal, nullptr, EVENT_READ, 0))
+        return false;
+    
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &CTcpProxy::SignalHandler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if(sigaction(SIGHUP, &sa, nullptr) < 0)
+    {
+        LOG_ERROR("%s: sigaction(SIGHUP) error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void CTcpProxy::SignalHandler(int sig)
+{
+    // Note: Only async-signal-safe calls here
+    int saved_errno = errno;
+    unsigned char c = (unsigned char)sig;
+    if(write(signal_fds[1], &c, 1) < 0)
+    {
+        // The pipe is full, so the signal is pending anyway
+    }
+    errno = saved_errno;
+}
+
+// Called by the event loop when a signal is caught
+void CTcpProxy::OnSignal(int fd)
+{
+    bool reload = false;
+    unsigned char sigs[64];
+    ssize_t n = 0;
+    while((n = read(fd, sigs, sizeof(sigs))) > 0 || (n < 0 && errno == EINTR))
+    {
+        for(ssize_t i = 0; i < n; i++)
+            reload = reload || (sigs[i] == SIGHUP);
+    }
+    
+    // Note: Several signals in a row reload the config once
+    if(reload)
+    {
+        LOG_INFO("%s: SIGHUP, reloading the config\n", __func__);
+        Reload();
+    }
+}
+
+bool CTcpProxy::MakeCmdPipe()
+{
+    if(base_name[0] == '\0')
+        return false;
+
+    // Open fifo to listen on the commands sent to the process
+    char fifo_name[PATH_MAX]{};
+    sprintf(fifo_name, "/tmp/%s.cmd", base_name);
+    
+    // Remove fifo if existed from previous run. It's OK if it doesn't exist
+    unlink(fifo_name);
+    
+    // Make fifo
+    if(mkfifo(fifo_name, S_IRUSR | S_IWUSR | S_IWGRP) == -1 && errno != EEXIST)
+    {
+        LOG_ERROR("%s: mkfifo error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    
+    // Open nonblocking
+    int fifo = open(fifo_name, O_RDONLY | O_NONBLOCK);
+    if(fifo == -1)
+    {
+        LOG_ERROR("%s: open error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    
+    // Add fifo callback
+    if(!CallbackAdd(fifo, -1, &CTcpProxy::OnCommand, nullptr, EVENT_READ, CMD_BUFSIZE))
+    {
+        close(fifo);
+        return false;
+    }
+    return true;
+}
+
+bool CTcpProxy::Start(bool upgrade)
+{
+    // Make sure we have a valid base name
+    if(base_name[0] == '\0')
+        return false;
+
+    // Make sure that no other instances of TcpProxy are running. Note: On
+    // upgrade, the running instance releases the lock once it hands over
+    // its listeners (see HandoffListeners).
+    if(!upgrade && IsProcessRunning())
+        return false;
+
+    // Read configuration (port, routes, etc.).
+    // Start writing the log off the event loop.
+    // Create event loop backend.
+    // Start resolving target host names.
+    // Reload the config on SIGHUP.
+    // Listen on the admin socket for the batches of commands.
+    // Take over the listeners of the running instance (upgrade only).
+    // Listen on the metrics connections (if configured).
+    // Open fifo to listen on the commands sent to the process.
+    // Start other workers (if any).
+    // Note: On upgrade, everything that might fail is done before the running
+    // instance hands over its listeners (and stops accepting). Past that the
+    // listeners are this instance's only, so it keeps going without the fifo,
+    // the metrics or the workers failed to start (the main worker accepts on
+    // their sockets, see Listen).
+    bool res = false;
+    bool started = false;
+    if(ReadConfig(conf_name) && CLog::Start() && MakeEventLoop() && MakeResolver() && MakeSignalPipe() &&
+       MakeAdminSocket(upgrade) && (upgrade || MakeMetrics()) &&
+       (!upgrade || (TakeListeners() && !IsProcessRunning(true))))
+    {
+        if(upgrade)
+        {
+            MoveAdminSocket();
+            MakeMetrics();
+        }
+        bool cmd_pipe = MakeCmdPipe();
+        bool workers_started = StartWorkers();
+        if((cmd_pipe && workers_started) || upgrade)
+        {
+            // Start to listen
+            SetCpuAffinity();
+            keep_running = true;
+            started = true;
+            pthread_mutex_lock(&loop_mutex);
+            res = Listen();
+            pthread_mutex_unlock(&loop_mutex);
+        }
+    }
+    
+    // Wait for other workers to finish, and write the rest of the log
+    StopWorkers();
+    CLog::Stop();
+
+    // Remove command fifo, admin socket & lock file (and the Unix sockets
+    // listened on). Note: They belong to the new instance after the upgrade,
+    // and to the running instance if the upgrade fails before the handoff.
+    if(upgrade && lock_fd < 0)
+    {
+        char fname[sizeof(admin_path) + 8]{};
+        snprintf(fname, sizeof(fname), "%s%s", admin_path, ADMIN_UPGRADE_SUFFIX);
+        unlink(fname);
+    }
+    else if(!handed_off)
+    {
+        char fname[PATH_MAX]{};
+        sprintf(fname, "/tmp/%s.cmd", base_name);
+        unlink(fname);
+        unlink(admin_path);
+        for(int i = 0; i < listener_count && started; i++)
+        {
+            if(listeners[i].addr.ss_family == AF_UNIX)
+                unlink(((const sockaddr_un&)listeners[i].addr).sun_path);
+        }
+
+        sprintf(fname, "/tmp/%s.lock", base_name);
+        unlink(fname);
+    }
+
+    return res;
+}
+ 
+bool CTcpProxy::Listen()
+{
+    if(!keep_running)
+    {
+        // We failed somewhere during initializatin and should't be running
+        return false;
+    }
+    
+    for(int i = 0; i < listener_count; i++)
+    {
+        // Note: The main worker only listens on the Unix socket
+        Listener& l = listeners[i];
+        if(l.addr.ss_family == AF_UNIX && worker_id != 0)
+            continue;
+        
+        // Use the listening socket taken over on upgrade (if any), so the
+        // connections waiting to be accepted are not reset
+        int sock = l.inherited_fd;
+        if(sock >= 0)
+            LOG_INFO("%s: fd=%d, worker=%d, took over the listening socket of %s\n", __func__, sock, worker_id, l.name);
+        else
+            sock = MakeListener(l);
+        if(sock < 0)
+            return false;
+        
+        // Add callback
+        if(!CallbackAdd(sock, -1, &CTcpProxy::OnConnect, nullptr, EVENT_READ, 0))
+        {
+            close(sock);
+            return false;
+        }
+        cb[sock].listener = i;
+        l.fd = sock;
+        
+        // Success
+        LOG_INFO("%s: fd=%d, worker=%d, listening for incomming connections on %s....\n", __func__, sock, worker_id, l.name);
+    }
+    
+    // The main worker accepts on the rest of the sockets taken over (if the
+    // running instance had more workers)
+    for(int i = 0; worker_id == 0 && i < inherited_count; i++)
+    {
+        int listener = inherited_listeners[i];
+        if(listener < 0)
+            continue;
+        
+        int k = 0; // The socket is the k-th one of the listener
+        for(int j = 0; j < i; j++)
+            k += (inherited_listeners[j] == listener);
+        if(k == 0 || (k < worker_count && listeners[listener].addr.ss_family != AF_UNIX &&
+                      workers != nullptr && workers[k-1].running))
+            continue; // Taken by the worker k
+        
+        if(!CallbackAdd(inherited_fds[i], -1, &CTcpProxy::OnConnect, nullptr, EVENT_READ, 0))
+            close(inherited_fds[i]);
+        else
+            cb[inherited_fds[i]].listener = listener;
+    }
+    
+    // Pre-connect target sockets of the routes with the pool
+    for(Route* rt = FirstRoute(); rt != nullptr; rt = NextRoute(rt))
+    {
+        for(int i = 0; i < rt->target_count; i++)
+            FillPool(rt, i);
+    }
+    
+    // Start the target health checks. Note: The main worker checks all
+    // the targets, and tells the other workers the results.
+    if(worker_id == 0 && health_interval != 0)
+        ProbeTargets();
+    
+    // Enter events loop...
+    while(keep_running)
+    {
+        //printf("%s: CallbackSelect() ...\n", __func__);
+        CallbackSelect();
+        //printf("%s: CallbackSelect() end\n", __func__);
+        
+        // Exit once drained. Note: The main worker waits for the others,
+        // since they exit on their own.
+        if(draining && session_count == 0 && WorkersExited())
+        {
+            LOG_INFO("%s: worker=%d, all sessions closed, exiting\n", __func__, worker_id);
+            keep_running = false;
+        }
+    }
+
+    return true;
+}
+
+bool CTcpProxy::AddListener(const char* name, const char* options)
+{
+    if(listener_count == MAX_LISTENERS)
+    {
+        LOG_ERROR("%s: Too many listeners, max %d: '%s'\n", __func__, MAX_LISTENERS, name);
+        return false;
+    }
+    if(FindListener(name) >= 0)
+    {
+        LOG_ERROR("%s: Duplicated listener: '%s'\n", __func__, name);
+        return false;
+    }
+    
+    // "<port>" (all the addresses), "<ipv4>:<port>", "[<ipv6>]:<port>" or
+    // the path of the Unix socket
+    Listener& l = listeners[listener_count];
+    memset(&l.addr, 0, sizeof(l.addr));
+    if(*name == '/')
+    {
+        sockaddr_un& addr = (sockaddr_un&)l.addr;
+        if(strlen(name) >= sizeof(addr.sun_path))
+        {
+            LOG_ERROR("%s: Unix socket path is too long: '%s'\n", __func__, name);
+            return false;
+        }
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, name);
+        l.addr_len = sizeof(sockaddr_un);
+    }
+    else if(!ParseAddress(name, "::", l.addr, l.addr_len))
+    {
+        LOG_ERROR("%s: Invalid listen address: '%s'\n", __func__, name);
+        return false;
+    }
+    
+    // Options expected format: "name name ..."
+    char option[32]{};
+    int pos = 0;
+    l.proxy_protocol = false;
+    while(sscanf(options, "%31s%n", option, &pos) == 1)
+    {
+        options += pos;
+        if(strcasecmp(option, LISTEN_OPTION_PROXY_PROTOCOL) == 0 && l.addr.ss_family != AF_UNIX)
+        {
+            l.proxy_protocol = true;
+        }
+        else
+        {
+            LOG_ERROR("%s: Invalid listener option: '%s'\n", __func__, option);
+            return false;
+        }
+    }
+    
+    snprintf(l.name, sizeof(l.name), "%s", name);
+    l.dual_stack = (strchr(name, ':') == nullptr && *name != '/');
+    listener_count++;
+    return true;
+}
+
+int CTcpProxy::FindListener(const char* name) const
+{
+    for(int i = 0; i < listener_count; i++)
+    {
+        if(strcmp(listeners[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int CTcpProxy::MakeListener(Listener& l)
+{
+    // Open up the TCP socket the proxy listens on. For "<port>" prefer the
+    // dual-stack IPv6 socket, which accepts IPv4 clients as IPv4-mapped
+    // addresses, and fall back to IPv4 only if IPv6 is not supported by
+    // the system.
+    sockaddr_storage proxy_addr = l.addr;
+    socklen_t proxy_addr_len = l.addr_len;
+    
+    int sock = socket(proxy_addr.ss_family, SOCK_STREAM, 0);
+    if(sock >= 0 && l.dual_stack)
+    {
+        int v6only = 0;
+        if(setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0)
+        {
+            LOG_ERROR("%s: setsockopt(IPV6_V6ONLY) error: %s\n", __func__, strerror(errno));
+            close(sock);
+            return -1;
+        }
+    }
+    else if(sock < 0 && errno == EAFNOSUPPORT && l.dual_stack)
+    {
+        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        
+        // Bind the socket to all local addresses
+        sockaddr_in& addr = (sockaddr_in&)proxy_addr;
+        in_port_t port = ((const sockaddr_in6&)l.addr).sin6_port;
+        memset(&proxy_addr, 0, sizeof(proxy_addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = port;
+        proxy_addr_len = sizeof(sockaddr_in);
+    }
+    
+    if(sock < 0)
+    {
+        LOG_ERROR("%s: socket error: %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    
+    int flag = 1;
+    if(proxy_addr.ss_family == AF_UNIX)
+    {
+        // Remove the socket left by the instance not stopped clean. Note: The
+        // lock file keeps the other instances from running.
+        unlink(((const sockaddr_un&)proxy_addr).sun_path);
+    }
+    else if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0)
+    {
+        LOG_ERROR("%s: setsockopt(SO_REUSEADDR) error: %s\n", __func__, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    
+    // Every worker has its own listening socket bound to the same port,
+    // so the kernel load balances incoming connections between them.
+    if(worker_count > 1 && proxy_addr.ss_family != AF_UNIX)
+    {
+#if defined(SO_REUSEPORT_LB)
+        int opt = SO_REUSEPORT_LB; // FreeBSD: SO_REUSEPORT doesn't load balance
+        const char* opt_name = "SO_REUSEPORT_LB";
+#else
+        int opt = SO_REUSEPORT;
+        const char* opt_name = "SO_REUSEPORT";
+#endif
+        if(setsockopt(sock, SOL_SOCKET, opt, &flag, sizeof(flag)) < 0)
+        {
+            LOG_ERROR("%s: setsockopt(%s) error: %s\n", __func__, opt_name, strerror(errno));
+            close(sock);
+            return -1;
+        }
+    }
+    
+    if(bind(sock, (struct sockaddr*)&proxy_addr, proxy_addr_len) < 0)
+    {
+        LOG_ERROR("%s: bind %s error: %s\n", __func__, l.name, strerror(errno));
+        //printf("%s: bind error: %s\n", __func__, hstrerror(h_errno));
+        close(sock);
+        return -1;
+    }
+    
+    // Make the socket async and tune it
+    if(!MakeAsync(sock) || !SetListenerOptions(sock))
+    {
+        LOG_ERROR("%s: failed to setup proxy_sock\n", __func__);
+        close(sock);
+        return -1;
+    }
+    
+    // Start listening...
+    if(listen(sock, listen_backlog) != 0)
+    {
+        LOG_ERROR("%s: listen error: %s\n", __func__, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    
+    return sock;
+}
+
+// Called by the event loop when ready to read connected socket
+void CTcpProxy::OnRead(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr)
+    {
+        LOG_ERROR("%s: fd=%d, cb is NULL\n", __func__, fd);
+        return;
+    }
+    
+    // Note: Idle timer checks the activity time when it expires
+    if(cb->session != nullptr)
+        cb->session->active_ms = now_ms;
+    
+    // Write to peer socket buffer
+    int peer_fd = cb->peer_fd;
+    Callback* peer_cb = GetCallback(peer_fd);
+    if(peer_cb == nullptr)
+    {
+        LOG_ERROR("%s: fd=%d, peer_fd=%d: peer_cb=nullptr\n", __func__, fd, peer_fd);
+        CloseSock(fd, peer_fd);
+        return;
+    }
+    
+    // Note: The event loop might be edge-triggered, so keep reading until
+    // the socket is drained. If peer buffer is full, then stop waiting for
+    // the socket to become readable until the peer has written its buffer
+    // out (see Flush).
+    while(true)
+    {
+        if(!GetBuffer(peer_cb))
+        {
+            CloseSock(fd, peer_fd);
+            break;
+        }
+        
+        if(peer_cb->len == peer_cb->size)
+        {
+            // Still have data to write from previous read
+            CallbackModify(fd, cb->events & ~EVENT_READ);
+            break;
+        }
+        
+        size_t limit = ShapeLimit(cb->session, fd);
+        if(limit == 0)
+        {
+            // Out of the route's rate, resume later (see OnTimer)
+            PutBuffer(peer_cb);
+            ThrottleRead(cb->session, fd);
+            break;
+        }
+        
+        // Note: Read into both segments of the free space (if the data
+        // wraps around the end of the buffer) with one call
+        iovec iov[2];
+        int iov_count = peer_cb->SpaceVec(iov, limit);
+        ssize_t n = readv(fd, iov, iov_count);
+        
+        if(n == 0)
+        {
+            // The client has shut down its side of the connection. Note:
+            // The other direction keeps relaying until it's shut down too.
+            LOG_DEBUG("%s: fd=%d, the client closed the connection\n", __func__, fd);
+            PutBuffer(peer_cb);
+            ReadEof(fd);
+            break;
+        }
+        else if(n < 0)
+        {
+            // Client communication error
+            if(errno == EINTR)
+                continue;
+            
+            if(errno != EAGAIN)
+            {
+                LOG_ERROR("%s: fd=%d, read error: %s\n", __func__, fd, strerror(errno));
+                CloseSock(fd, peer_fd);
+            }
+            else
+            {
+                // Nothing to write, so the idle session holds no buffer
+                PutBuffer(peer_cb);
+            }
+            break;
+        }
+        
+        // Success. Write to peer right away, since the edge-triggered
+        // event loop won't report already writable peer socket again.
+        CountBytes(cb->session, fd, n);
+        peer_cb->len += n;
+        if(!Flush(peer_fd))
+            break; // Note: cb and peer_cb are no longer valid
+    }
+}
+
+// Called by the event loop when ready to write connected socket
+void CTcpProxy::OnWrite(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr)
+    {
+        LOG_ERROR("%s: fd=%d, cb is NULL\n", __func__, fd);
+        return;
+    }
+    
+    // Note: The socket is also writable when pending connect completes
+    Flush(fd);
+}
+
+// Write the buffered data to the socket and update the events to wait for.
+// Returns false if the socket has been closed because of the write error.
+bool CTcpProxy::Flush(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr)
+        return false;
+    
+    while(cb->len > 0)
+    {
+        // Note: The data might wrap around the end of the ring buffer,
+        // so both of its segments are written with one call.
+        iovec iov[2];
+        int iov_count = cb->DataVec(iov);
+        ssize_t n = writev(fd, iov, iov_count);
+        
+        if(n == 0)
+        {
+            LOG_ERROR("%s: fd=%d, write error EOF: %s\n", __func__, fd, strerror(errno));
+            CloseSock(fd, cb->peer_fd); // Note: cb is no longer valid
+            return false;
+        }
+        else if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            
+            if(errno != EAGAIN)
+            {
+                LOG_ERROR("%s: fd=%d, write error: %s\n", __func__, fd, strerror(errno));
+                CloseSock(fd, cb->peer_fd); // Note: cb is no longer valid
+                return false;
+            }
+            break; // Wait for the socket to become writable
+        }
+        
+        // Success. Just move the head past the data written
+        cb->Consume(n);
+    }
+    
+    // Put the buffer back to the pool once the data is written out
+    PutBuffer(cb);
+    FlushEvents(fd, cb->len < cb->size);
+    
+    // Pass the peer's EOF on once all its data is written out
+    Callback* peer_cb = (cb->peer_fd >= 0 ? GetCallback(cb->peer_fd) : nullptr);
+    if(cb->len == 0 && peer_cb != nullptr && peer_cb->eof)
+        return ShutdownWrite(fd);
+    return true;
+}
+
+// Called when EOF is read from the socket: stop reading it, and shut down
+// the peer's writing side once the data read before is written out, so the
+// peer gets FIN right after the last byte (see Flush).
+// Returns false if the session has been closed.
+bool CTcpProxy::ReadEof(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr)
+        return false;
+    
+    cb->eof = true;
+    CallbackModify(fd, cb->events & ~EVENT_READ);
+    
+    // Start to drain the half-closed session (see OnTimer)
+    Session* s = cb->session;
+    if(s != nullptr && s->eof_ms == 0)
+    {
+        s->eof_ms = now_ms;
+        SessionTimer(s);
+    }
+    
+    int peer_fd = cb->peer_fd;
+    Callback* peer_cb = GetCallback(peer_fd);
+    if(peer_cb == nullptr)
+    {
+        CloseSock(fd, peer_fd);
+        return false;
+    }
+    
+    if(peer_cb->len == 0)
+        return ShutdownWrite(peer_fd);
+    return true;
+}
+
+// Send FIN to the socket. The session is closed once both sides got FIN.
+// Returns false if the session has been closed.
+bool CTcpProxy::ShutdownWrite(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr)
+        return false;
+    
+    if(cb->shut)
+        return true; // Already shut down
+    
+    int peer_fd = cb->peer_fd;
+    if(shutdown(fd, SHUT_WR) < 0)
+    {
+        LOG_ERROR("%s: fd=%d, shutdown error: %s\n", __func__, fd, strerror(errno));
+        CloseSock(fd, peer_fd);
+        return false;
+    }
+    cb->shut = true;
+    
+    Callback* peer_cb = GetCallback(peer_fd);
+    if(peer_cb == nullptr || peer_cb->shut)
+    {
+        LOG_DEBUG("%s: fd=%d, peer_fd=%d, both sides closed the connection\n", __func__, fd, peer_fd);
+        CloseSock(fd, peer_fd);
+        return false;
+    }
+    return true;
+}
+
+// Get the buffer of the data to write to the socket from the pool (if not yet)
+bool CTcpProxy::GetBuffer(Callback* c)
+{
+    if(c->buf == nullptr)
+        c->buf = buffers.Get(c->size);
+    return (c->buf != nullptr);
+}
+
+// Put the buffer back to the pool if there is no data left to write
+void CTcpProxy::PutBuffer(Callback* c)
+{
+    if(c->buf != nullptr && c->len == 0)
+    {
+        buffers.Put(c->buf, c->size);
+        c->buf = nullptr;
+        c->head = 0;
+    }
+}
+
+// Update the events to wait for after writing the buffered data out
+void CTcpProxy::FlushEvents(int fd, bool resume_peer)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr)
+        return;
+    
+    // Wait for the socket to become writable only while there is data left
+    // to write. A connected socket is almost always writable, so the event
+    // loop would never go idle otherwise.
+    CallbackModify(fd, (cb->len > 0 ? cb->events | EVENT_WRITE : cb->events & ~EVENT_WRITE));
+    
+    // Resume reading from the peer if it stopped because our buffer was full
+    int peer_fd = cb->peer_fd;
+    if(resume_peer && peer_fd >= 0)
+    {
+        Callback* peer_cb = GetCallback(peer_fd);
+        if(peer_cb != nullptr && !peer_cb->eof && !(peer_cb->events & EVENT_READ) && 
+           !IsThrottled(peer_cb->session, peer_fd))
+            CallbackModify(peer_fd, peer_cb->events | EVENT_READ);
+    }
+}
+
+#ifdef __linux__
+// Called by the event loop when ready to read connected socket (splice relay)
+void CTcpProxy::OnSpliceRead(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr)
+    {
+        LOG_ERROR("%s: fd=%d, cb is NULL\n", __func__, fd);
+        return;
+    }
+    
+    // Note: Idle timer checks the activity time when it expires
+    if(cb->session != nullptr)
+        cb->session->active_ms = now_ms;
+    
+    // Write to peer pipe
+    int peer_fd = cb->peer_fd;
+    Callback* peer_cb = GetCallback(peer_fd);
+    if(peer_cb == nullptr)
+    {
+        LOG_ERROR("%s: fd=%d, peer_fd=%d: peer_cb=nullptr\n", __func__, fd, peer_fd);
+        CloseSock(fd, peer_fd);
+        return;
+    }
+    
+    // Move the data from the socket to the peer pipe and then right away
+    // from the pipe to the peer socket, without copying it to user space.
+    while(true)
+    {
+        size_t space = peer_cb->size - peer_cb->len;
+        if(space == 0)
+        {
+            // Still have data to write from previous read
+            CallbackModify(fd, cb->events & ~EVENT_READ);
+            break;
+        }
+        
+        size_t limit = ShapeLimit(cb->session, fd);
+        if(limit == 0)
+        {
+            // Out of the route's rate, resume later (see OnTimer)
+            ThrottleRead(cb->session, fd);
+            break;
+        }
+        
+        ssize_t n = splice(fd, nullptr, peer_cb->pipe_fds[1], nullptr, (space < limit ? space : limit),
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        
+        if(n == 0)
+        {
+            // The client has shut down its side of the connection. Note:
+            // The other direction keeps relaying until it's shut down too.
+            LOG_DEBUG("%s: fd=%d, the client closed the connection\n", __func__, fd);
+            ReadEof(fd);
+            break;
+        }
+        else if(n < 0)
+        {
+            // Client communication error
+            if(errno == EINTR)
+                continue;
+            
+            if(errno != EAGAIN)
+            {
+                LOG_ERROR("%s: fd=%d, splice error: %s\n", __func__, fd, strerror(errno));
+                CloseSock(fd, peer_fd);
+            }
+            else if(peer_cb->len > 0)
+            {
+                // Note: EAGAIN also means the pipe is out of buffers. Since we
+                // can't tell which one, stop waiting for the socket to become
+                // readable until the pipe is drained (see SpliceFlush).
+                CallbackModify(fd, cb->events & ~EVENT_READ);
+            }
+            break;
+        }
+        
+        // Success. Write to peer right away
+        CountBytes(cb->session, fd, n);
+        peer_cb->len += n;
+        if(!SpliceFlush(peer_fd))
+            break; // Note: cb and peer_cb are no longer valid
+    }
+}
+
+// Called by the event loop when ready to write connected socket (splice relay)
+void CTcpProxy::OnSpliceWrite(int fd)
+{
+    // Note: The socket is also writable when pending connect completes
+    SpliceFlush(fd);
+}
+
+// Move the data from the pipe to the socket and update the events to wait for.
+// Returns false if the socket has been closed because of the write error.
+bool CTcpProxy::SpliceFlush(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr)
+        return false;
+    
+    while(cb->len > 0)
+    {
+        ssize_t n = splice(cb->pipe_fds[0], nullptr, fd, nullptr, cb->len,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        
+        if(n == 0)
+        {
+            LOG_ERROR("%s: fd=%d, splice error EOF: %s\n", __func__, fd, strerror(errno));
+            CloseSock(fd, cb->peer_fd); // Note: cb is no longer valid
+            return false;
+        }
+        else if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            
+            if(errno != EAGAIN)
+            {
+                LOG_ERROR("%s: fd=%d, splice error: %s\n", __func__, fd, strerror(errno));
+                CloseSock(fd, cb->peer_fd); // Note: cb is no longer valid
+                return false;
+            }
+            break; // Wait for the socket to become writable
+        }
+        
+        // Success
+        cb->len -= n;
+    }
+    
+    // Note: Resume reading from the peer only once the pipe is drained,
+    // since splice() can run out of pipe buffers before the pipe is full.
+    FlushEvents(fd, cb->len == 0);
+    
+    // Pass the peer's EOF on once all its data is written out
+    Callback* peer_cb = (cb->peer_fd >= 0 ? GetCallback(cb->peer_fd) : nullptr);
+    if(cb->len == 0 && peer_cb != nullptr && peer_cb->eof)
+        return ShutdownWrite(fd);
+    return true;
+}
+
+// Make the pipe of the data to write to fd (splice relay).
+// Note: The callback owns the pipe and closes it on remove.
+bool CTcpProxy::MakePipe(int fd, size_t size)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr)
+        return false;
+    
+    if(pipe2(cb->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        LOG_ERROR("%s: fd=%d, pipe2 error: %s\n", __func__, fd, strerror(errno));
+        cb->pipe_fds[0] = cb->pipe_fds[1] = -1;
+        return false;
+    }
+    
+    // Try to resize the pipe to the buffer size. It's OK if it fails,
+    // (i.e. above /proc/sys/fs/pipe-max-size), then use what we've got.
+    fcntl(cb->pipe_fds[1], F_SETPIPE_SZ, (int)size);
+    
+    int n = fcntl(cb->pipe_fds[1], F_GETPIPE_SZ);
+    if(n <= 0)
+    {
+        LOG_ERROR("%s: fd=%d, fcntl(F_GETPIPE_SZ) error: %s\n", __func__, fd, strerror(errno));
+        return false;
+    }
+    
+    cb->size = (size_t)n;
+    return true;
+}
+#else
+// Note: splice() is Linux only, the copying relay is used on other platforms
+void CTcpProxy::OnSpliceRead(int fd) { OnRead(fd); }
+void CTcpProxy::OnSpliceWrite(int fd) { OnWrite(fd); }
+bool CTcpProxy::SpliceFlush(int fd) { return Flush(fd); }
+bool CTcpProxy::MakePipe(int fd, size_t size)
+{
+    LOG_ERROR("%s: splice relay is not supported on this platform\n", __func__);
+    return false;
+}
+#endif // __linux__
+
+// Called by the event loop when ready to read/accept connected socket
+void CTcpProxy::OnConnect(int fd)
+{
+    // Note: The event loop might be edge-triggered, so accept all pending
+    // connections until accept() returns EAGAIN, but no more than the batch
+    // per loop iteration, so the connection storm doesn't starve the relay.
+    int listener = cb[fd].listener; // Note: cb is reallocated as the sockets are added
+    for(int i = 0; keep_running; i++)
+    {
+        if(i == accept_batch)
+        {
+            // Still might have pending connections. Note: Modify re-arms
+            // the events, so the next wait reports the listener again.
+            loop->Modify(fd, cb[fd].events);
+            break;
+        }
+        
+        // Note: sockaddr_storage is large enough for both IPv4 and IPv6 peers
+        socklen_t addr_len = sizeof(sockaddr_storage); // in/out parameter
+        sockaddr_storage source_addr;
+        memset(&source_addr, 0, sizeof(source_addr));
+        
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+        // Note: The accepted socket inherits the socket options of the
+        // listener (SO_KEEPALIVE etc., see MakeAsync), so accept4() makes
+        // it ready to use with no more syscalls.
+        int source_fd = accept4(fd, (sockaddr*)&source_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int source_fd = accept(fd, (sockaddr*)&source_addr, &addr_len);
+        if(source_fd >= 0 && !MakeAsync(source_fd))
+        {
+            LOG_ERROR("%s: fd=%d, make_async(source_fd) failed\n", __func__, source_fd);
+            close(source_fd);
+            continue;
+        }
+#endif
+        if(source_fd < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) // nonblocking, retry
+                LOG_ERROR("%s: fd=%d, accept error: %s\n", __func__, fd, strerror(errno));
+            break;
+        }
+        
+        // Note: The client behind the balancer is routed by the address in
+        // its PROXY header (see OnProxyHeader)
+        stats.accepted.Add(1);
+        if(listeners[listener].proxy_protocol)
+            WaitHeader(source_fd, listener);
+        else
+            NewConnection(source_fd, source_addr, listener, now_ms);
+    }
+}
+
+bool CTcpProxy::WaitHeader(int fd, int listener)
+{
+    HeaderWait* w = new (std::nothrow) HeaderWait;
+    if(w == nullptr || !CallbackAdd(fd, -1, &CTcpProxy::OnProxyHeader, nullptr, EVENT_READ, 0))
+    {
+        LOG_ERROR("%s: fd=%d, failed to wait for the PROXY header\n", __func__, fd);
+        delete w;
+        CloseSock(fd);
+        return false;
+    }
+    
+    w->fd = fd;
+    w->listener = listener;
+    w->start_ms = now_ms;
+    w->prev = header_waits_tail;
+    (header_waits_tail != nullptr ? header_waits_tail->next : header_waits) = w;
+    header_waits_tail = w;
+    cb[fd].header = w;
+    if(!header_timer.IsArmed())
+        timers->Schedule(&header_timer, now_ms + PROXY_HEADER_TIMEOUT_MS);
+    return true;
+}
+
+// Called by the event loop when ready to read the PROXY header of the client
+void CTcpProxy::OnProxyHeader(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr || cb->header == nullptr)
+    {
+        LOG_ERROR("%s: fd=%d, header is NULL\n", __func__, fd);
+        return;
+    }
+    
+    // Peek the rest of the header, and only read (consume) its part, so the
+    // client's data after it is relayed to the target as usual. Note: The
+    // data of the incomplete header is all header.
+    HeaderWait* w = cb->header;
+    ProxyHeader header;
+    int header_len = 0;
+    while(true)
+    {
+        ssize_t n = recv(fd, w->data + w->len, sizeof(w->data) - w->len, MSG_PEEK);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if(n <= 0)
+        {
+            LOG_WARNING("%s: fd=%d, closed before the PROXY header: %s\n", __func__, fd, (n < 0 ? strerror(errno) : "EOF"));
+            stats.rejected.Add(1);
+            CloseSock(fd);
+            return;
+        }
+        
+        header_len = header.Parse(w->data, w->len + n);
+        size_t take = (header_len > 0 ? (size_t)header_len - w->len : (size_t)n);
+        if(header_len < 0 || (header_len == 0 && w->len + n == sizeof(w->data)) || 
+           recv(fd, w->data + w->len, take, 0) != (ssize_t)take)
+        {
+            LOG_WARNING("%s: fd=%d, invalid PROXY header\n", __func__, fd);
+            stats.rejected.Add(1);
+            CloseSock(fd);
+            return;
+        }
+        w->len += take;
+        if(header_len > 0)
+            break;
+    }
+    
+    // The header of the LOCAL (health check) connection or with the unknown
+    // addresses: route by the connection's own ones
+    int listener = w->listener;
+    uint64_t accept_ms = w->start_ms;
+    CallbackRemove(fd); // Note: Deletes the wait
+    if(header.source.ss_family != 0)
+    {
+        NewConnection(fd, header.source, listener, accept_ms, &header.dest);
+        return;
+    }
+    
+    sockaddr_storage addr{};
+    socklen_t addr_len = sizeof(addr);
+    if(getpeername(fd, (sockaddr*)&addr, &addr_len) < 0)
+    {
+        LOG_ERROR("%s: fd=%d, getpeername error: %s\n", __func__, fd, strerror(errno));
+        CloseSock(fd);
+        return;
+    }
+    NewConnection(fd, addr, listener, accept_ms);
+}
+
+void CTcpProxy::ExpireHeaders()
+{
+    // Close the clients that haven't sent the header in time, the oldest first
+    while(header_waits != nullptr && now_ms >= header_waits->start_ms + PROXY_HEADER_TIMEOUT_MS)
+    {
+        LOG_WARNING("%s: fd=%d, no PROXY header in %d ms\n", __func__, header_waits->fd, PROXY_HEADER_TIMEOUT_MS);
+        stats.rejected.Add(1);
+        CloseSock(header_waits->fd); // Note: Deletes the wait
+    }
+    if(header_waits != nullptr)
+        timers->Schedule(&header_timer, header_waits->start_ms + PROXY_HEADER_TIMEOUT_MS);
+}
+
+bool CTcpProxy::QueueProxyHeader(int target_fd, const ProxyHeader& header, int version)
+{
+    // Put the header to the data to write to the target, so it goes first
+    // once the target is connected
+    Callback* cb = GetCallback(target_fd);
+    unsigned char buf[PROXY_HEADER_MAX];
+    size_t len = header.Format(version, buf, sizeof(buf));
+    if(cb == nullptr || len == 0)
+        return false;
+    
+    if(cb->pipe_fds[1] >= 0)
+    {
+        // Splice relay: the pipe of the target is empty yet, so it takes
+        // the header as a whole
+        if(write(cb->pipe_fds[1], buf, len) != (ssize_t)len)
+        {
+            LOG_ERROR("%s: fd=%d, write to pipe error: %s\n", __func__, target_fd, strerror(errno));
+            return false;
+        }
+        cb->len += len;
+        return true;
+    }
+    
+    size_t space = 0;
+    if(!GetBuffer(cb) || cb->Space(space) == nullptr || space < len)
+        return false;
+    memcpy(cb->Space(space), buf, len);
+    cb->len += len;
+    return true;
+}
+
+void CTcpProxy::NewConnection(int source_fd, const sockaddr_storage& source_addr, int listener, uint64_t accept_ms,
+                              const sockaddr_storage* dest_addr)
+{
+    // Note: The clients of the Unix socket have no address, so they match
+    // the route of 0.0.0.0 (i.e. the default one)
+    bool unix_client = (source_addr.ss_family == AF_UNIX);
+    sockaddr_in unix_addr{};
+    unix_addr.sin_family = AF_INET;
+    
+    IpAddr source_ip;
+    if(!source_ip.Set(unix_client ? (const sockaddr*)&unix_addr : (const sockaddr*)&source_addr))
+    {
+        LOG_ERROR("%s: fd=%d, unsupported socket address family\n", __func__, source_fd);
+        CloseSock(source_fd);
+        return;
+    }
+    
+    in_port_t source_port = (source_addr.ss_family == AF_INET ? 
+                             ((const sockaddr_in&)source_addr).sin_port :
+                             (unix_client ? 0 : ((const sockaddr_in6&)source_addr).sin6_port));
+    
+    // Lookup server name and establish control connection
+    char ip_str[INET6_ADDRSTRLEN]{};
+    Route* rt = GetRoute(listener, source_ip);
+    if(rt == nullptr)
+    {
+        LOG_ERROR("%s: fd=%d, GetRoute failed for source_ip=%s\n", __func__, source_fd, 
+                  source_ip.ToString(ip_str, sizeof(ip_str)));
+        stats.rejected.Add(1);
+        CloseSock(source_fd);
+        return;
+    }
+    
+    // Session limits of the route, so a source can't take all the sessions
+    // (and the fds) of the worker
+    size_t max_sessions = (size_t)WorkerShare(rt->opts.max_sessions);
+    size_t max_source_sessions = (size_t)WorkerShare(rt->opts.max_source_sessions);
+    if(max_sessions != 0 && rt->session_count >= max_sessions)
+    {
+        LOG_WARNING("%s: fd=%d, route %s has max %zu sessions in the worker, source_ip=%s\n", __func__, source_fd, 
+                    rt->source_ip, max_sessions, source_ip.ToString(ip_str, sizeof(ip_str)));
+        stats.limited.Add(1);
+        CloseSock(source_fd);
+        return;
+    }
+    if(max_source_sessions != 0 && source_counts.Get(rt, source_ip) >= max_source_sessions)
+    {
+        LOG_WARNING("%s: fd=%d, source_ip=%s has max %zu sessions of route %s in the worker\n", __func__, source_fd, 
+                    source_ip.ToString(ip_str, sizeof(ip_str)), max_source_sessions, rt->source_ip);
+        stats.limited.Add(1);
+        CloseSock(source_fd);
+        return;
+    }
+    
+    int target = SelectTarget(rt, source_ip);
+    if(target < 0)
+    {
+        LOG_ERROR("%s: fd=%d, no available targets for source_ip=%s\n", __func__, source_fd, 
+                  source_ip.ToString(ip_str, sizeof(ip_str)));
+        stats.rejected.Add(1);
+        CloseSock(source_fd);
+        return;
+    }
+    Target& t = rt->targets[target];
+    
+    // The route's socket options of the source (the listener has the default
+    // ones, see SetListenerOptions)
+    if(!unix_client && !(rt->opts.sock == SocketOptions()))
+        SetSocketOptions(source_fd, source_addr.ss_family, rt->opts.sock);
+    
+    // Use the pre-connected target socket (if any), or connect a new one
+    int target_fd = TakePooled(rt, target);
+    bool connected = (target_fd >= 0);
+    if(target_fd < 0)
+        target_fd = ConnectTarget(t, rt->opts.sock.Merge(sock_opts));
+    if(target_fd < 0)
+    {
+        LOG_ERROR("%s: fd=%d, failed to connect to %s:%hu\n", __func__, source_fd, t.ip, t.port);
+        CloseSock(source_fd);
+        return;
+    }
+    
+    // Use route buffer size and relay mode, or the default ones if not set
+    size_t buf_size = (rt->opts.buffer_size != 0 ? rt->opts.buffer_size : buffer_size);
+    RelayMode relay_mode = (rt->opts.relay != RELAY_DEFAULT ? rt->opts.relay : relay);
+    
+    // Add client/server callbacks.
+    // Note: Wait for the target socket to become writable to know when
+    // the pending connect completes (see OnTargetConnect), and don't read
+    // the source until then. Once connected, we only wait for writability
+    // while there is buffered data to write (see Flush).
+    int source_events = (connected ? EVENT_READ : 0);
+    CALLBACK_FUNC connect_fn = (connected ? nullptr : &CTcpProxy::OnTargetConnect);
+    
+    bool res = false;
+    if(relay_mode == RELAY_SPLICE)
+    {
+        // Make a pipe per direction for splice relay
+        res = CallbackAdd(source_fd, target_fd, &CTcpProxy::OnSpliceRead, &CTcpProxy::OnSpliceWrite, source_events, 0) &&
+              CallbackAdd(target_fd, source_fd, (connect_fn ? connect_fn : &CTcpProxy::OnSpliceRead), 
+                          (connect_fn ? connect_fn : &CTcpProxy::OnSpliceWrite), EVENT_READ | EVENT_WRITE, 0) &&
+              MakePipe(source_fd, buf_size) && 
+              MakePipe(target_fd, buf_size);
+        
+        if(!res)
+        {
+            // Fall back to the copying relay
+            LOG_WARNING("%s: fd=%d, failed to setup splice relay, using copy relay\n", __func__, source_fd);
+            for(int fd : {source_fd, target_fd})
+            {
+                if(fd < cb_size)
+                    CallbackRemove(fd);
+            }
+            relay_mode = RELAY_COPY;
+        }
+    }
+    
+    if(relay_mode == RELAY_COPY)
+    {
+        res = CallbackAdd(source_fd, target_fd, &CTcpProxy::OnRead, &CTcpProxy::OnWrite, source_events, buf_size) &&
+              CallbackAdd(target_fd, source_fd, (connect_fn ? connect_fn : &CTcpProxy::OnRead), 
+                          (connect_fn ? connect_fn : &CTcpProxy::OnWrite), EVENT_READ | EVENT_WRITE, buf_size);
+    }
+    
+    if(!res)
+    {
+        LOG_ERROR("%s: fd=%d, failed to add callbacks\n", __func__, source_fd);
+        CloseSock(source_fd, target_fd);
+        return;
+    }
+    
+    // The PROXY header with the client addresses goes before the relayed data
+    if(rt->opts.proxy_protocol != 0)
+    {
+        sockaddr_storage local_addr{};
+        socklen_t local_len = sizeof(local_addr);
+        if(dest_addr == nullptr)
+            getsockname(source_fd, (sockaddr*)&local_addr, &local_len);
+        
+        ProxyHeader header;
+        header.Set(source_addr, (dest_addr != nullptr ? *dest_addr : local_addr));
+        if(!QueueProxyHeader(target_fd, header, rt->opts.proxy_protocol))
+        {
+            LOG_ERROR("%s: fd=%d, failed to queue the PROXY header\n", __func__, source_fd);
+            CloseSock(source_fd, target_fd);
+            return;
+        }
+    }
+    
+    // Add the session to its route. Note: The callbacks keep the pointer
+    // to the session, so we don't need to look it up on close.
+    if(!SessionAdd(rt, target, source_fd, target_fd, connected, source_ip, ntohs(source_port), accept_ms))
+        CloseSock(source_fd, target_fd);
+    else if(connected && relay_mode == RELAY_SPLICE && cb[target_fd].len > 0)
+        SpliceFlush(target_fd); // The PROXY header to the pooled target
+    else if(connected && cb[target_fd].len > 0)
+        Flush(target_fd);
+    
+    // Replace the pre-connected socket taken (if any)
+    FillPool(rt, target);
+}
+
+void CTcpProxy::OnTargetConnect(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr || cb->session == nullptr)
+    {
+        LOG_ERROR("%s: fd=%d, session is NULL\n", __func__, fd);
+        CloseSock(fd, (cb != nullptr ? cb->peer_fd : -1));
+        return;
+    }
+    
+    // Pending connect completes (successfully or not)
+    Session* s = cb->session;
+    Target& t = s->route->targets[s->target];
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    
+    if(err != 0)
+    {
+        LOG_ERROR("%s: fd=%d, connect to %s:%hu error: %s\n", __func__, fd, t.ip, t.port, strerror(err));
+        TargetFailed(t);
+        CloseSession(s);
+        return;
+    }
+    TargetConnected(t, now_ms - s->start_ms);
+    
+    // Start relaying: Switch the target to the relay callbacks, and read the
+    // source. Note: Modify re-arms the events, so the data already received
+    // is reported by the next wait.
+    s->connected = true;
+    s->connect_ms = now_ms;
+    int source_fd = s->source_fd;
+    bool splice = (cb->pipe_fds[0] >= 0);
+    cb->read_fn = (splice ? &CTcpProxy::OnSpliceRead : &CTcpProxy::OnRead);
+    cb->write_fn = (splice ? &CTcpProxy::OnSpliceWrite : &CTcpProxy::OnWrite);
+    if(!CallbackModify(fd, EVENT_READ) || !CallbackModify(source_fd, EVENT_READ))
+    {
+        CloseSession(s);
+        return;
+    }
+    SessionTimer(s);
+    
+    // Write the PROXY header (if any)
+    if(cb->len > 0 && splice)
+        SpliceFlush(fd);
+    else if(cb->len > 0)
+        Flush(fd);
+}
+
+void CTcpProxy::OnTimer(Session* s)
+{
+    const RouteOptions& opts = s->route->opts;
+    uint64_t timeout = GetTimeout(opts.connect_timeout, connect_timeout);
+    uint64_t idle = GetTimeout(opts.idle_timeout, idle_timeout);
+    uint64_t lifetime = GetTimeout(opts.max_lifetime, max_lifetime);
+    uint64_t drain = GetTimeout(opts.drain_timeout, drain_timeout);
+    Target& t = s->route->targets[s->target];
+    
+    // Resume reading the side(s) throttled by the rate limit
+    if(s->throttled != 0 && now_ms >= s->resume_ms)
+        ResumeRead(s);
+    
+    if(!s->connected && timeout != 0 && now_ms >= s->start_ms + timeout)
+    {
+        LOG_WARNING("%s: fd=%d, connect to %s:%hu timed out\n", __func__, s->target_fd, t.ip, t.port);
+        TargetFailed(t);
+    }
+    else if(s->connected && !s->pooled && lifetime != 0 && now_ms >= s->start_ms + lifetime)
+    {
+        LOG_WARNING("%s: fd=%d, session to %s:%hu reached max lifetime\n", __func__, s->source_fd, t.ip, t.port);
+    }
+    else if(s->connected && !s->pooled && s->eof_ms != 0 && drain != 0 && now_ms >= s->eof_ms + drain)
+    {
+        // Reset both sides (SO_LINGER with zero timeout), so the kernel
+        // drops the data not read by the peer rather than keeps sending it.
+        LOG_WARNING("%s: fd=%d, session to %s:%hu drain timed out\n", __func__, s->source_fd, t.ip, t.port);
+        linger lg{1, 0};
+        for(int fd : {s->source_fd, s->target_fd})
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    else if(s->connected && !s->pooled && idle != 0 && now_ms >= s->active_ms + idle)
+    {
+        LOG_WARNING("%s: fd=%d, session to %s:%hu is idle\n", __func__, s->source_fd, t.ip, t.port);
+    }
+    else
+    {
+        // The session was active since the timer was armed
+        SessionTimer(s);
+        return;
+    }
+    CloseSession(s);
+}
+
+void CTcpProxy::SessionTimer(Session* s)
+{
+    // Arm the session timer for the nearest timeout. Note: The idle timer
+    // isn't re-armed on every read, instead it checks the activity time
+    // when it expires.
+    const RouteOptions& opts = s->route->opts;
+    uint64_t expires = 0;
+    if(!s->connected)
+    {
+        uint64_t timeout = GetTimeout(opts.connect_timeout, connect_timeout);
+        if(timeout != 0)
+            expires = s->start_ms + timeout;
+    }
+    else if(!s->pooled)
+    {
+        uint64_t idle = GetTimeout(opts.idle_timeout, idle_timeout);
+        uint64_t lifetime = GetTimeout(opts.max_lifetime, max_lifetime);
+        uint64_t drain = GetTimeout(opts.drain_timeout, drain_timeout);
+        if(idle != 0)
+            expires = s->active_ms + idle;
+        if(lifetime != 0 && (expires == 0 || s->start_ms + lifetime < expires))
+            expires = s->start_ms + lifetime;
+        if(s->eof_ms != 0 && drain != 0 && (expires == 0 || s->eof_ms + drain < expires))
+            expires = s->eof_ms + drain;
+        if(s->throttled != 0 && (expires == 0 || s->resume_ms < expires))
+            expires = s->resume_ms;
+    }
+    
+    if(expires != 0)
+        timers->Schedule(&s->timer, expires);
+    else
+        timers->Cancel(&s->timer);
+}
+
+void CTcpProxy::ThrottleRead(Session* s, int fd)
+{
+    // Stop reading fd until the route's bucket has refilled. Note: The timer
+    // wakes the session up, so the event loop doesn't spin on the readable
+    // socket in the meanwhile.
+    const TokenBucket& bucket = (fd == s->source_fd ? s->route->shape_in : s->route->shape_out);
+    uint64_t resume_ms = now_ms + bucket.WaitMs();
+    if(s->throttled == 0 || resume_ms < s->resume_ms)
+        s->resume_ms = resume_ms;
+    s->throttled |= (fd == s->source_fd ? Session::THROTTLE_SOURCE : Session::THROTTLE_TARGET);
+    CallbackModify(fd, cb[fd].events & ~EVENT_READ);
+    SessionTimer(s);
+}
+
+void CTcpProxy::ResumeRead(Session* s)
+{
+    // Note: Modify re-arms the events, so the data already received is
+    // reported by the next wait. The reader stops again if the peer's
+    // buffer is still full.
+    int throttled = s->throttled;
+    s->throttled = 0;
+    if(throttled & Session::THROTTLE_SOURCE)
+    {
+        Callback* c = GetCallback(s->source_fd);
+        if(c != nullptr && !c->eof)
+            CallbackModify(s->source_fd, c->events | EVENT_READ);
+    }
+    if(throttled & Session::THROTTLE_TARGET)
+    {
+        Callback* c = GetCallback(s->target_fd);
+        if(c != nullptr && !c->eof)
+            CallbackModify(s->target_fd, c->events | EVENT_READ);
+    }
+}
+
+bool CTcpProxy::IsThrottled(const Session* s, int fd) const
+{
+    return (s != nullptr && (s->throttled & (fd == s->source_fd ? Session::THROTTLE_SOURCE : Session::THROTTLE_TARGET)));
+}
+
+void CTcpProxy::CloseSession(Session* s)
+{
+    // Note: CloseSock deletes the session
+    if(s->pooled)
+        CloseSock(s->target_fd);
+    else
+        CloseSock(s->source_fd, s->target_fd);
+}
+
+int CTcpProxy::ConnectTarget(Target& t, const SocketOptions& so)
+{
+    int fd = socket(t.ip_family, SOCK_STREAM, IPPROTO_TCP);
+    if(fd < 0)
+    {
+        LOG_ERROR("%s: socket error: %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    
+    if(!MakeAsync(fd))
+    {
+        LOG_ERROR("%s: fd=%d, make_async failed\n", __func__, fd);
+        close(fd);
+        return -1;
+    }
+    
+    SetSocketOptions(fd, t.ip_family, so);
+#ifdef TCP_FASTOPEN_CONNECT
+    // Note: With the cookie of the target, connect() completes at once and
+    // SYN goes with the first data written, so it's only for the protocols
+    // where the client speaks first
+    if(so.fastopen > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &so.fastopen, sizeof(so.fastopen)) < 0)
+        LOG_WARNING("%s: fd=%d, setsockopt(TCP_FASTOPEN_CONNECT) error: %s\n", __func__, fd, strerror(errno));
+#endif
+    
+    if(connect(fd, (const sockaddr*)&t.addr, t.addr_len) < 0)
+    {
+        if(errno != EINPROGRESS) // nonblocking, connection stalled
+        {
+            LOG_ERROR("%s: fd=%d, connect error: %s\n", __func__, fd, strerror(errno));
+            close(fd);
+            TargetFailed(t);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+void CTcpProxy::FillPool(Route* rt, int target)
+{
+    // Note: The draining worker (see Drain) doesn't need the pool
+    Target& t = rt->targets[target];
+    while(!draining && t.pool_count < rt->opts.pool && IsTargetUp(t))
+    {
+        // Note: The pooled socket doesn't write until it's taken, so it
+        // can't defer SYN to the first data (fastopen)
+        SocketOptions so = rt->opts.sock.Merge(sock_opts);
+        so.fastopen = -1;
+        int fd = ConnectTarget(t, so);
+        if(fd < 0)
+            break;
+        
+        // Note: Wait for the socket to become writable to know when the
+        // pending connect completes, and readable to know when it's closed.
+        Session* s = session_slab.Alloc();
+        if(s == nullptr || 
+           !CallbackAdd(fd, -1, &CTcpProxy::OnPoolRead, &CTcpProxy::OnPoolWrite, EVENT_READ | EVENT_WRITE, 0))
+        {
+            LOG_ERROR("%s: fd=%d, failed to add pooled socket\n", __func__, fd);
+            session_slab.Free(s);
+            CloseSock(fd);
+            break;
+        }
+        
+        // Push to the head of the target's pool
+        s->target_fd = fd;
+        s->route = rt;
+        s->target = target;
+        s->pooled = true;
+        s->start_ms = s->active_ms = now_ms;
+        s->timer.data = s;
+        s->next = t.pool;
+        if(t.pool != nullptr)
+            t.pool->prev = s;
+        t.pool = s;
+        t.pool_count++;
+        GetCallback(fd)->session = s;
+        SessionTimer(s);
+    }
+}
+
+void CTcpProxy::ClosePool(Target& t)
+{
+    // Note: CloseSock removes the session from the pool
+    while(t.pool != nullptr)
+        CloseSock(t.pool->target_fd);
+    assert(t.pool_count == 0);
+}
+
+int CTcpProxy::TakePooled(Route* rt, int target)
+{
+    Target& t = rt->targets[target];
+    Session* s = t.pool;
+    while(s != nullptr)
+    {
+        Session* next = s->next;
+        int fd = s->target_fd;
+        
+        // Skip pending connects, those are not ready yet
+        if(!s->connected)
+        {
+            s = next;
+            continue;
+        }
+        
+        // Health check: The target must not have closed the connection
+        if(IsPooledAlive(fd))
+        {
+            // Hand the socket off. Note: The relay callbacks are added by the caller.
+            SessionRemove(s);
+            CallbackRemove(fd);
+            return fd;
+        }
+        
+        LOG_WARNING("%s: fd=%d, pooled socket to %s:%hu is closed\n", __func__, fd, t.ip, t.port);
+        CloseSock(fd);
+        s = next;
+    }
+    return -1;
+}
+
+void CTcpProxy::OnPoolWrite(int fd)
+{
+    // Pending connect completes
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    
+    Callback* cb = GetCallback(fd);
+    if(err != 0 || cb == nullptr || cb->session == nullptr)
+    {
+        // Note: Don't reconnect right away, the pool is refilled on the next handoff
+        LOG_ERROR("%s: fd=%d, pooled connect error: %s\n", __func__, fd, strerror(err));
+        if(cb != nullptr && cb->session != nullptr)
+        {
+            Session* s = cb->session;
+            TargetFailed(s->route->targets[s->target]);
+        }
+        CloseSock(fd);
+        return;
+    }
+    
+    // The socket is ready for handoff, only watch for the target closing it
+    Session* s = cb->session;
+    TargetConnected(s->route->targets[s->target], now_ms - s->start_ms);
+    cb->session->connected = true;
+    SessionTimer(cb->session);
+    CallbackModify(fd, EVENT_READ);
+}
+
+void CTcpProxy::OnPoolRead(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb != nullptr && cb->session != nullptr && !cb->session->connected)
+    {
+        // Connect failed (or completed): Let OnPoolWrite check it
+        OnPoolWrite(fd);
+        return;
+    }
+    
+    // Note: The data sent by the target (i.e. server greeting) is left in the
+    // socket and relayed to the client after handoff.
+    if(!IsPooledAlive(fd))
+    {
+        LOG_WARNING("%s: fd=%d, pooled socket is closed by the target\n", __func__, fd);
+        CloseSock(fd);
+    }
+}
+
+bool CTcpProxy::IsPooledAlive(int fd) const
+{
+    // The socket is closed if it's at EOF or has an error pending
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)));
+}
+
+void CTcpProxy::ProbeTargets()
+{
+    // Note: The draining worker doesn't need the health checks
+    if(draining)
+        return;
+    
+    // The probes not connected since the last round have failed
+    for(Probe* p = probes; p != nullptr; p = p->next)
+    {
+        if(p->fd >= 0)
+            ProbeDone(p, false);
+        p->used = false;
+    }
+    
+    // Check every target address once, no matter how many routes have it
+    for(Route* rt = FirstRoute(); rt != nullptr; rt = NextRoute(rt))
+    {
+        for(int i = 0; i < rt->target_count; i++)
+        {
+            const Target& t = rt->targets[i];
+            if(t.ip_family == 0)
+                continue; // Not resolved yet
+            
+            Probe* p = probes;
+            while(p != nullptr && (p->port != t.port || strcmp(p->host, t.host) != 0))
+                p = p->next;
+            if(p == nullptr)
+            {
+                p = new (std::nothrow) Probe;
+                if(p == nullptr)
+                {
+                    LOG_ERROR("%s: Out of memory: probe is NULL\n", __func__);
+                    continue;
+                }
+                strcpy(p->host, t.host);
+                p->port = t.port;
+                p->next = probes;
+                probes = p;
+            }
+            p->used = true;
+            p->addr = t.addr;
+            p->addr_len = t.addr_len;
+        }
+    }
+    
+    // Drop the probes of the addresses no longer used, and connect the rest
+    for(Probe** next = &probes; *next != nullptr; )
+    {
+        Probe* p = *next;
+        if(!p->used)
+        {
+            *next = p->next;
+            delete p;
+            continue;
+        }
+        next = &p->next;
+        
+        int fd = socket(p->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+        if(fd < 0 || !MakeAsync(fd))
+        {
+            // Note: It's not the target failure
+            LOG_ERROR("%s: socket error: %s\n", __func__, strerror(errno));
+            if(fd >= 0)
+                close(fd);
+            continue;
+        }
+        
+        // Note: Wait for the socket to become writable to know when the
+        // pending connect completes
+        int res = connect(fd, (const sockaddr*)&p->addr, p->addr_len);
+        if(res < 0 && errno == EINPROGRESS)
+        {
+            if(CallbackAdd(fd, -1, nullptr, &CTcpProxy::OnProbeConnect, EVENT_WRITE, 0))
+            {
+                cb[fd].probe = p;
+                p->fd = fd;
+            }
+            else
+            {
+                CloseSock(fd);
+            }
+            continue;
+        }
+        
+        // Completed (or failed) right away
+        int err = (res == 0 ? 0 : errno);
+        close(fd);
+        if(err != 0)
+            LOG_DEBUG("%s: connect to %s:%hu error: %s\n", __func__, p->host, p->port, strerror(err));
+        ProbeDone(p, err == 0);
+    }
+    
+    timers->Schedule(&health_timer, now_ms + health_interval);
+}
+
+void CTcpProxy::OnProbeConnect(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr || cb->probe == nullptr)
+    {
+        CloseSock(fd);
+        return;
+    }
+    
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if(err != 0)
+        LOG_DEBUG("%s: fd=%d, connect to %s:%hu error: %s\n", __func__, fd, cb->probe->host, cb->probe->port, strerror(err));
+    ProbeDone(cb->probe, err == 0);
+}
+
+void CTcpProxy::ProbeDone(Probe* p, bool up)
+{
+    if(p->fd >= 0)
+    {
+        CloseSock(p->fd);
+        p->fd = -1;
+    }
+    
+    bool changed = (p->down == up);
+    p->down = !up;
+    if(changed && up)
+        LOG_INFO("%s: %s:%hu is up\n", __func__, p->host, p->port);
+    else if(changed)
+        LOG_WARNING("%s: %s:%hu is down, failed the health check\n", __func__, p->host, p->port);
+    
+    // Publish the state to all the workers. Note: The down state is published
+    // on every round, so the routes added since then get it as well.
+    if(!changed && up)
+        return;
+    SetTargetHealth(p->host, p->port, p->down);
+    
+    char cmd[CMD_BUFSIZE]{};
+    snprintf(cmd, sizeof(cmd), "%s %s %hu %s", CMD_HEALTH, p->host, p->port, (p->down ? "down" : "up"));
+    SendWorkers(cmd);
+}
+
+void CTcpProxy::SetTargetHealth(const char* host, unsigned short port, bool down)
+{
+    for(Route* rt = FirstRoute(); rt != nullptr; rt = NextRoute(rt))
+    {
+        for(int i = 0; i < rt->target_count; i++)
+        {
+            Target& t = rt->targets[i];
+            if(t.port == port && strcmp(t.host, host) == 0)
+                t.probe_down = down;
+        }
+    }
+}
+
+void CTcpProxy::OnCommand(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr)
+    {
+        LOG_ERROR("%s: fd=%d, cb is NULL\n", __func__, fd);
+        return;
+    }
+    
+    // Note: The commands buffer is kept until the fifo is closed
+    if(!GetBuffer(cb))
+        return;
+    cb->buf[cb->len] = '\0';
+    
+    // Note: The event loop might be edge-triggered, so keep reading
+    // until the fifo is drained or closed by the client.
+    while(true)
+    {
+        // Note: Leave the room for the terminating 0
+        ssize_t n = read(fd, cb->buf + cb->len, cb->size - cb->len - 1);
+        
+        if(n == 0)
+        {
+            // The connection has been gracefully closed by the client
+            //printf("%s fd=%d: The client closed the connection\n", __func__, fd);
+            
+            // Process commands (one command per line)
+            char* cmd = (char*)cb->buf;
+            while(cmd != nullptr && *cmd != '\0')
+            {
+                char* end = strchr(cmd, '\n');
+                if(end != nullptr)
+                    *end++ = '\0';
+                
+                cmd = TrimString(cmd);
+                if(*cmd != '\0')
+                {
+                    LOG_INFO("%s: fd=%d, cmd=\"%s\"\n", __func__, fd, cmd);
+                    ProcessCmd(cmd);
+                    if(!keep_running)
+                        return;
+                }
+                cmd = end;
+            }
+            
+            // The batch doesn't outlive the commands written with it, so
+            // the routes of the next ones aren't held until some "commit"
+            if(batch_open)
+            {
+                LOG_ERROR("%s: fd=%d, \"%s\" without \"%s\", the batch is dropped\n",
+                          __func__, fd, CMD_BEGIN, CMD_COMMIT);
+                ProcessCmd(CMD_ABORT);
+            }
+            
+            // Close fifo & reopen since connection is closed.
+            // Note: CloseSock resets cmd buffer and cb is no longer valid
+            CloseSock(fd);
+            MakeCmdPipe();
+            break;
+        }
+        else if(n < 0)
+        {
+            // Client communication error
+            if(errno == EINTR)
+                continue;
+            
+            if(errno != EAGAIN)
+            {
+                LOG_ERROR("%s: fd=%d, read error: %s\n", __func__, fd, strerror(errno));
+                
+                // Reset cmd buffer
+                memset(cb->buf, 0, cb->size);
+                cb->len = 0;
+            }
+            break;
+        }
+        
+        // Success
+        cb->len += n;
+        cb->buf[cb->len] = '\0';
+    }
+}
+
+bool CTcpProxy::ParseAddress(const char* str, const char* default_ip, sockaddr_storage& addr, socklen_t& addr_len) const
+{
+    // "<port>" (the default IP), "<ipv4>:<port>" or "[<ipv6>]:<port>"
+    char ip[INET6_ADDRSTRLEN+8]{};
+    const char* port_str = str;
+    const char* sep = strrchr(str, ':');
+    if(sep != nullptr)
+    {
+        const char* begin = str;
+        const char* end = sep;
+        if(*begin == '[' && end > begin && end[-1] == ']')
+        {
+            begin++;
+            end--;
+        }
+        snprintf(ip, sizeof(ip), "%.*s", (int)(end - begin), begin);
+        port_str = sep + 1;
+    }
+    else
+    {
+        snprintf(ip, sizeof(ip), "%s", default_ip);
+    }
+    
+    char* end = nullptr;
+    long port = strtol(port_str, &end, 10);
+    memset(&addr, 0, sizeof(addr));
+    addr_len = 0;
+    sockaddr_in& addr4 = (sockaddr_in&)addr;
+    sockaddr_in6& addr6 = (sockaddr_in6&)addr;
+    if(inet_pton(AF_INET, ip, &addr4.sin_addr) == 1)
+    {
+        addr4.sin_family = AF_INET;
+        addr4.sin_port = htons((unsigned short)port);
+        addr_len = sizeof(sockaddr_in);
+    }
+    else if(inet_pton(AF_INET6, ip, &addr6.sin6_addr) == 1)
+    {
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_port = htons((unsigned short)port);
+        addr_len = sizeof(sockaddr_in6);
+    }
+    return (addr_len != 0 && *port_str != '\0' && *end == '\0' && port > 0 && port <= 65535);
+}
+
+bool CTcpProxy::MakeMetrics()
+{
+    if(metrics_addr[0] == '\0')
+        return true; // Disabled
+    
+    // Note: Listen on the loopback by default, since the stats are not for
+    // everybody to see
+    sockaddr_storage addr{};
+    socklen_t addr_len = 0;
+    if(!ParseAddress(metrics_addr, "127.0.0.1", addr, addr_len))
+    {
+        LOG_ERROR("%s: Invalid metrics address: '%s'\n", __func__, metrics_addr);
+        return false;
+    }
+    
+    // Note: On upgrade, the socket is taken over with the listeners (see
+    // TakeListeners), so the port isn't shared with the running instance
+    bool inherited = (metrics_fd >= 0);
+    int sock = metrics_fd;
+    metrics_fd = -1;
+    if(!inherited && (sock = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    {
+        LOG_ERROR("%s: socket error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    
+    int flag = 1;
+    if((!inherited && (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0 ||
+                       bind(sock, (sockaddr*)&addr, addr_len) < 0 || !MakeAsync(sock) || listen(sock, 16) != 0)) ||
+       !CallbackAdd(sock, -1, &CTcpProxy::OnMetricsConnect, nullptr, EVENT_READ, 0))
+    {
+        LOG_ERROR("%s: Failed to listen on '%s': %s\n", __func__, metrics_addr, strerror(errno));
+        close(sock);
+        return false;
+    }
+    
+    LOG_INFO("%s: fd=%d, listening for metrics connections on %s\n", __func__, sock, metrics_addr);
+    return true;
+}
+
+// Called by the event loop when ready to accept metrics connection
+void CTcpProxy::OnMetricsConnect(int fd)
+{
+    while(keep_running)
+    {
+        int client_fd = accept(fd, nullptr, nullptr);
+        if(client_fd < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_ERROR("%s: fd=%d, accept error: %s\n", __func__, fd, strerror(errno));
+            break;
+        }
+        
+        if(!MakeAsync(client_fd) ||
+           !CallbackAdd(client_fd, -1, &CTcpProxy::OnMetricsRead, &CTcpProxy::OnReplyWrite, EVENT_READ, 0))
+        {
+            close(client_fd);
+            continue;
+        }
+    }
+}
+
+// Called by the event loop when ready to read metrics connection
+void CTcpProxy::OnMetricsRead(int fd)
+{
+    int res = ReadRequest(fd, CMD_BUFSIZE * 8);
+    Callback* cb = GetCallback(fd);
+    if(res < 0 || cb == nullptr || cb->len == 0)
+    {
+        CloseSock(fd);
+        return;
+    }
+    
+    // Wait for the whole request head (unless the client is done sending)
+    const char* request = (const char*)cb->buf;
+    if(res == 0 && strstr(request, "\r\n\r\n") == nullptr && strstr(request, "\n\n") == nullptr)
+        return;
+    
+    // Any GET is the stats scrape (i.e. "GET /metrics")
+    TextBuffer text;
+    if(strncmp(request, "GET ", 4) != 0)
+        text.Printf("HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\nConnection: close\r\n\r\n");
+    else if(!text.Printf("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n") ||
+            !FormatStats(text))
+        text.Clear();
+    SendReply(fd, text);
+}
+
+bool CTcpProxy::MakeAdminSocket(bool upgrade)
+{
+    // Note: On upgrade, the running instance listens on the path until it
+    // hands over the listeners, so listen on the temporary one, and move it
+    // to the path then (see MoveAdminSocket)
+    char path[sizeof(admin_path)]{};
+    if(snprintf(path, sizeof(path), "%s%s", admin_path, (upgrade ? ADMIN_UPGRADE_SUFFIX : "")) >= (int)sizeof(path))
+    {
+        LOG_ERROR("%s: Admin socket path is too long: '%s%s'\n", __func__, admin_path, ADMIN_UPGRADE_SUFFIX);
+        return false;
+    }
+    
+    // Remove the socket if existed from previous run. It's OK if it doesn't exist
+    unlink(path);
+    
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0)
+    {
+        LOG_ERROR("%s: socket error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    
+    // Note: Only the owner can connect to the socket (no umask race with chmod)
+    mode_t mask = umask(S_IRWXG | S_IRWXO);
+    int res = bind(sock, (sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    
+    if(res < 0 || !MakeNonBlocking(sock) || listen(sock, 16) != 0 ||
+       !CallbackAdd(sock, -1, &CTcpProxy::OnAdminConnect, nullptr, EVENT_READ, 0))
+    {
+        LOG_ERROR("%s: Failed to listen on '%s': %s\n", __func__, path, strerror(errno));
+        close(sock);
+        return false;
+    }
+    
+    LOG_INFO("%s: fd=%d, listening for admin connections on %s\n", __func__, sock, path);
+    return true;
+}
+
+void CTcpProxy::MoveAdminSocket()
+{
+    // Replace the running instance's admin socket with this one (upgrade).
+    // Note: Connected to the temporary path if it fails.
+    char path[sizeof(admin_path) + 8]{};
+    snprintf(path, sizeof(path), "%s%s", admin_path, ADMIN_UPGRADE_SUFFIX);
+    if(rename(path, admin_path) < 0)
+        LOG_ERROR("%s: rename(%s, %s) error: %s\n", __func__, path, admin_path, strerror(errno));
+    else
+        LOG_INFO("%s: listening for admin connections on %s\n", __func__, admin_path);
+}
+
+// Called by the event loop when ready to accept admin socket connection
+void CTcpProxy::OnAdminConnect(int fd)
+{
+    while(keep_running)
+    {
+        int client_fd = accept(fd, nullptr, nullptr);
+        if(client_fd < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_ERROR("%s: fd=%d, accept error: %s\n", __func__, fd, strerror(errno));
+            break;
+        }
+        
+        if(!MakeNonBlocking(client_fd) ||
+           !CallbackAdd(client_fd, -1, &CTcpProxy::OnAdminRead, &CTcpProxy::OnReplyWrite, EVENT_READ, 0))
+        {
+            close(client_fd);
+            continue;
+        }
+    }
+}
+
+// Called by the event loop when ready to read admin socket connection
+void CTcpProxy::OnAdminRead(int fd)
+{
+    int res = ReadRequest(fd, MAX_ADMIN_REQUEST);
+    Callback* cb = GetCallback(fd);
+    if(res < 0 || cb == nullptr || (res > 0 && cb->len == 0))
+    {
+        CloseSock(fd);
+        return;
+    }
+    
+    // The batch of commands (one per line) ends with an empty line, or
+    // when the client shuts down its side of the connection
+    char* cmds = (char*)cb->buf;
+    char* end = (cb->len > 0 && cmds[0] == '\n' ? cmds : strstr(cmds, "\n\n"));
+    if(res == 0 && end == nullptr)
+        return;
+    if(end != nullptr)
+        end[1] = '\0';
+    
+    TextBuffer reply;
+    RunBatch(cmds, reply, fd);
+    SendReply(fd, reply);
+}
+
+void CTcpProxy::RunBatch(char* cmds, TextBuffer& reply, int fd, bool replace)
+{
+    // Split the commands into lines in place
+    char* end = cmds + strlen(cmds);
+    for(char* p = cmds; p < end; p++)
+    {
+        if(*p == '\n')
+            *p = '\0';
+    }
+    
+    // Run the commands in order, but only check the routes: They are applied
+    // all at once after the last command, and only if all of them are valid.
+    int line = 0;
+    int route_count = 0;
+    int invalid_count = 0;
+    bool exit = false;
+    bool handoff = false;
+    for(char* next = cmds; next < end; )
+    {
+        char* cmd = next;
+        next += strlen(next) + 1;
+        line++;
+        
+        cmd = TrimString(cmd);
+        if(*cmd == '\0' || *cmd == '#')
+            continue;
+        
+        if(strncasecmp(cmd, CMD_ROUTE, strlen(CMD_ROUTE)) == 0)
+        {
+            route_count++;
+            if(!AddRoute(cmd + strlen(CMD_ROUTE), false))
+            {
+                invalid_count++;
+                reply.Printf("error: line %d: invalid route\n", line);
+            }
+        }
+        else if(strcasecmp(cmd, CMD_STATS) == 0)
+        {
+            bool res = FormatStats(reply);
+            reply.Printf(res ? "ok\n" : "error: line %d: out of memory\n", line);
+        }
+        else if(strcasecmp(cmd, CMD_SESSIONS) == 0)
+        {
+            bool res = FormatSessions(reply);
+            reply.Printf(res ? "ok\n" : "error: line %d: out of memory\n", line);
+        }
+        else if(strcasecmp(cmd, CMD_EXIT) == 0)
+        {
+            exit = true;
+        }
+        else if(strcasecmp(cmd, CMD_RELOAD) == 0)
+        {
+            reply.Printf(Reload() ? "ok: reloaded\n" : "error: line %d: reload failed, see the log\n", line);
+        }
+        else if(strcasecmp(cmd, CMD_HANDOFF) == 0)
+        {
+            // Note: The reply goes with the listening sockets
+            handoff = (fd >= 0 && !handed_off && !handoff && HandoffListeners(fd));
+            if(!handoff)
+                reply.Printf("error: line %d: handoff failed, see the log\n", line);
+        }
+        else
+        {
+            reply.Printf("error: line %d: unknown command\n", line);
+        }
+    }
+    
+    if(invalid_count > 0)
+    {
+        reply.Printf("error: %d of %d route(s) invalid, none applied\n", invalid_count, route_count);
+    }
+    else if(route_count > 0)
+    {
+        // Note: The batch is applied by every worker in one go, so the new
+        // connections are routed either by the old routes or the new ones.
+        ProcessCmd(CMD_BEGIN);
+        for(char* next = cmds; next < end; next += strlen(next) + 1)
+        {
+            char* cmd = TrimString(next);
+            if(strncasecmp(cmd, CMD_ROUTE, strlen(CMD_ROUTE)) == 0)
+                ProcessCmd(cmd);
+        }
+        if(ProcessCmd(replace ? CMD_REPLACE : CMD_COMMIT))
+            reply.Printf("ok: %d route(s) applied\n", route_count);
+        else
+            reply.Printf("error: failed to apply the route(s), see the log\n");
+    }
+    
+    if(handoff)
+    {
+        // The new instance has the listeners, so stop accepting and let it
+        // take the lock (and the fifo, admin socket etc.)
+        ProcessCmd(CMD_DRAIN);
+        close(lock_fd);
+        lock_fd = -1;
+        handed_off = true;
+    }
+    
+    if(exit)
+    {
+        reply.Printf("ok: exiting\n");
+        ProcessCmd(CMD_EXIT);
+    }
+    if(reply.len == 0)
+        reply.Printf("ok\n");
+}
+
+bool CTcpProxy::Reload()
+{
+    // Note: Only the routes are reloaded, the other settings need restart
+    // (or upgrade). The routes not changed keep their sessions and pools.
+    FILE* stream = fopen(conf_name, "r");
+    if(!stream) 
+    {
+        LOG_ERROR("%s: fopen(%s) error: %s\n", __func__, conf_name, strerror(errno));
+        return false;
+    }
+    
+    // The routes of the "listen:" blocks go to their listeners. Note: The
+    // route of an unknown (new) listener is invalid, so the reload fails.
+    TextBuffer cmds;
+    char* line{nullptr};
+    size_t len{0};
+    bool res = true;
+    char block[sizeof(Listener::name)]{};
+    while(res && getline(&line, &len, stream) != -1) 
+    {
+        char* ptr = TrimString(line);
+        const char* value = nullptr;
+        if(strncasecmp(ptr, CONFIG_NAME_PORT, strlen(CONFIG_NAME_PORT)) == 0)
+            value = TrimString(ptr + strlen(CONFIG_NAME_PORT));
+        else if(strncasecmp(ptr, CONFIG_NAME_LISTEN, strlen(CONFIG_NAME_LISTEN)) == 0)
+            value = TrimString(ptr + strlen(CONFIG_NAME_LISTEN));
+        
+        // Note: The listener's name is its address, with no options
+        if(value != nullptr)
+            snprintf(block, sizeof(block), "%.*s", (int)strcspn(value, " \t"), value);
+        else if(strncasecmp(ptr, CONFIG_NAME_ROUTE, strlen(CONFIG_NAME_ROUTE)) == 0 && block[0] != '\0')
+            res = cmds.Printf("%s %s %s%s\n", CMD_ROUTE, ptr + strlen(CONFIG_NAME_ROUTE), ROUTE_OPTION_LISTEN, block);
+        else if(strncasecmp(ptr, CONFIG_NAME_ROUTE, strlen(CONFIG_NAME_ROUTE)) == 0)
+            res = cmds.Printf("%s %s\n", CMD_ROUTE, ptr + strlen(CONFIG_NAME_ROUTE));
+    }
+    free(line);
+    fclose(stream);
+    
+    if(!res || cmds.len == 0)
+    {
+        LOG_ERROR("%s: No routes read from %s\n", __func__, conf_name);
+        return false;
+    }
+    
+    // The routes are checked first, and only if all are valid, the table
+    // is replaced by them (the routes gone from the config are removed)
+    TextBuffer reply;
+    RunBatch(cmds.data, reply, -1, true);
+    res = (reply.len > 0 && strncmp(reply.data, "ok", 2) == 0);
+    
+    char* next = reply.data;
+    while(next != nullptr && *next != '\0')
+    {
+        char* end = strchr(next, '\n');
+        if(end != nullptr)
+            *end++ = '\0';
+        if(strncmp(next, "ok", 2) == 0)
+            LOG_INFO("%s: %s\n", __func__, next);
+        else
+            LOG_ERROR("%s: %s\n", __func__, next);
+        next = end;
+    }
+    return res;
+}
+
+bool CTcpProxy::HandoffListeners(int fd)
+{
+    // The listening sockets: the main worker's ones first, then the others'
+    // and the metrics socket (if any). Note: The new instance's workers take
+    // them by index per listener (see InheritedFd), so with the same number
+    // of workers every worker keeps its SO_REUSEPORT socket.
+    int max_count = 1;
+    for(int i = 0; i < cb_size; i++)
+        max_count += (cb[i].read_fn == &CTcpProxy::OnConnect);
+    max_count += (workers != nullptr ? (worker_count - 1) * listener_count : 0);
+    int* fds = new (std::nothrow) int[max_count];
+    if(fds == nullptr)
+    {
+        LOG_ERROR("%s: Out of memory: fds is NULL\n", __func__);
+        return false;
+    }
+    
+    int count = 0;
+    for(int i = 0; i < cb_size && count < max_count; i++)
+    {
+        if(cb[i].read_fn == &CTcpProxy::OnConnect)
+            fds[count++] = i;
+    }
+    for(int i = 0; workers != nullptr && i < worker_count - 1; i++)
+    {
+        for(int l = 0; l < listener_count && workers[i].running && !workers[i].exited; l++)
+        {
+            int sock = workers[i].proxy->listeners[l].fd.load();
+            if(sock >= 0 && count < max_count)
+                fds[count++] = sock;
+        }
+    }
+    if(count == 0)
+    {
+        LOG_ERROR("%s: fd=%d, no listening sockets to hand over\n", __func__, fd);
+        delete [] fds;
+        return false;
+    }
+    int listeners_count = count;
+    for(int i = 0; i < cb_size && count < max_count; i++)
+    {
+        if(cb[i].read_fn == &CTcpProxy::OnMetricsConnect)
+            fds[count++] = i;
+    }
+    
+    // Note: Up to MAX_HANDOFF_FDS sockets per message, the text goes with
+    // the first one (the others have a new line only)
+    char text[64]{};
+    int text_len = snprintf(text, sizeof(text), "ok: %d listener(s) handed over%s\n", listeners_count,
+                            (count > listeners_count ? " with the metrics" : ""));
+    char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)];
+    bool res = true;
+    for(int sent = 0; sent < count && res; )
+    {
+        int n = (count - sent < MAX_HANDOFF_FDS ? count - sent : MAX_HANDOFF_FDS);
+        iovec iov{(sent == 0 ? text : (char*)"\n"), (size_t)(sent == 0 ? text_len : 1)};
+        memset(control, 0, sizeof(control));
+        
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(cmsg), fds + sent, sizeof(int) * n);
+        
+        res = (sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len);
+        if(!res)
+            LOG_ERROR("%s: fd=%d, sendmsg error: %s\n", __func__, fd, strerror(errno));
+        sent += n;
+    }
+    delete [] fds;
+    if(!res)
+        return false;
+    
+    LOG_INFO("%s: fd=%d, %d listener(s) handed over, draining the sessions\n", __func__, fd, listeners_count);
+    return true;
+}
+
+bool CTcpProxy::TakeListeners()
+{
+    // Ask the running instance for its listening sockets over its admin socket
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0)
+    {
+        LOG_ERROR("%s: socket error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, admin_path);
+    
+    // Note: Don't wait forever if the running instance is stuck
+    timeval tv{10, 0};
+    char cmd[32]{};
+    int cmd_len = snprintf(cmd, sizeof(cmd), "%s\n", CMD_HANDOFF);
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+       connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+       write(sock, cmd, cmd_len) != cmd_len || shutdown(sock, SHUT_WR) < 0)
+    {
+        LOG_ERROR("%s: Failed to ask %s for the listeners: %s\n", __func__, admin_path, strerror(errno));
+        close(sock);
+        return false;
+    }
+    
+    // Read the messages with the sockets (see HandoffListeners) until the
+    // running instance closes the connection
+    char text[CMD_BUFSIZE]{};
+    char more[CMD_BUFSIZE]{};
+    char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)];
+    int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    ssize_t n = 0;
+    bool res = true;
+    for(int i = 0; res; i++)
+    {
+        iovec iov{(i == 0 ? text : more), sizeof(text) - 1};
+        memset(control, 0, sizeof(control));
+        
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        n = recvmsg(sock, &msg, flags);
+        if(n <= 0)
+            break;
+        
+        int count = 0;
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if(cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        if(count == 0)
+            continue;
+        
+        int* fds = new (std::nothrow) int[inherited_count + count];
+        if(fds == nullptr)
+        {
+            LOG_ERROR("%s: Out of memory: fds is NULL\n", __func__);
+            for(int k = 0; k < count; k++)
+                close(((int*)CMSG_DATA(cmsg))[k]);
+            res = false;
+            break;
+        }
+        if(inherited_count > 0)
+            memcpy(fds, inherited_fds, sizeof(int) * inherited_count);
+        memcpy(fds + inherited_count, CMSG_DATA(cmsg), sizeof(int) * count);
+        delete [] inherited_fds;
+        inherited_fds = fds;
+        inherited_count += count;
+    }
+    int err = errno;
+    close(sock);
+    
+    if(res && inherited_count > 0)
+    {
+        inherited_listeners = new (std::nothrow) int[inherited_count];
+        if(inherited_listeners == nullptr)
+        {
+            LOG_ERROR("%s: Out of memory: inherited_listeners is NULL\n", __func__);
+            res = false;
+        }
+    }
+    if(!res || inherited_count == 0 || strncmp(text, "ok", 2) != 0)
+    {
+        if(res)
+            LOG_ERROR("%s: No listeners from %s: %s\n", __func__, admin_path,
+                      (n < 0 && text[0] == '\0' ? strerror(err) : TrimString(text)));
+        for(int i = 0; i < inherited_count; i++)
+            close(inherited_fds[i]);
+        inherited_count = 0;
+        return false;
+    }
+    
+    // Don't take the sockets listening on another address (i.e. the port
+    // is changed). Note: The metrics socket is handed over too, unless the
+    // running instance has none (see MakeMetrics).
+    sockaddr_storage metrics{};
+    socklen_t metrics_len = 0;
+    if(metrics_addr[0] != '\0' && !ParseAddress(metrics_addr, "127.0.0.1", metrics, metrics_len))
+        metrics_len = 0;
+    for(int i = 0; i < inherited_count; i++)
+    {
+        inherited_listeners[i] = -1;
+        for(int l = 0; l < listener_count && inherited_listeners[i] < 0; l++)
+        {
+            if(IsSocketAddr(inherited_fds[i], listeners[l].addr, listeners[l].dual_stack))
+                inherited_listeners[i] = l;
+        }
+        if(inherited_listeners[i] < 0 && metrics_len != 0 && metrics_fd < 0 &&
+           IsSocketAddr(inherited_fds[i], metrics, false))
+        {
+            metrics_fd = inherited_fds[i];
+            inherited_fds[i] = -1;
+        }
+        else if(inherited_listeners[i] < 0)
+        {
+            LOG_WARNING("%s: fd=%d, not listening on the configured addresses, closing\n", __func__, inherited_fds[i]);
+            close(inherited_fds[i]);
+            inherited_fds[i] = -1;
+        }
+    }
+    for(int l = 0; l < listener_count; l++)
+        listeners[l].inherited_fd = InheritedFd(l, 0);
+    
+    LOG_INFO("%s: %s", __func__, TrimString(text));
+    return true;
+}
+
+bool CTcpProxy::IsSocketAddr(int fd, const sockaddr_storage& addr, bool dual_stack) const
+{
+    sockaddr_storage sa{};
+    socklen_t sa_len = sizeof(sa);
+    if(getsockname(fd, (sockaddr*)&sa, &sa_len) < 0 || sa.ss_family != addr.ss_family)
+    {
+        // Note: "<port>" might be on IPv4 only (see MakeListener)
+        return (dual_stack && sa.ss_family == AF_INET && 
+                ((const sockaddr_in&)sa).sin_port == ((const sockaddr_in6&)addr).sin6_port &&
+                ((const sockaddr_in&)sa).sin_addr.s_addr == INADDR_ANY);
+    }
+    
+    if(sa.ss_family == AF_UNIX)
+        return (strcmp(((const sockaddr_un&)sa).sun_path, ((const sockaddr_un&)addr).sun_path) == 0);
+    if(sa.ss_family == AF_INET)
+        return (memcmp(&((const sockaddr_in&)sa).sin_addr, &((const sockaddr_in&)addr).sin_addr, sizeof(in_addr)) == 0 &&
+                ((const sockaddr_in&)sa).sin_port == ((const sockaddr_in&)addr).sin_port);
+    return (memcmp(&((const sockaddr_in6&)sa).sin6_addr, &((const sockaddr_in6&)addr).sin6_addr, sizeof(in6_addr)) == 0 &&
+            ((const sockaddr_in6&)sa).sin6_port == ((const sockaddr_in6&)addr).sin6_port);
+}
+
+int CTcpProxy::InheritedFd(int listener, int k) const
+{
+    // The k-th of the sockets taken over for the listener
+    for(int i = 0; i < inherited_count; i++)
+    {
+        if(inherited_listeners[i] == listener && k-- == 0)
+            return inherited_fds[i];
+    }
+    return -1;
+}
+
+void CTcpProxy::Drain()
+{
+    // Stop accepting, and exit when the sessions are closed (see Listen).
+    // Note: The metrics are the new instance's on upgrade.
+    for(int fd = 0; fd < cb_size; fd++)
+    {
+        if(cb[fd].read_fn == &CTcpProxy::OnConnect || cb[fd].read_fn == &CTcpProxy::OnMetricsConnect)
+            CloseSock(fd);
+    }
+    for(int i = 0; i < listener_count; i++)
+        listeners[i].fd = -1;
+    
+    for(Route* rt = FirstRoute(); rt != nullptr; rt = NextRoute(rt))
+    {
+        for(int i = 0; i < rt->target_count; i++)
+            ClosePool(rt->targets[i]);
+    }
+    
+    draining = true;
+    LOG_INFO("%s: worker=%d, draining %zu session(s)\n", __func__, worker_id, session_count);
+}
+
+bool CTcpProxy::WorkersExited() const
+{
+    for(int i = 0; workers != nullptr && i < worker_count - 1; i++)
+    {
+        if(workers[i].running && !workers[i].exited)
+            return false;
+    }
+    return true;
+}
+
+int CTcpProxy::ReadRequest(int fd, size_t max_size)
+{
+    // Read the request into the callback's own buffer (not from the pool),
+    // growing it as needed. Returns 1 if the client has shut down its side,
+    // 0 if the socket is drained, and -1 on error.
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr)
+        return -1;
+    
+    while(true)
+    {
+        // Note: Leave the room for the terminating 0
+        if(cb->len + 1 >= cb->size)
+        {
+            size_t new_size = (cb->size > 0 ? cb->size * 2 : CMD_BUFSIZE);
+            if(new_size > max_size)
+            {
+                LOG_ERROR("%s: fd=%d, request is too long (max %zu)\n", __func__, fd, max_size);
+                return -1;
+            }
+            
+            unsigned char* buf = new (std::nothrow) unsigned char[new_size];
+            if(buf == nullptr)
+            {
+                LOG_ERROR("%s: Out of memory: new_size=%zu\n", __func__, new_size);
+                return -1;
+            }
+            if(cb->len > 0)
+                memcpy(buf, cb->buf, cb->len);
+            delete [] cb->buf;
+            cb->buf = buf;
+            cb->size = new_size;
+            cb->owned = true;
+        }
+        
+        ssize_t n = read(fd, cb->buf + cb->len, cb->size - cb->len - 1);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if(n < 0)
+        {
+            LOG_ERROR("%s: fd=%d, read error: %s\n", __func__, fd, strerror(errno));
+            return -1;
+        }
+        if(n == 0)
+            return 1;
+        
+        cb->len += n;
+        cb->buf[cb->len] = '\0';
+    }
+}
+
+void CTcpProxy::SendReply(int fd, TextBuffer& reply)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr || reply.len == 0)
+    {
+        CloseSock(fd);
+        return;
+    }
+    
+    // Write the reply out of the request buffer, and close the connection
+    // when it's done. Note: No more reads, so the connection writing the
+    // reply has no read_fn (see OnReplyWrite).
+    size_t len = reply.len;
+    if(cb->owned)
+        delete [] cb->buf;
+    cb->buf = (unsigned char*)reply.Detach();
+    cb->size = len;
+    cb->len = len;
+    cb->head = 0;
+    cb->owned = true;
+    cb->read_fn = nullptr;
+    CallbackModify(fd, EVENT_WRITE);
+    OnReplyWrite(fd);
+}
+
+// Called by the event loop when ready to write the reply
+void CTcpProxy::OnReplyWrite(int fd)
+{
+    Callback* cb = GetCallback(fd);
+    if(cb == nullptr || cb->read_fn != nullptr)
+        return; // The request is not read yet
+    
+    while(cb->len > 0)
+    {
+        size_t len = 0;
+        unsigned char* data = cb->Data(len);
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return; // Wait for the socket to become writable
+        if(n < 0)
+        {
+            LOG_ERROR("%s: fd=%d, write error: %s\n", __func__, fd, strerror(errno));
+            break;
+        }
+        cb->Consume(n);
+    }
+    CloseSock(fd);
+}
+
+bool CTcpProxy::FormatStats(TextBuffer& text)
+{
+    // Totals of the route's target (over all workers)
+    struct Totals
+    {
+        const Route* route{nullptr};
+        const Target* target{nullptr};
+        uint64_t sessions_active{0};
+        uint64_t sessions_total{0};
+        uint64_t bytes_in{0};
+        uint64_t bytes_out{0};
+        uint64_t connect_errors{0};
+        uint64_t ejections{0};
+        uint64_t buckets[STAT_LATENCY_BUCKETS]{};
+        uint64_t latency_sum{0};
+        uint64_t latency_count{0};
+        char labels[sizeof(Listener::name)+INET6_ADDRSTRLEN+HOST_NAME_MAX+48]{};
+        
+        void Add(const TargetStats& st)
+        {
+            sessions_active += st.sessions_active.Get();
+            sessions_total += st.sessions_total.Get();
+            bytes_in += st.bytes_in.Get();
+            bytes_out += st.bytes_out.Get();
+            connect_errors += st.connect_errors.Get();
+            ejections += st.ejections.Get();
+            for(int b = 0; b < STAT_LATENCY_BUCKETS; b++)
+                buckets[b] += st.connect_latency.buckets[b].Get();
+            latency_sum += st.connect_latency.sum.Get();
+            latency_count += st.connect_latency.count.Get();
+        }
+    };
+    
+    size_t total_count = 0;
+    for(const Route* rt = FirstRoute(); rt != nullptr; rt = NextRoute(rt))
+        total_count += rt->target_count;
+    
+    Totals* totals = new (std::nothrow) Totals[total_count + 1];
+    if(totals == nullptr)
+    {
+        LOG_ERROR("%s: Out of memory: totals is NULL\n", __func__);
+        return false;
+    }
+    
+    size_t n = 0;
+    for(const Route* rt = FirstRoute(); rt != nullptr; rt = NextRoute(rt))
+    {
+        for(int i = 0; i < rt->target_count; i++, n++)
+        {
+            totals[n].route = rt;
+            totals[n].target = &rt->targets[i];
+        }
+    }
+    
+    // Sum the counters of the workers (this one and the others). Note: The
+    // workers have the copies of the routes, so look them up by the source,
+    // and the targets by the index. The locks keep the worker from changing
+    // its routes (and the retired ones) in the meanwhile, the counters are
+    // updated with no lock.
+    uint64_t accepted = 0;
+    uint64_t rejected = 0;
+    uint64_t limited = 0;
+    int running = 0;
+    for(int w = 0; w < worker_count; w++)
+    {
+        CTcpProxy* proxy = RunningWorker(w);
+        if(proxy == nullptr)
+            continue;
+        
+        running++;
+        accepted += proxy->stats.accepted.Get();
+        rejected += proxy->stats.rejected.Get();
+        limited += proxy->stats.limited.Get();
+        
+        if(proxy != this)
+            pthread_mutex_lock(&proxy->loop_mutex);
+        pthread_mutex_lock(&proxy->routes_mutex);
+        for(size_t k = 0; k < total_count; k++)
+        {
+            Totals& tt = totals[k];
+            const Route* rt = (proxy == this ? tt.route :
+                               proxy->listeners[tt.route->opts.listener].routes.Find(tt.route->source_addr,
+                                                                                      tt.route->source_prefix_len));
+            int i = (int)(tt.target - tt.route->targets);
+            if(rt != nullptr && i < rt->target_count &&
+               rt->targets[i].port == tt.target->port && strcmp(rt->targets[i].host, tt.target->host) == 0)
+                tt.Add(rt->targets[i].stats);
+            
+            // The routes replaced by the route count the traffic of their
+            // sessions still open (see SetRoute). Note: The same host and
+            // port listed twice is counted by the first one.
+            for(const Route* old = proxy->retired; old != nullptr && FindTarget(tt.route, *tt.target) == i; old = old->next)
+            {
+                if(!old->replaced || old->opts.listener != tt.route->opts.listener ||
+                   old->source_prefix_len != tt.route->source_prefix_len || !(old->source_addr == tt.route->source_addr))
+                    continue;
+                for(int j = 0; j < old->target_count; j++)
+                {
+                    if(FindTarget(old, old->targets[j]) == j &&
+                       old->targets[j].port == tt.target->port && strcmp(old->targets[j].host, tt.target->host) == 0)
+                        tt.Add(old->targets[j].stats);
+                }
+            }
+        }
+        pthread_mutex_unlock(&proxy->routes_mutex);
+        if(proxy != this)
+            pthread_mutex_unlock(&proxy->loop_mutex);
+    }
+    
+    // Global counters are the sums over the targets
+    Totals& all = totals[total_count];
+    for(size_t k = 0; k < total_count; k++)
+    {
+        all.sessions_active += totals[k].sessions_active;
+        all.sessions_total += totals[k].sessions_total;
+        all.bytes_in += totals[k].bytes_in;
+        all.bytes_out += totals[k].bytes_out;
+        all.connect_errors += totals[k].connect_errors;
+        all.ejections += totals[k].ejections;
+    }
+    
+    // Prometheus text format
+    struct Metric
+    {
+        const char* name;
+        const char* type;
+        const char* help;
+        uint64_t Totals::*field;
+    };
+    static const Metric metrics[] =
+    {
+        {"sessions_active", "gauge", "Sessions open now", &Totals::sessions_active},
+        {"sessions_total", "counter", "Sessions open since start", &Totals::sessions_total},
+        {"bytes_in_total", "counter", "Bytes relayed from the sources to the targets", &Totals::bytes_in},
+        {"bytes_out_total", "counter", "Bytes relayed from the targets to the sources", &Totals::bytes_out},
+        {"connect_errors_total", "counter", "Target connects failed or timed out", &Totals::connect_errors},
+        {"ejections_total", "counter", "Targets ejected after consecutive connect errors", &Totals::ejections},
+    };
+    
+    bool res = text.Printf("# HELP tcproxy_workers Event loops running\n# TYPE tcproxy_workers gauge\n"
+                           "tcproxy_workers %d\n", running) &&
+               text.Printf("# HELP tcproxy_connections_accepted_total Connections accepted\n"
+                           "# TYPE tcproxy_connections_accepted_total counter\n"
+                           "tcproxy_connections_accepted_total %llu\n", (unsigned long long)accepted) &&
+               text.Printf("# HELP tcproxy_connections_rejected_total Connections closed with no route or target\n"
+                           "# TYPE tcproxy_connections_rejected_total counter\n"
+                           "tcproxy_connections_rejected_total %llu\n", (unsigned long long)rejected) &&
+               text.Printf("# HELP tcproxy_connections_limited_total Connections closed by the session limits\n"
+                           "# TYPE tcproxy_connections_limited_total counter\n"
+                           "tcproxy_connections_limited_total %llu\n", (unsigned long long)limited);
+    
+    for(const Metric& m : metrics)
+    {
+        res = res && text.Printf("# HELP tcproxy_%s %s\n# TYPE tcproxy_%s %s\ntcproxy_%s %llu\n",
+                                 m.name, m.help, m.name, m.type, m.name, (unsigned long long)(all.*m.field));
+    }
+    // Labels of the targets. Note: The listener is labeled only if there
+    // are more than one.
+    for(size_t k = 0; k < total_count; k++)
+    {
+        Totals& tt = totals[k];
+        int len = 0;
+        if(listener_count > 1)
+            len = snprintf(tt.labels, sizeof(tt.labels), "listener=\"%s\",", listeners[tt.route->opts.listener].name);
+        snprintf(tt.labels + len, sizeof(tt.labels) - len, "route=\"%s\",target=\"%s:%hu\"",
+                 tt.route->source_ip, tt.target->host, tt.target->port);
+    }
+    
+    for(const Metric& m : metrics)
+    {
+        res = res && text.Printf("# HELP tcproxy_target_%s %s (per route target)\n# TYPE tcproxy_target_%s %s\n",
+                                 m.name, m.help, m.name, m.type);
+        for(size_t k = 0; k < total_count && res; k++)
+        {
+            res = text.Printf("tcproxy_target_%s{%s} %llu\n", m.name, totals[k].labels,
+                              (unsigned long long)(totals[k].*m.field));
+        }
+    }
+    
+    res = res && text.Printf("# HELP tcproxy_target_connect_latency_ms Target connect time, ms (per route target)\n"
+                             "# TYPE tcproxy_target_connect_latency_ms histogram\n");
+    for(size_t k = 0; k < total_count && res; k++)
+    {
+        const char* labels = totals[k].labels;
+        
+        // Note: The buckets are cumulative in the output
+        uint64_t count = 0;
+        for(int b = 0; b < STAT_LATENCY_BUCKETS && res; b++)
+        {
+            count += totals[k].buckets[b];
+            if(b < STAT_LATENCY_BUCKETS - 1)
+                res = text.Printf("tcproxy_target_connect_latency_ms_bucket{%s,le=\"%llu\"} %llu\n", labels,
+                                  (unsigned long long)STAT_LATENCY_BOUNDS[b], (unsigned long long)count);
+            else
+                res = text.Printf("tcproxy_target_connect_latency_ms_bucket{%s,le=\"+Inf\"} %llu\n", labels,
+                                  (unsigned long long)count);
+        }
+        res = res && text.Printf("tcproxy_target_connect_latency_ms_sum{%s} %llu\n"
+                                 "tcproxy_target_connect_latency_ms_count{%s} %llu\n",
+                                 labels, (unsigned long long)totals[k].latency_sum,
+                                 labels, (unsigned long long)totals[k].latency_count);
+    }
+    
+    // The dispatch time of the event loop iterations per worker (if enabled).
+    // Note: The count is the sum of the buckets read, so it's consistent with
+    // them while the worker keeps adding to the histogram.
+    if(loop_histogram)
+    {
+        res = res && text.Printf("# HELP tcproxy_loop_dispatch_us Event loop iteration dispatch time, us (per worker)\n"
+                                 "# TYPE tcproxy_loop_dispatch_us histogram\n");
+    }
+    for(int w = 0; w < worker_count && loop_histogram && res; w++)
+    {
+        const CTcpProxy* proxy = RunningWorker(w);
+        if(proxy == nullptr)
+            continue;
+        
+        const StatHistogram& h = proxy->stats.loop_dispatch;
+        uint64_t count = 0;
+        for(int b = 0; b < STAT_LATENCY_BUCKETS && res; b++)
+        {
+            count += h.buckets[b].Get();
+            if(b < STAT_LATENCY_BUCKETS - 1)
+                res = text.Printf("tcproxy_loop_dispatch_us_bucket{worker=\"%d\",le=\"%llu\"} %llu\n", w,
+                                  (unsigned long long)STAT_LATENCY_BOUNDS[b], (unsigned long long)count);
+            else
+                res = text.Printf("tcproxy_loop_dispatch_us_bucket{worker=\"%d\",le=\"+Inf\"} %llu\n", w,
+                                  (unsigned long long)count);
+        }
+        res = res && text.Printf("tcproxy_loop_dispatch_us_sum{worker=\"%d\"} %llu\n"
+                                 "tcproxy_loop_dispatch_us_count{worker=\"%d\"} %llu\n",
+                                 w, (unsigned long long)h.sum.Get(), w, (unsigned long long)count);
+    }
+    
+    delete [] totals;
+    return res;
+}
+
+bool CTcpProxy::FormatSessions(TextBuffer& text)
+{
+    // The sessions of all workers (this one and the others), one per line.
+    // The loop mutex keeps the worker from changing its sessions (and the
+    // routes and callbacks) in the meanwhile. Note: The worker only waits
+    // for the mutex once done with the events it's got, so the loop isn't
+    // stopped, and this one (the main worker) holds its own mutex already.
+    uint64_t now = GetTimeMs();
+    bool res = true;
+    for(int w = 0; w < worker_count && res; w++)
+    {
+        CTcpProxy* proxy = RunningWorker(w);
+        if(proxy == nullptr)
+            continue;
+        
+        if(proxy != this)
+            pthread_mutex_lock(&proxy->loop_mutex);
+        
+        // Note: The removed routes keep their sessions until closed
+        for(int retired = 0; retired < 2 && res; retired++)
+        {
+            const Route* rt = (retired ? proxy->retired : proxy->FirstRoute());
+            for(; rt != nullptr && res; rt = (retired ? rt->next : proxy->NextRoute(rt)))
+            {
+                for(const Session* s = rt->sessions; s != nullptr && res; s = s->next)
+                {
+                    const Target& t = rt->targets[s->target];
+                    const Callback* source_cb = (s->source_fd < proxy->cb_size ? &proxy->cb[s->source_fd] : nullptr);
+                    const Callback* target_cb = (s->target_fd < proxy->cb_size ? &proxy->cb[s->target_fd] : nullptr);
+                    char ip_str[INET6_ADDRSTRLEN]{};
+                    if(listener_count > 1)
+                        res = text.Printf("listener=%s ", listeners[rt->opts.listener].name);
+                    res = res && text.Printf("worker=%d route=%s src=%s:%hu src_fd=%d dst=%s:%hu dst_fd=%d "
+                                             "age_ms=%llu connect_ms=%lld first_in_ms=%lld first_out_ms=%lld "
+                                             "bytes_in=%llu bytes_out=%llu buffered_in=%zu buffered_out=%zu\n",
+                                             w, rt->source_ip, s->source_ip.ToString(ip_str, sizeof(ip_str)),
+                                             s->source_port, s->source_fd, t.ip, t.port, s->target_fd,
+                                             (unsigned long long)(now - s->accept_ms), s->Since(s->connect_ms),
+                                             s->Since(s->first_in_ms), s->Since(s->first_out_ms),
+                                             (unsigned long long)s->bytes_in, (unsigned long long)s->bytes_out,
+                                             (target_cb != nullptr ? target_cb->len : 0),
+                                             (source_cb != nullptr ? source_cb->len : 0));
+                }
+            }
+        }
+        
+        if(proxy != this)
+            pthread_mutex_unlock(&proxy->loop_mutex);
+    }
+    return res;
+}
+
+CTcpProxy* CTcpProxy::RunningWorker(int w)
+{
+    // The proxy instance of the worker, or nullptr if it's not running
+    if(w == 0)
+        return this;
+    return (workers != nullptr && w < worker_count && workers[w-1].running ? workers[w-1].proxy : nullptr);
+}
+
+bool CTcpProxy::StartWorkers()
+{
+    if(worker_count <= 1)
+        return true;
+    
+    workers = new (std::nothrow) Worker[worker_count - 1];
+    if(workers == nullptr)
+    {
+        LOG_ERROR("%s: Out of memory: workers is NULL\n", __func__);
+        return false;
+    }
+    
+#ifdef __linux__
+    // Assign CPUs available to the process to the workers round-robin
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    int cpu_list[CPU_SETSIZE]{};
+    int cpu_count = 0;
+    
+    if(cpu_affinity && sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+    {
+        for(int i = 0; i < CPU_SETSIZE; i++)
+        {
+            if(CPU_ISSET(i, &cpus))
+                cpu_list[cpu_count++] = i;
+        }
+    }
+    
+    if(cpu_count > 0)
+        cpu = cpu_list[0];
+#endif // __linux__
+    
+    for(int i = 1; i < worker_count; i++)
+    {
+        Worker& w = workers[i - 1];
+        
+        // Make a pipe to send the commands to the worker
+        if(pipe(w.cmd_fds) < 0)
+        {
+            LOG_ERROR("%s: pipe error: %s\n", __func__, strerror(errno));
+            w.cmd_fds[0] = w.cmd_fds[1] = -1;
+            return false;
+        }
+        
+        // Note: The main worker doesn't wait for the busy worker to read
+        // its commands, the ones the pipe can't take are queued instead
+        for(int fd : w.cmd_fds)
+        {
+            int n = fcntl(fd, F_GETFL);
+            if(n < 0 || fcntl(fd, F_SETFL, n | O_NONBLOCK) < 0)
+            {
+                LOG_ERROR("%s: fcntl(O_NONBLOCK) error: %s\n", __func__, strerror(errno));
+                return false;
+            }
+        }
+        
+        w.proxy = new (std::nothrow) CTcpProxy(*this, i);
+        if(w.proxy == nullptr)
+        {
+            LOG_ERROR("%s: Out of memory: worker proxy is NULL\n", __func__);
+            return false;
+        }
+        
+#ifdef __linux__
+        if(cpu_count > 0)
+            w.proxy->cpu = cpu_list[i % cpu_count];
+#endif // __linux__
+        
+        // Note: The signals are caught by the main worker (see MakeSignalPipe)
+        sigset_t sigs, old_sigs;
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+        int err = pthread_create(&w.thread, nullptr, &CTcpProxy::WorkerThread, &w);
+        pthread_sigmask(SIG_SETMASK, &old_sigs, nullptr);
+        if(err != 0)
+        {
+            LOG_ERROR("%s: pthread_create error: %s\n", __func__, strerror(err));
+            return false;
+        }
+        w.running = true;
+    }
+    
+    LOG_INFO("%s: %d workers started\n", __func__, worker_count);
+    return true;
+}
+
+void CTcpProxy::StopWorkers()
+{
+    if(workers == nullptr)
+        return;
+    
+    for(int i = 0; i < worker_count - 1; i++)
+    {
+        Worker& w = workers[i];
+        
+        // Close the command pipe to tell the worker to exit. Note: The
+        // commands still queued are dropped, the worker exits anyway.
+        if(w.pending.len > 0)
+            CallbackRemove(w.cmd_fds[1]);
+        if(w.cmd_fds[1] >= 0)
+            close(w.cmd_fds[1]);
+        
+        if(w.running)
+        {
+            pthread_join(w.thread, nullptr);
+        }
+        else if(w.cmd_fds[0] >= 0)
+        {
+            // Note: The running worker owns the read end
+            close(w.cmd_fds[0]);
+        }
+        
+        delete w.proxy;
+    }
+    
+    delete [] workers;
+    workers = nullptr;
+}
+
+void* CTcpProxy::WorkerThread(void* arg)
+{
+    Worker* w = (Worker*)arg;
+    w->proxy->RunWorker(w->cmd_fds[0]);
+    w->exited = true;
+    return nullptr;
+}
+
+void CTcpProxy::RunWorker(int cmd_fd)
+{
+    SetCpuAffinity();
+    
+    // Note: The worker holds the loop mutex unless waiting for the events
+    // (see CallbackSelect), including while setting up its callbacks
+    pthread_mutex_lock(&loop_mutex);
+    
+    // Create event loop backend and listen on the commands sent by the main worker
+    if(!MakeEventLoop() || 
+       !CallbackAdd(cmd_fd, -1, &CTcpProxy::OnWorkerCommand, nullptr, EVENT_READ, CMD_BUFSIZE))
+    {
+        LOG_ERROR("%s: worker=%d, failed to start\n", __func__, worker_id);
+        close(cmd_fd);
+        pthread_mutex_unlock(&loop_mutex);
+        return;
+    }
+    
+    // Start to listen
+    keep_running = true;
+    Listen();
+    pthread_mutex_unlock(&loop_mutex);
+}
+
+void CTcpProxy::OnResolve(int fd)
+{
+    CResolver::Result result;
+    while(resolver->GetResult(result))
+    {
+        int count = UpdateTargets(result.host, result.ip);
+        if(count == 0)
+        {
+            // The host is no longer used by the routes
+            resolver->Remove(result.host);
+            continue;
+        }
+        LOG_INFO("%s: %s is %s (%d target(s))\n", __func__, result.host, result.ip, count);
+        
+        // Publish the new address to other workers (if any)
+        char cmd[CMD_BUFSIZE]{};
+        snprintf(cmd, sizeof(cmd), "%s %s %s", CMD_RESOLVED, result.host, result.ip);
+        SendWorkers(cmd);
+    }
+}
+
+void CTcpProxy::SendWorkers(const char* cmd)
+{
+    if(workers == nullptr)
+        return;
     
-    // Start listening...
-    if(listen(sock, MAX_LISTEN_BACKLOG) != 0)
+    // Note: The command is sent as a new-line terminated string.
+    // Writes up to PIPE_BUF bytes are atomic, so we don't worry
+    // about partial writes for the commands up to CMD_BUFSIZE.
+    char buf[CMD_BUFSIZE+1]{};
+    int len = snprintf(buf, sizeof(buf), "%s\n", cmd);
+    if(len <= 0 || len >= (int)sizeof(buf))
     {
-        printf("%s: listen error: %s\n", __func__, strerror(errno));
-        close(sock);
-        return false;
+        LOG_ERROR("%s: Command is too long: \"%s\"\n", __func__, cmd);
+        return;
     }
     
-    // Add callback
-    CallbackAdd(sock, -1, &CTcpProxy::OnConnect, nullptr);
-    
-    // Success
-    printf("%s: fd=%d, listening for incomming connections....\n", __func__, sock);
-    
-    // Enter events loop...
-    while(keep_running)
+    for(int i = 0; i < worker_count - 1; i++)
     {
-        //printf("%s: CallbackSelect() ...\n", __func__);
-        CallbackSelect();
-        //printf("%s: CallbackSelect() end\n", __func__);
+        // Note: The drained worker doesn't read the pipe anymore
+        Worker& w = workers[i];
+        if(!w.running || w.exited)
+            continue;
+        
+        // Keep the order of the commands: Once some are queued, the new ones
+        // go after them (see OnWorkerWrite)
+        ssize_t n = (w.pending.len == 0 ? write(w.cmd_fds[1], buf, len) : 0);
+        if(n == len)
+            continue;
+        if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            LOG_ERROR("%s: worker=%d, write error: %s\n", __func__, i + 1, strerror(errno));
+            continue;
+        }
+        
+        // The pipe is full (the worker is busy), write the command once
+        // it's writable. Note: Printf logs if out of memory.
+        bool first = (w.pending.len == 0);
+        if(w.pending.Printf("%s", buf) && first &&
+           !CallbackAdd(w.cmd_fds[1], -1, nullptr, &CTcpProxy::OnWorkerWrite, EVENT_WRITE, 0))
+        {
+            LOG_ERROR("%s: worker=%d, can't wait for the pipe, %zu bytes of commands dropped\n",
+                      __func__, i + 1, w.pending.len);
+            w.pending.Clear();
+        }
     }
-
-    return true;
 }
 
-// Called by the event loop when ready to read connected socket
-void CTcpProxy::OnRead(int fd)
+// Called by the event loop when ready to write the commands queued for the worker
+void CTcpProxy::OnWorkerWrite(int fd)
 {
-    Callback* cb = GetCallback(fd);
-    if(cb == nullptr)
+    Worker* w = nullptr;
+    for(int i = 0; i < worker_count - 1 && workers != nullptr && w == nullptr; i++)
     {
-        printf("%s: fd=%d, cb is NULL\n", __func__, fd);
-        return;
+        if(workers[i].cmd_fds[1] == fd)
+            w = &workers[i];
     }
-    
-    // Write to peer socket buffer
-    Callback* peer_cb = GetCallback(cb->peer_fd);
-    if(peer_cb == nullptr)
+    if(w == nullptr)
     {
-        printf("%s: fd=%d, peer_fd=%d: peer_cb=nullptr\n", __func__, fd, cb->peer_fd);
-        CloseSock(fd, cb->peer_fd); // Note: arg is no longer valid
+        LOG_ERROR("%s: fd=%d, no worker of the pipe\n", __func__, fd);
+        CallbackRemove(fd);
         return;
     }
     
-    if(peer_cb->len != 0)
-        return; // Still have date to write from previous read
-    
-    ssize_t n = read(fd, peer_cb->buf, sizeof(peer_cb->buf));
-    
-    if(n == 0)
-    {
-        // The connection has been gracefully closed by the client
-        printf("%s: fd=%d, the client closed the connection\n", __func__, fd);
-        CloseSock(fd, cb->peer_fd); // Note: arg is no longer valid
-    }
-    else if(n < 0)
+    // Note: The queued commands may be split between the writes, the
+    // worker keeps the incomplete command for its next read
+    size_t done = 0;
+    bool wait = false;
+    while(done < w->pending.len && w->running && !w->exited)
     {
-        // Client communication error
-        if(errno != EAGAIN && errno != EINTR)
+        ssize_t n = write(fd, w->pending.data + done, w->pending.len - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
         {
-            printf("%s: fd=%d, read error: %s\n", __func__, fd, strerror(errno));
-            CloseSock(fd, cb->peer_fd); // Note: arg is no longer valid
+            wait = true; // Wait for the pipe to become writable again
+            break;
+        }
+        if(n < 0)
+        {
+            LOG_ERROR("%s: fd=%d, write error: %s\n", __func__, fd, strerror(errno));
+            break;
         }
+        done += n;
     }
-    else
+    
+    if(wait)
     {
-        // Success
-        peer_cb->len = n;
+        // Keep the rest for the next call
+        memmove(w->pending.data, w->pending.data + done, w->pending.len - done);
+        w->pending.len -= done;
+        w->pending.data[w->pending.len] = '\0';
+        return;
     }
+    
+    // All written (or the worker is gone)
+    w->pending.Clear();
+    CallbackRemove(fd);
 }
 
-// Called by the event loop when ready to write connected socket
-void CTcpProxy::OnWrite(int fd)
+void CTcpProxy::SetCpuAffinity()
+{
+    if(cpu < 0)
+        return;
+    
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if(err != 0)
+        LOG_ERROR("%s: worker=%d, pthread_setaffinity_np error: %s\n", __func__, worker_id, strerror(err));
+    else
+        LOG_INFO("%s: worker=%d, pinned to CPU %d\n", __func__, worker_id, cpu);
+#endif // __linux__
+}
+
+// Called by the worker event loop when ready to read command pipe
+void CTcpProxy::OnWorkerCommand(int fd)
 {
     Callback* cb = GetCallback(fd);
     if(cb == nullptr)
     {
-        printf("%s: fd=%d, cb is NULL\n", __func__, fd);
+        LOG_ERROR("%s: fd=%d, cb is NULL\n", __func__, fd);
         return;
     }
     
-    if(cb->len == 0)
-        return; // Nothing to write
-    
-    ssize_t n = write(fd, cb->buf, cb->len);
-    
-    if(n == 0)
+    // Note: The commands buffer is kept until the pipe is closed
+    if(!GetBuffer(cb))
     {
-        printf("%s: fd=%d, write error EOF: %s\n", __func__, fd, strerror(errno));
-        CloseSock(fd, cb->peer_fd); // Note: cb is no longer valid
+        keep_running = false;
+        return;
     }
-    else if(n < 0)
+    
+    while(keep_running)
     {
-        if(errno != EAGAIN && errno != EINTR)
+        // Note: Leave the room for the terminating 0
+        ssize_t n = read(fd, cb->buf + cb->len, cb->size - cb->len - 1);
+        
+        if(n == 0)
         {
-            printf("%s: fd=%d, write error: %s\n", __func__, fd, strerror(errno));
-            CloseSock(fd, cb->peer_fd); // Note: arg is no longer valid
+            // The main worker closed the pipe, time to exit
+            keep_running = false;
+            break;
         }
-    }
-    else
-    {
-        // Success
-        if(n < cb->len)
+        else if(n < 0)
         {
-            // Still have data to write.
-            // Shift remaining date to the beginning of the buffer
-            memmove(cb->buf, cb->buf + n, cb->len - n);
-            cb->len = cb->len - n;
+            if(errno == EINTR)
+                continue;
+            
+            if(errno != EAGAIN)
+            {
+                LOG_ERROR("%s: fd=%d, read error: %s\n", __func__, fd, strerror(errno));
+                keep_running = false;
+            }
+            break;
         }
-        else
+        
+        cb->len += n;
+        cb->buf[cb->len] = '\0';
+        
+        // Process all complete (new-line terminated) commands
+        char* cmd = (char*)cb->buf;
+        char* end = nullptr;
+        while((end = strchr(cmd, '\n')) != nullptr)
+        {
+            *end = '\0';
+            if(end != cmd)
+                ProcessCmd(TrimString(cmd));
+            cmd = end + 1;
+        }
+        
+        // Keep an incomplete command for the next read
+        cb->len = strlen(cmd);
+        memmove(cb->buf, cmd, cb->len + 1);
+        
+        if(cb->len == cb->size - 1)
         {
-            // No data to write left
+            LOG_ERROR("%s: fd=%d, command is too long, dropped\n", __func__, fd);
             cb->len = 0;
         }
     }
 }
 
-// Called by the event loop when ready to read/accept connected socket
-void CTcpProxy::OnConnect(int fd)
+void CTcpProxy::CloseSock(int fd1, int fd2)
 {
-    socklen_t addr_len = sizeof(struct sockaddr); // in/out parameter
-    struct sockaddr source_addr;
-    memset(&source_addr, 0, sizeof(struct sockaddr));
-    
-    int source_fd = accept(fd, &source_addr, &addr_len);
-    if(source_fd < 0)
+    for(int fd : {fd1, fd2})
     {
-        if(errno != EAGAIN && errno != EINTR) // nonblocking, retry
-            printf("%s: fd=%d, accept error: %s\n", __func__, fd, strerror(errno));
-        CloseSock(fd);
-        return;
+        if(fd >= 0)
+        {
+            if(fd < cb_size)
+            {
+                // Remove the session from its route (if any)
+                if(cb[fd].session != nullptr)
+                    SessionRemove(cb[fd].session);
+                
+                CallbackRemove(fd);
+            }
+            close(fd);
+        }
     }
-    
-    if(source_fd >= FD_SETSIZE)
+}
+
+bool CTcpProxy::SessionAdd(Route* rt, int target, int source_fd, int target_fd, bool connected,
+                           const IpAddr& source_ip, unsigned short source_port, uint64_t accept_ms)
+{
+    Session* s = session_slab.Alloc();
+    if(s == nullptr)
     {
-        printf("%s: fd=%d, source_fd=%d exeedes the max file descriptor %d\n",
-                __func__, fd, source_fd, FD_SETSIZE-1);
-        CloseSock(source_fd);
-        return;
+        LOG_ERROR("%s: Out of memory: session is NULL\n", __func__);
+        return false;
     }
     
-    if(!MakeAsync(source_fd)) // this may very well be redundant
-    {
-        printf("%s: fd=%d, make_async(source_fd) failed\n", __func__, fd);
-        CloseSock(source_fd);
-        return;
-    }
+    s->source_fd = source_fd;
+    s->target_fd = target_fd;
+    s->route = rt;
+    s->target = target;
+    s->connected = connected;
+    s->source_ip = source_ip;
+    s->source_port = source_port;
+    s->source_counted = (rt->opts.max_source_sessions != 0 && source_counts.Add(rt, source_ip));
+    s->start_ms = s->active_ms = now_ms;
+    s->accept_ms = accept_ms;
+    s->connect_ms = (connected ? now_ms : 0); // The pooled target is connected already
+    s->timer.data = s;
+    rt->targets[target].session_count++;
+    rt->targets[target].stats.sessions_active.Add(1);
+    rt->targets[target].stats.sessions_total.Add(1);
+    session_count++;
     
-    char source_ip[INET6_ADDRSTRLEN]{};
-    in_port_t source_port{0};
+    // Push to the head of the route's sessions
+    s->next = rt->sessions;
+    if(rt->sessions != nullptr)
+        rt->sessions->prev = s;
+    rt->sessions = s;
+    rt->session_count++;
+    
+    GetCallback(source_fd)->session = s;
+    GetCallback(target_fd)->session = s;
+    SessionTimer(s);
+    
+    const Target& t = rt->targets[target];
+    char ip_str[INET6_ADDRSTRLEN]{};
+    LOG_RECORD(LOG_LEVEL_INFO, "session_open", "worker=%d src=%s:%hu src_fd=%d dst=%s:%hu dst_fd=%d pooled=%d",
+               worker_id, s->source_ip.ToString(ip_str, sizeof(ip_str)), s->source_port, source_fd,
+               t.ip, t.port, target_fd, (int)connected);
+    return true;
+}
 
-    if(source_addr.sa_family == AF_INET)
-    { 
-        const sockaddr_in& addr = (sockaddr_in&)source_addr;
-        source_port = addr.sin_port;
-        inet_ntop(AF_INET, &addr.sin_addr, source_ip, INET_ADDRSTRLEN);
-    }
-    else if(source_addr.sa_family == AF_INET6)
-    {
-        const sockaddr_in6& addr6 = (sockaddr_in6&)source_addr;
-        source_port = addr6.sin6_port;
-        inet_ntop(AF_INET6, &addr6.sin6_addr, source_ip, INET6_ADDRSTRLEN);
-    }
+void CTcpProxy::SessionRemove(Session* s)
+{
+    // Unlink from the route's sessions, or the target's pool
+    Route* rt = s->route;
+    Target& t = rt->targets[s->target];
+    if(s->prev != nullptr)
+        s->prev->next = s->next;
+    else if(s->pooled)
+        t.pool = s->next;
     else
-    {
-        printf("%s: fd=%d, unsupported socket address family\n", __func__, fd);
-        CloseSock(source_fd);
-        return;
-    }
+        rt->sessions = s->next;
+    if(s->next != nullptr)
+        s->next->prev = s->prev;
     
-    // Lookup server name and establish control connection
-    Route* rt = GetRoute(source_ip);
-    if(rt == nullptr)
+    if(s->pooled)
     {
-        printf("%s: fd=%d, GetRoute failed for source_ip=%s\n", __func__, fd, source_ip);
-        CloseSock(source_fd);
-        return;
+        t.pool_count--;
     }
-    
-    int target_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if(target_fd < 0)
+    else
     {
-        printf("%s: fd=%d, socket error: %s\n", __func__, fd, strerror(errno));
-        CloseSock(source_fd);
-        return;
+        rt->session_count--;
+        t.session_count--;
+        t.stats.sessions_active.Sub(1);
+        session_count--;
+        if(s->source_counted)
+            source_counts.Remove(rt, s->source_ip);
+        
+        char ip_str[INET6_ADDRSTRLEN]{};
+        // Note: The times of the events are from the accept (-1 - never),
+        // i.e. first_out_ms - first_in_ms is the target's response time
+        LOG_RECORD(LOG_LEVEL_INFO, "session_close", "worker=%d src=%s:%hu src_fd=%d dst=%s:%hu dst_fd=%d "
+                   "duration_ms=%llu connect_ms=%lld first_in_ms=%lld first_out_ms=%lld close_ms=%lld "
+                   "bytes_in=%llu bytes_out=%llu",
+                   worker_id, s->source_ip.ToString(ip_str, sizeof(ip_str)), s->source_port, s->source_fd,
+                   t.ip, t.port, s->target_fd, (unsigned long long)(now_ms - s->start_ms),
+                   s->Since(s->connect_ms), s->Since(s->first_in_ms), s->Since(s->first_out_ms), s->Since(now_ms),
+                   (unsigned long long)s->bytes_in, (unsigned long long)s->bytes_out);
     }
     
-    if(target_fd >= FD_SETSIZE)
+    timers->Cancel(&s->timer);
+    
+    // Detach from both callbacks, so the peer's close doesn't remove it again
+    for(int fd : {s->source_fd, s->target_fd})
     {
-        printf("%s: fd=%d, target_fd=%d exeedes the max file descriptor %d\n",
-                __func__, fd, target_fd, FD_SETSIZE-1);
-        CloseSock(source_fd, target_fd);
-        return;
+        if(fd >= 0 && fd < cb_size && cb[fd].session == s)
+            cb[fd].session = nullptr;
     }
+    session_slab.Free(s);
     
-    if(!MakeAsync(target_fd))
+    // Delete the removed route with its last session. Note: The stats of
+    // the replaced route go on in the route replacing it (see SetRoute).
+    if(rt->retired && rt->session_count == 0)
     {
-        printf("%s: fd=%d, make_async(target_fd) failed\n", __func__, fd);
-        CloseSock(source_fd, target_fd);
-        return;
+        Route** p = &retired;
+        while(*p != nullptr && *p != rt)
+            p = &(*p)->next;
+        if(*p != nullptr)
+            *p = rt->next;
+        if(rt->replaced)
+            MergeStats(rt);
+        delete rt;
     }
+}
+
+void CTcpProxy::RemoveRoute(Route* rt)
+{
+    LOG_INFO("%s: Removing route %s (%zu session(s) left to finish)\n", __func__, rt->source_ip, rt->session_count);
     
-    struct sockaddr_in target_addr;
-    memset(&target_addr, 0, sizeof(struct sockaddr_in));
-    target_addr.sin_family = AF_INET;
-    target_addr.sin_port = htons(rt->target_port);
-    inet_aton(rt->target_ip, &target_addr.sin_addr);
+    pthread_mutex_lock(&routes_mutex);
+    listeners[rt->opts.listener].routes.Remove(rt);
+    pthread_mutex_unlock(&routes_mutex);
+    RetireRoute(rt);
+}
+
+void CTcpProxy::RetireRoute(Route* rt)
+{
+    // Note: The sessions are not closed, but get no new ones
+    for(int i = 0; i < rt->target_count; i++)
+        ClosePool(rt->targets[i]);
     
-    if(connect(target_fd, (struct sockaddr*)&target_addr, sizeof(struct sockaddr_in)) < 0)
+    if(rt->session_count == 0)
     {
-        if(errno != EINPROGRESS) // nonblocking, connection stalled
-        {
-            printf("%s: fd=%d, connect error: %s\n", __func__, fd, strerror(errno));
-            CloseSock(source_fd, target_fd);
-            return;
-        }
+        delete rt;
+        return;
     }
     
-    printf("%s: fd=%d, connection proxied: %s:%d (fd=%d) --> %s:%hu (fd=%d)\n", __func__, fd,
-           source_ip, ntohs(source_port), source_fd, 
-           rt->target_ip, rt->target_port, target_fd);
-    
-    // Add client/server callbacks
-    CallbackAdd(source_fd, target_fd, &CTcpProxy::OnRead, &CTcpProxy::OnWrite);
-    CallbackAdd(target_fd, source_fd, &CTcpProxy::OnRead, &CTcpProxy::OnWrite);
-    
-    // Update source/target route table
-    rt->source_fd = source_fd;
+    // Keep the route until its last session is closed (see SessionRemove)
+    rt->retired = true;
+    rt->next = retired;
+    retired = rt;
 }
 
-void CTcpProxy::OnCommand(int fd)
+bool CTcpProxy::ProcessCmd(const char* cmd)
 {
-    Callback* cb = GetCallback(fd);
-    if(cb == nullptr)
+    // The commands of the main worker to the others (see OnResolve and
+    // ProbeDone) are not taken from the fifo, so the workers' targets don't
+    // differ from its ones
+    if(worker_id == 0 && (strncasecmp(cmd, CMD_RESOLVED, strlen(CMD_RESOLVED)) == 0 ||
+                          strncasecmp(cmd, CMD_HEALTH, strlen(CMD_HEALTH)) == 0))
     {
-        printf("%s: fd=%d, cb is NULL\n", __func__, fd);
-        return;
+        LOG_ERROR("%s: Worker only command \"%s\"\n", __func__, cmd);
+        return false;
     }
     
-    ssize_t n = read(fd, cb->buf + cb->len, sizeof(cb->buf) - cb->len);
+    // Forward the command to other workers (if any)
+    SendWorkers(cmd);
     
-    if(n == 0)
+    bool res = true;
+    if(batch_open && strncasecmp(cmd, CMD_ROUTE, strlen(CMD_ROUTE)) == 0)
     {
-        // The connection has been gracefully closed by the client
-        //printf("%s fd=%d: The client closed the connection\n", __func__, fd);
-        
-        // Process command
-        char* cmd = TrimString((char*)cb->buf);
-        printf("%s: fd=%d, cmd=\"%s\"\n", __func__, fd, cmd);
-        
-        ProcessCmd(cmd);
-        if(!keep_running)
-            return;
-
-        // Close fifo & reopen since connection is closed
-        CloseSock(fd);
-        MakeCmdPipe();
-        
-        // Reset cmd buffer
-        memset(cb->buf, 0, sizeof(cb->buf));
-        cb->len = 0;
+        // Keep the batch's routes until it's committed. Note: The route
+        // is lost if out of memory (logged by Printf).
+        res = batch.Printf("%s\n", cmd + strlen(CMD_ROUTE));
     }
-    else if(n < 0)
+    else if(strcasecmp(cmd, CMD_BEGIN) == 0)
     {
-        // Client communication error
-        if(errno != EAGAIN && errno != EINTR)
-        {
-            printf("%s: fd=%d, read error: %s\n", __func__, fd, strerror(errno));
-            
-            // Reset cmd buffer
-            memset(cb->buf, 0, sizeof(cb->buf));
-            cb->len = 0;
-        }
+        batch.Clear();
+        batch_open = true;
     }
-    else
+    else if(strcasecmp(cmd, CMD_ABORT) == 0)
     {
-        // Success
-        cb->len += n;
+        batch.Clear();
+        batch_open = false;
     }
-}
-
-void CTcpProxy::CloseSock(int fd1, int fd2)
-{
-    for(int fd : {fd1, fd2})
+    else if(strcasecmp(cmd, CMD_COMMIT) == 0 || strcasecmp(cmd, CMD_REPLACE) == 0)
     {
-        if(fd >= 0)
+        // Apply the batch's routes (one per line) in one go
+        LOG_INFO("%s: Committing %zu bytes of routes\n", __func__, batch.len);
+        for(Route* rt = FirstRoute(); rt != nullptr; rt = NextRoute(rt))
+            rt->mark = false;
+        char* route_conf = batch.data;
+        while(route_conf != nullptr && *route_conf != '\0')
         {
-            close(fd);
-            if(fd < FD_SETSIZE)
-                CallbackRemove(fd);
-            
-            // If fd represents a source host, then update routing table
-            Route* rt = GetRoute(fd);
-            if(rt != nullptr)
-                rt->source_fd = -1;
+            char* end = strchr(route_conf, '\n');
+            *end++ = '\0';
+            if(!AddRoute(route_conf))
+                res = false;
+            route_conf = end;
+        }
+        batch.Clear();
+        batch_open = false;
+        
+        // Remove the routes not set by the batch (unless it failed)
+        for(Route* rt = FirstRoute(); rt != nullptr && res && strcasecmp(cmd, CMD_REPLACE) == 0; )
+        {
+            Route* rt_next = NextRoute(rt);
+            if(!rt->mark)
+                RemoveRoute(rt);
+            rt = rt_next;
         }
     }
-}
-
-void CTcpProxy::ProcessCmd(const char* cmd)
-{
-    if(strcasecmp(cmd, CMD_EXIT) == 0)
+    else if(strcasecmp(cmd, CMD_DRAIN) == 0)
+    {
+        Drain();
+    }
+    else if(strcasecmp(cmd, CMD_EXIT) == 0)
     {
         keep_running = false;
     }
+    else if(strncasecmp(cmd, CMD_RESOLVED, strlen(CMD_RESOLVED)) == 0 && worker_id > 0)
+    {
+        // New target host address published by the main worker
+        char host[HOST_NAME_MAX+1]{};
+        char ip[INET6_ADDRSTRLEN]{};
+        char format[32]{};
+        sprintf(format, "%%%ds %%%ds", HOST_NAME_MAX, INET6_ADDRSTRLEN - 1);
+        if(sscanf(cmd + strlen(CMD_RESOLVED), format, host, ip) == 2)
+            UpdateTargets(host, ip);
+    }
+    else if(strncasecmp(cmd, CMD_HEALTH, strlen(CMD_HEALTH)) == 0 && worker_id > 0)
+    {
+        // Target health check result published by the main worker
+        char host[HOST_NAME_MAX+1]{};
+        unsigned short port = 0;
+        char state[8]{};
+        char format[32]{};
+        sprintf(format, "%%%ds %%hu %%7s", HOST_NAME_MAX);
+        if(sscanf(cmd + strlen(CMD_HEALTH), format, host, &port, state) == 3)
+            SetTargetHealth(host, port, strcasecmp(state, "down") == 0);
+    }
     else if(strncasecmp(cmd, CMD_ROUTE, strlen(CMD_ROUTE)) == 0)
     {
         // Expected command format is "route: 192.168.0.1 192.168.0.1:8080";
-        printf("%s: cmd=\"%s\"\n", __func__, cmd);
+        LOG_INFO("%s: cmd=\"%s\"\n", __func__, cmd);
         const char* route_conf = cmd + strlen(CMD_ROUTE);
-        AddRoute(route_conf);
+        res = AddRoute(route_conf);
     }
     else
     {
-        printf("%s: Unknown command \"%s\"\n", __func__, cmd);
+        LOG_ERROR("%s: Unknown command \"%s\"\n", __func__, cmd);
+        res = false;
     }
+    return res;
 }
 
 char* CTcpProxy::TrimString(char* str) const
@@ -1030,7 +5382,139 @@ char* CTcpProxy::TrimString(char* str) const
     return str;
 }
 
-bool CTcpProxy::IsProcessRunning() const
+bool CTcpProxy::ParseRelayMode(const char* str, RelayMode& relay) const
+{
+    if(str == nullptr)
+        return false;
+    
+    if(strcasecmp(str, "copy") == 0)
+        relay = RELAY_COPY;
+    else if(strcasecmp(str, "splice") == 0)
+        relay = RELAY_SPLICE;
+    else
+        return false;
+    return true;
+}
+
+bool CTcpProxy::ParseBalanceMode(const char* str, BalanceMode& balance) const
+{
+    if(str == nullptr)
+        return false;
+    
+    if(strcasecmp(str, "rr") == 0)
+        balance = BALANCE_RR;
+    else if(strcasecmp(str, "leastconn") == 0)
+        balance = BALANCE_LEASTCONN;
+    else if(strcasecmp(str, "hash") == 0)
+        balance = BALANCE_HASH;
+    else
+        return false;
+    return true;
+}
+
+bool CTcpProxy::ParseSize(const char* str, size_t& size) const
+{
+    if(str == nullptr || *str == '\0')
+        return false;
+    
+    // Expected format: <number>[K|M], e.g. 512, 64K, 1M
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long n = strtoull(str, &end, 10);
+    if(end == str || *str == '-' || errno == ERANGE || n > SIZE_MAX)
+        return false;
+    
+    size_t mult = 1;
+    if(*end == 'k' || *end == 'K')
+    {
+        mult = 1024;
+        end++;
+    }
+    else if(*end == 'm' || *end == 'M')
+    {
+        mult = 1024 * 1024;
+        end++;
+    }
+    
+    // Note: The size that doesn't fit is invalid, not wrapped around
+    if(*end != '\0' || n > SIZE_MAX / mult)
+        return false;
+    
+    size = (size_t)n * mult;
+    return true;
+}
+
+bool CTcpProxy::ParseFlag(const char* str, int& flag) const
+{
+    if(str == nullptr)
+        return false;
+    
+    if(strcasecmp(str, "on") == 0 || strcasecmp(str, "true") == 0)
+        flag = 1;
+    else if(strcasecmp(str, "off") == 0 || strcasecmp(str, "false") == 0)
+        flag = 0;
+    else
+        return false;
+    return true;
+}
+
+bool CTcpProxy::ParseTime(const char* str, uint64_t& ms) const
+{
+    if(str == nullptr || *str == '\0')
+        return false;
+    
+    // Expected format: <number>[ms|s|m|h], e.g. 500ms, 30s, 5m, 1h (seconds by default)
+    char* end = nullptr;
+    unsigned long long n = strtoull(str, &end, 10);
+    if(end == str)
+        return false;
+    
+    if(strcasecmp(end, "ms") == 0)
+        ms = n;
+    else if(*end == '\0' || strcasecmp(end, "s") == 0)
+        ms = n * 1000;
+    else if(strcasecmp(end, "m") == 0)
+        ms = n * 60 * 1000;
+    else if(strcasecmp(end, "h") == 0)
+        ms = n * 60 * 60 * 1000;
+    else
+        return false;
+    return true;
+}
+
+bool CTcpProxy::ParseTimeout(const char* str, uint64_t& ms) const
+{
+    // Note: 0 is the global timeout, so the route turns it off by "off"
+    if(str != nullptr && strcasecmp(str, "off") == 0)
+    {
+        ms = TIMEOUT_OFF;
+        return true;
+    }
+    return ParseTime(str, ms);
+}
+
+uint64_t CTcpProxy::GetTimeout(uint64_t route_ms, uint64_t global_ms)
+{
+    if(route_ms == TIMEOUT_OFF)
+        return 0;
+    return (route_ms != 0 ? route_ms : global_ms);
+}
+
+uint64_t CTcpProxy::GetTimeMs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t CTcpProxy::GetTimeUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool CTcpProxy::IsProcessRunning(bool wait)
 {
     if(base_name[0] == '\0')
         return false;
@@ -1042,7 +5526,7 @@ bool CTcpProxy::IsProcessRunning() const
     if(fd == -1)
     {
         //perror("Cannot open lock file\n");
-        printf("%s: Cannot open lock file \"%s\": %s\n", __func__, lock_file, strerror(errno));
+        LOG_ERROR("%s: Cannot open lock file \"%s\": %s\n", __func__, lock_file, strerror(errno));
         return false;
     }
     
@@ -1054,17 +5538,19 @@ bool CTcpProxy::IsProcessRunning() const
     fl.l_len    = 0;            // length, 0 = to EOF
     fl.l_pid    = getpid();     // our PID
     
-    // Try to create a file lock
-    if(fcntl(fd, F_SETLK, &fl) == -1)   /* F_GETLK, F_SETLK, F_SETLKW */
+    // Try to create a file lock. Note: The lock is held until the fd is closed.
+    if(fcntl(fd, (wait ? F_SETLKW : F_SETLK), &fl) == -1)   /* F_GETLK, F_SETLK, F_SETLKW */
     {
         // we failed to create a file lock, meaning it's already locked
         if(errno == EACCES || errno == EAGAIN)
         {
-            printf("%s: Another instance of %s is already running\n", __func__, base_name);
+            LOG_ERROR("%s: Another instance of %s is already running\n", __func__, base_name);
+            close(fd);
             return true;
         }
     }
     
+    lock_fd = fd;
     return false;
 }
 
@@ -4,19 +4,53 @@
 #ifndef __TCP_PROXY__
 #define __TCP_PROXY__
 
-#include <sys/socket.h>     // fd_set
+#include <sys/socket.h>
+#include <sys/un.h>         // sockaddr_un
+#include <sys/uio.h>        // iovec
 #include <new>              // std::nothrow
 #include <arpa/inet.h>      // INET6_ADDRSTRLEN
 #include <limits.h>         // NAME_MAX
+#include <unistd.h>         // close
+#include <pthread.h>        // pthread_create
+#include "eventloop.h"
+#include "ipaddr.h"
+#include "prefixtrie.h"
+#include "resolver.h"
+#include "timerwheel.h"
+#include "bufferpool.h"
+#include "slab.h"
+#include "log.h"
+#include "stats.h"
+#include "ratelimit.h"
+#include "proxyproto.h"
 
-#define RW_BUFSIZE  512     // The size of READ/WRITE buffer
+#define RW_BUFSIZE  (16*1024)   // The default size of READ/WRITE buffer
+#define MIN_BUFSIZE 512         // The min size of READ/WRITE buffer
+#define MAX_BUFSIZE (64*1024*1024) // The max size of READ/WRITE buffer
+#define MAX_SOCKBUF (256*1024*1024) // The max SO_RCVBUF/SO_SNDBUF (capped by the system, i.e. rmem_max)
+#define CMD_BUFSIZE 512         // The size of command buffer
+#define MAX_ADMIN_REQUEST (64*1024*1024) // The max size of admin socket request (batch of commands)
+#define MAX_TARGETS 16          // The max number of targets per route
+#define MAX_POOL    256         // The max number of pre-connected sockets per target
+#define DNS_REFRESH 30          // The default target host names refresh interval, seconds
+#define CONNECT_TIMEOUT 10000   // The default target connect timeout, ms
+#define MAX_FAILS   5           // The default number of consecutive connect errors to eject the target
+#define EJECT_TIME  5000        // The default time the target is ejected for the first time, ms
+#define MAX_EJECT_TIME (5*60*1000) // The max time the target is ejected for (the back-off doubles up to it), ms
+#define MAX_FREE_BUFFERS (16*1024*1024) // The max size of free READ/WRITE buffers kept per worker
+#define LISTEN_BACKLOG 1024     // The default listen backlog (capped by the system, i.e. somaxconn)
+#define ACCEPT_BATCH 64         // The default max number of connections accepted per loop iteration
+#define MAX_HANDOFF_FDS 250     // The max number of listening sockets handed over per message (SCM_MAX_FD)
+#define MAX_LISTENERS 64        // The max number of listeners (listen: blocks)
+#define DRAIN_CHECK_MS 1000     // How often the draining main worker checks if the workers are done
+#define PROXY_HEADER_TIMEOUT_MS 5000 // How long the client has to send its PROXY protocol header
+#define TIMEOUT_OFF UINT64_MAX  // The route's timeout is off, even if the global one is set ("off")
 
-// Note: The number of TCP connections can be no higher than FD_SETSIZE
-// since select() can monitor only file descriptors numbers that are less
-// than FD_SETSIZE (1024). File descriptors 0, 1, and 2 are already in use
-// as stdin, stdout, and stderr. Moreover, libc can make use of a few file
-// descriptors for functions like gethostbyname. As a result, the real 
-// number of TCP connection will be lower then FD_SETSIZE.
+// Note: The number of TCP connections is limited by the process file
+// descriptors limit (RLIMIT_NOFILE), which is raised to its hard limit on
+// start-up. The "select" event loop can monitor only file descriptors
+// numbers that are less than FD_SETSIZE (1024), so use "epoll" (Linux)
+// or "kqueue" (BSD) event loop for a large number of connections.
 
 //
 // TCP proxy class
@@ -26,75 +60,551 @@ class CTcpProxy
     // Callback to make when a file descriptor is ready
     typedef void(CTcpProxy::*CALLBACK_FUNC)(int);
     
+    struct Route;
+    struct Session;
+    struct Probe;
+    struct HeaderWait;
+    
     struct Callback
     {
         CALLBACK_FUNC write_fn{nullptr};   // Function to call
         CALLBACK_FUNC read_fn{nullptr};    // Function to call
         
         int peer_fd{-1};
-        unsigned char buf[RW_BUFSIZE]{};
-        ssize_t len{0};
+        unsigned char* buf{nullptr};       // Ring buffer of the data to write to fd (from the pool)
+        size_t size{0};                    // The size of the buffer (or the pipe)
+        size_t head{0};                    // The offset of the first byte to write
+        size_t len{0};                     // The number of bytes to write
+        int pipe_fds[2]{-1, -1};           // Pipe of the data to write to fd (splice relay)
+        int events{0};                     // Events to monitor (EVENT_READ/EVENT_WRITE)
+        Session* session{nullptr};         // Session of the fd (source or target)
+        bool eof{false};                   // EOF read from fd (no more data to relay to the peer)
+        bool shut{false};                  // FIN sent to fd (the peer EOF and its data written out)
+        bool owned{false};                 // The buffer is not from the pool (new[], see ReadRequest)
+        Probe* probe{nullptr};             // Health check connect of the fd (see OnProbeConnect)
+        int listener{-1};                  // Listener of the listening socket (see OnConnect)
+        HeaderWait* header{nullptr};       // The client waiting for its PROXY header (see OnProxyHeader)
+        
+        // Contiguous data to write starting from the head
+        unsigned char* Data(size_t& n) const { n = (len < size - head ? len : size - head); return buf + head; }
+        
+        // Contiguous free space to read into after the data
+        unsigned char* Space(size_t& n) const
+        {
+            size_t tail = (head + len) % size;
+            n = (len == size ? 0 : (tail >= head ? size - tail : head - tail));
+            return buf + tail;
+        }
+        
+        // The data to write as up to two segments (the data might wrap
+        // around the end of the buffer). Returns the number of segments.
+        int DataVec(iovec iov[2]) const
+        {
+            size_t n = 0;
+            iov[0].iov_base = Data(n);
+            iov[0].iov_len = n;
+            iov[1].iov_base = buf;
+            iov[1].iov_len = len - n;
+            return (iov[1].iov_len > 0 ? 2 : 1);
+        }
         
-        void Reset() { new (this) Callback; } // Re-constract Callback in place
+        // The free space after the data as up to two segments of up to limit
+        // bytes in total. Returns the number of segments.
+        int SpaceVec(iovec iov[2], size_t limit) const
+        {
+            size_t n = 0;
+            iov[0].iov_base = Space(n);
+            iov[0].iov_len = (n < limit ? n : limit);
+            size_t rest = size - len - n;
+            iov[1].iov_base = buf;
+            iov[1].iov_len = (rest < limit - iov[0].iov_len ? rest : limit - iov[0].iov_len);
+            return (iov[1].iov_len > 0 ? 2 : 1);
+        }
+        
+        // Consume n bytes written out. Note: Rewind empty buffer, so the
+        // next read gets the whole buffer as a contiguous space.
+        void Consume(size_t n) { len -= n; head = (len == 0 ? 0 : (head + n) % size); }
+        
+        // Re-constract Callback in place. Note: The buffer must be put back
+        // to the pool (or deleted) before (see CallbackRemove).
+        void Reset()
+        {
+            for(int fd : pipe_fds)
+            {
+                if(fd >= 0)
+                    close(fd);
+            }
+            new (this) Callback;
+        }
     };
     
-    struct Route
+    // How the data is relayed between source and target sockets
+    enum RelayMode
+    {
+        RELAY_DEFAULT = 0,                 // Use global relay mode
+        RELAY_COPY,                        // read()/write() through user space buffer
+        RELAY_SPLICE                       // splice() through the pipe (Linux only)
+    };
+    
+    // How the target is selected for a new session
+    enum BalanceMode
+    {
+        BALANCE_RR = 0,                    // Round-robin
+        BALANCE_LEASTCONN,                 // The least number of sessions
+        BALANCE_HASH                       // Consistent hashing on source address
+    };
+    
+    // Socket options of the source and target sockets (see SetSocketOptions)
+    struct SocketOptions
+    {
+        int nodelay{-1};                   // TCP_NODELAY 0/1 (-1 - not set)
+        int quickack{-1};                  // TCP_QUICKACK 0/1 (Linux, -1 - not set)
+        int rcvbuf{0};                     // SO_RCVBUF, bytes (0 - not set)
+        int sndbuf{0};                     // SO_SNDBUF, bytes (0 - not set)
+        int keepidle{0};                   // TCP_KEEPIDLE, s (0 - not set)
+        int keepintvl{0};                  // TCP_KEEPINTVL, s (0 - not set)
+        int keepcnt{0};                    // TCP_KEEPCNT (0 - not set)
+        int tos{-1};                       // IP_TOS/IPV6_TCLASS (-1 - not set)
+        int fastopen{-1};                  // TCP_FASTOPEN_CONNECT of the target connect 0/1 (Linux, -1 - not set)
+        
+        // The options set here, and the defaults for the ones not set
+        SocketOptions Merge(const SocketOptions& defaults) const
+        {
+            SocketOptions so = *this;
+            so.nodelay = (nodelay >= 0 ? nodelay : defaults.nodelay);
+            so.quickack = (quickack >= 0 ? quickack : defaults.quickack);
+            so.rcvbuf = (rcvbuf > 0 ? rcvbuf : defaults.rcvbuf);
+            so.sndbuf = (sndbuf > 0 ? sndbuf : defaults.sndbuf);
+            so.keepidle = (keepidle > 0 ? keepidle : defaults.keepidle);
+            so.keepintvl = (keepintvl > 0 ? keepintvl : defaults.keepintvl);
+            so.keepcnt = (keepcnt > 0 ? keepcnt : defaults.keepcnt);
+            so.tos = (tos >= 0 ? tos : defaults.tos);
+            so.fastopen = (fastopen >= 0 ? fastopen : defaults.fastopen);
+            return so;
+        }
+        
+        bool operator==(const SocketOptions& o) const
+        {
+            return nodelay == o.nodelay && quickack == o.quickack && rcvbuf == o.rcvbuf && sndbuf == o.sndbuf &&
+                   keepidle == o.keepidle && keepintvl == o.keepintvl && keepcnt == o.keepcnt &&
+                   tos == o.tos && fastopen == o.fastopen;
+        }
+    };
+    
+    struct RouteOptions
+    {
+        size_t buffer_size{0};             // The size of READ/WRITE buffer (0 - use global)
+        RelayMode relay{RELAY_DEFAULT};    // Relay mode (RELAY_DEFAULT - use global)
+        BalanceMode balance{BALANCE_RR};   // Target selection for multiple targets
+        int pool{0};                       // Pre-connected sockets per target (0 - none)
+        uint64_t connect_timeout{0};       // Target connect timeout, ms (0 - use global, see TIMEOUT_OFF)
+        uint64_t idle_timeout{0};          // Session idle timeout, ms (0 - use global)
+        uint64_t max_lifetime{0};          // Session max lifetime, ms (0 - use global)
+        uint64_t drain_timeout{0};         // Half-closed session drain timeout, ms (0 - use global)
+        size_t max_sessions{0};            // Max sessions of the route (0 - no limit, see WorkerShare)
+        size_t max_source_sessions{0};     // Max sessions per source address of the route (0 - no limit)
+        uint64_t rate_in{0};               // Max bytes/sec from the sources (0 - no limit)
+        uint64_t rate_out{0};              // Max bytes/sec from the targets (0 - no limit)
+        SocketOptions sock;                // Socket options (the ones not set - use global)
+        int listener{0};                   // Listener of the route's clients (index, see Listener)
+        int proxy_protocol{0};             // PROXY protocol header version sent to the targets (0 - none)
+        
+        bool operator==(const RouteOptions& o) const
+        {
+            return buffer_size == o.buffer_size && relay == o.relay && balance == o.balance && pool == o.pool &&
+                   connect_timeout == o.connect_timeout && idle_timeout == o.idle_timeout &&
+                   max_lifetime == o.max_lifetime && drain_timeout == o.drain_timeout &&
+                   max_sessions == o.max_sessions && max_source_sessions == o.max_source_sessions &&
+                   rate_in == o.rate_in && rate_out == o.rate_out && sock == o.sock &&
+                   listener == o.listener && proxy_protocol == o.proxy_protocol;
+        }
+    };
+    
+    struct Target
+    {
+        char host[HOST_NAME_MAX+1]{};      // Host name/ip as configured
+        int ip_family{0};                  // 0 if the host name is not resolved yet
+        char ip[INET6_ADDRSTRLEN]{};
+        unsigned short port{0};
+        sockaddr_storage addr{};           // Socket address to connect to
+        socklen_t addr_len{0};
+        size_t hash{0};                    // Hash of ip/port (consistent hashing)
+        size_t session_count{0};           // The number of sessions to the target
+        Session* pool{nullptr};            // Pre-connected sockets (target side only)
+        int pool_count{0};                 // The number of pre-connected sockets
+        int fails{0};                      // Consecutive connect errors (see TargetFailed)
+        int ejections{0};                  // Consecutive ejections (the back-off exponent)
+        uint64_t ejected_until{0};         // Not selected until then, ms (0 - never ejected)
+        bool probe_down{false};            // Failed the health check (see ProbeTargets)
+        TargetStats stats;                 // Traffic of the target (see OnMetricsRead)
+    };
+    
+    // Accepted connection of the listener with proxy_protocol, which is routed
+    // once its PROXY header is read. The waits are in the order of accept, so
+    // the oldest ones time out first (see ExpireHeaders).
+    struct HeaderWait
+    {
+        int fd{-1};
+        int listener{0};
+        uint64_t start_ms{0};              // Accept time
+        unsigned char data[PROXY_HEADER_MAX]{}; // The part of the header read so far
+        size_t len{0};
+        HeaderWait* prev{nullptr};
+        HeaderWait* next{nullptr};
+    };
+    
+    // Health check of the target address (main worker only). The targets
+    // of all the routes with the same host and port share the probe.
+    struct Probe
+    {
+        char host[HOST_NAME_MAX+1]{};      // Host name/ip as configured
+        unsigned short port{0};
+        sockaddr_storage addr{};           // Socket address to connect to
+        socklen_t addr_len{0};
+        int fd{-1};                        // Pending connect (-1 - none)
+        bool down{false};                  // The last check failed
+        bool used{false};                  // Still the target of some route (see ProbeTargets)
+        Probe* next{nullptr};
+    };
+    
+    // Proxied connection from the source to the target socket. Both
+    // callbacks point to the session, and the session is linked into
+    // the list of its route's sessions, so it's unlinked in O(1).
+    // Pre-connected target sockets are the pooled sessions without
+    // the source, linked into the pool of their target instead.
+    struct Session
     {
+        enum { THROTTLE_SOURCE = 0x01, THROTTLE_TARGET = 0x02 };
+        
         int source_fd{-1};
-        int source_ip_family{0};
-        char source_ip[INET6_ADDRSTRLEN]{};
-        int target_ip_family{0};
-        char target_ip[INET6_ADDRSTRLEN]{};
-        unsigned short target_port{0};
-        Route* next{nullptr};
+        int target_fd{-1};
+        Route* route{nullptr};
+        int target{-1};                    // Index of the route's target
+        bool pooled{false};                // Pre-connected target socket (no source)
+        bool connected{false};             // Target connect completed
+        bool source_counted{false};        // Counted in the sessions of the source (see source_counts)
+        int throttled{0};                  // Sides with reading paused by the rate limit (THROTTLE_*)
+        uint64_t resume_ms{0};             // When to resume reading throttled side(s)
+        IpAddr source_ip;                  // Source address (none for pooled)
+        unsigned short source_port{0};
+        uint64_t start_ms{0};              // When the session started
+        uint64_t accept_ms{0};             // When the source was accepted (before its PROXY header, if any)
+        uint64_t connect_ms{0};            // When the target connect completed (0 - not yet)
+        uint64_t first_in_ms{0};           // When the first byte was read from the source (0 - none yet)
+        uint64_t first_out_ms{0};          // When the first byte was read from the target (0 - none yet)
+        uint64_t active_ms{0};             // When the data was read last time
+        uint64_t eof_ms{0};                // When the first side half-closed (0 - not yet)
+        uint64_t bytes_in{0};              // Bytes from the source to the target
+        uint64_t bytes_out{0};             // Bytes from the target to the source
+        CTimerWheel::Timer timer;          // Connect, idle or lifetime timeout
+        Session* prev{nullptr};            // Previous session of the route (or pool)
+        Session* next{nullptr};            // Next session of the route (or pool)
+        
+        // The time from the accept to the event, ms (-1 - not yet)
+        long long Since(uint64_t ms) const { return (ms != 0 ? (long long)(ms - accept_ms) : -1); }
+    };
+    
+    struct Route
+    {
+        Session* sessions{nullptr};        // List of the route's sessions
+        size_t session_count{0};           // The number of the route's sessions
+        IpAddr source_addr;                // Binary source address (route key)
+        int source_prefix_len{0};          // Source prefix length (full length for host)
+        char source_ip[INET6_ADDRSTRLEN+4]{}; // Source address (and "/<prefix_len>")
+        char source_host[HOST_NAME_MAX+1]{}; // The host name the source is resolved from (none - address)
+        Target targets[MAX_TARGETS];       // Targets to balance the sessions over
+        int target_count{0};
+        unsigned int rr_next{0};           // Next target for round-robin
+        RouteOptions opts;
+        TokenBucket shape_in;              // Bytes from the sources (opts.rate_in)
+        TokenBucket shape_out;             // Bytes from the targets (opts.rate_out)
+        bool mark{false};                  // Set or kept by the batch (see CMD_REPLACE)
+        bool retired{false};               // Removed from the table, deleted with its last session
+        bool replaced{false};              // Retired by the changed route, which took over its stats
+        Route* next{nullptr};              // Next route in the list of all routes (or retired ones)
+        Route* hash_next{nullptr};         // Next route in the hash bucket
+    };
+    
+    // Host routes hashed by the binary source address, and CIDR
+    // routes (including the default one) in the prefix tries.
+    struct RouteTable
+    {
+        Route* list{nullptr};              // List of all routes
+        Route** buckets{nullptr};          // Hash buckets of host routes
+        size_t bucket_count{0};            // The number of hash buckets (power of 2)
+        size_t host_count{0};              // The number of host routes
+        size_t count{0};                   // The number of routes
+        CPrefixTrie trie4{32};             // IPv4 CIDR routes
+        CPrefixTrie trie6{128};            // IPv6 CIDR routes
+        
+        ~RouteTable() { Clear(); }
+        
+        bool Insert(Route* rt);            // Note: The table owns the route
+        void Remove(Route* rt);            // Note: The caller owns the route then
+        Route* Find(const IpAddr& addr, int prefix_len) const; // Exact match
+        Route* Match(const IpAddr& addr) const; // Longest prefix match
+        void Clear();
+        
+    private:
+        bool Rehash(size_t new_count);
+    };
+    
+    // Address the proxy listens on ("listen:" block), with its own routes.
+    // Every worker listens on the TCP address (SO_REUSEPORT), and the main
+    // worker on the Unix socket.
+    struct Listener
+    {
+        char name[sizeof(sockaddr_un::sun_path)]{}; // "<port>", "<ip>:<port>", "[<ipv6>]:<port>" or Unix socket path
+        sockaddr_storage addr{};           // Address to bind (in6addr_any for "<port>")
+        socklen_t addr_len{0};
+        bool dual_stack{false};            // "<port>": IPv4 and IPv6 clients on all addresses
+        bool proxy_protocol{false};        // The clients send the PROXY protocol header (v1 or v2)
+        std::atomic<int> fd{-1};           // Listening socket of the worker (to hand over on upgrade)
+        int inherited_fd{-1};              // Listening socket taken over on upgrade (-1 - none)
+        RouteTable routes;                 // Routes of the listener's clients
+    };
+    
+    // Worker runs its own event loop with its own listener (SO_REUSEPORT),
+    // callbacks, buffers and a copy of the routes.
+    struct Worker
+    {
+        CTcpProxy* proxy{nullptr};         // Worker proxy instance
+        pthread_t thread;                  // Worker thread running the proxy event loop
+        bool running{false};               // Is worker thread started?
+        std::atomic<bool> exited{false};   // Is worker thread finished (i.e. drained)?
+        int cmd_fds[2]{-1, -1};            // Worker command pipe (read/write ends)
+        TextBuffer pending;                // Commands not written to the full pipe yet (see OnWorkerWrite)
     };
     
 public:
     CTcpProxy(const char* program_name, const char* configFile);
     ~CTcpProxy();
 
-    bool Start();
+    bool Start(bool upgrade=false);        // upgrade: Take over the listeners of the running instance
 
 private:
+    CTcpProxy(const CTcpProxy& parent, int worker_id); // Worker instance
+    
     bool Listen();
-    bool AddRoute(const char* route_conf);
-    bool AddRoute(const char* source_host, const char* target_host, unsigned short target_port);
+    bool AddListener(const char* name, const char* options);
+    int FindListener(const char* name) const;
+    bool IsSocketAddr(int fd, const sockaddr_storage& addr, bool dual_stack) const;
+    int InheritedFd(int listener, int k) const;
+    int MakeListener(Listener& l);
+    bool StartWorkers();
+    void StopWorkers();
+    void RunWorker(int cmd_fd);
+    static void* WorkerThread(void* arg);
+    void SendWorkers(const char* cmd);
+    void SetCpuAffinity();
+    bool AddRoute(const char* route_conf, bool apply=true, int listener=0); // apply=false: only check the route
+    bool AddRoute(const char* source_host, const char* targets, const RouteOptions& opts, bool apply);
+    bool SetRoute(const char* source_host, const IpAddr& source_addr, int prefix_len, const Route& conf);
+    uint64_t WorkerShare(uint64_t limit) const; // The worker's part of the route's limit
+    static int FindTarget(const Route* rt, const Target& t);
+    void MergeStats(Route* old);
+    bool ParseRouteOptions(const char* options, RouteOptions& opts);
+    bool ParseTarget(const char* target, Target& t, bool apply);
+    bool SetTargetAddr(Target& t, const char* ip);
+    int UpdateTargets(const char* host, const char* ip);
+    int SelectTarget(Route* rt, const IpAddr& source_addr);
+    bool IsTargetUp(const Target& t) const;
+    void TargetConnected(Target& t, uint64_t latency_ms);
+    void TargetFailed(Target& t);
+    void ProbeTargets();
+    void ProbeDone(Probe* p, bool up);
+    void SetTargetHealth(const char* host, unsigned short port, bool down);
     
-    void CallbackAdd(int fd, int peer_fd, CALLBACK_FUNC read_fn, CALLBACK_FUNC write_fn);
+    bool CallbackAdd(int fd, int peer_fd, CALLBACK_FUNC read_fn, CALLBACK_FUNC write_fn,
+                     int events, size_t buf_size);
+    bool CallbackModify(int fd, int events);
     void CallbackRemove(int);
     void CallbackSelect();
+    bool CallbackReserve(int fd);
     inline Callback* GetCallback(int fd);
     
     // Callback: Called by the event loop when ready to read/write/accept connected socket
     void OnRead(int fd);
     void OnWrite(int fd);
+    void OnSpliceRead(int fd);
+    void OnSpliceWrite(int fd);
     void OnConnect(int fd);
+    void NewConnection(int source_fd, const sockaddr_storage& source_addr, int listener, uint64_t accept_ms,
+                       const sockaddr_storage* dest_addr=nullptr); // dest_addr nullptr - the local one
+    
+    // Callback: Called by the event loop when ready to read the PROXY header of the client
+    void OnProxyHeader(int fd);
+    bool WaitHeader(int fd, int listener);
+    void ExpireHeaders();
+    bool QueueProxyHeader(int target_fd, const ProxyHeader& header, int version);
     
     // Callback: Called by the event loop when ready to read command fifo
     void OnCommand(int fd);
     
+    // Callback: Called by the worker event loop when ready to read command pipe
+    void OnWorkerCommand(int fd);
+    
+    // Callback: Called by the event loop when ready to write the commands queued for the worker
+    void OnWorkerWrite(int fd);
+    
+    // Callback: Called by the event loop when target socket connect completes
+    void OnTargetConnect(int fd);
+    
+    // Called when session timer expires
+    void OnTimer(Session* s);
+    
+    // Callback: Called by the event loop when health check connect completes
+    void OnProbeConnect(int fd);
+    
+    // Callback: Called by the event loop when pooled target socket is ready
+    void OnPoolRead(int fd);
+    void OnPoolWrite(int fd);
+    
+    // Callback: Called by the event loop when resolver has the results
+    void OnResolve(int fd);
+    
+    // Callback: Called by the event loop when ready to accept/read metrics connection
+    void OnMetricsConnect(int fd);
+    void OnMetricsRead(int fd);
+    
+    // Callback: Called by the event loop when ready to accept/read admin socket connection
+    void OnAdminConnect(int fd);
+    void OnAdminRead(int fd);
+    
+    // Callback: Called by the event loop when ready to write the reply (metrics or admin)
+    void OnReplyWrite(int fd);
+    
+    // Callback: Called by the event loop when a signal is caught (i.e. SIGHUP)
+    void OnSignal(int fd);
+    
     // Helpers
     bool ReadConfig(const char* config_file);
     bool MakeCmdPipe();
+    bool MakeResolver();
+    bool MakeMetrics();
+    bool FormatStats(TextBuffer& text);
+    bool FormatSessions(TextBuffer& text);
+    CTcpProxy* RunningWorker(int w);       // w: 0 - this one (the main worker)
+    bool MakeAdminSocket(bool upgrade);
+    void MoveAdminSocket();
+    void RunBatch(char* cmds, TextBuffer& reply, int fd, bool replace=false);
+    bool Reload();
+    bool HandoffListeners(int fd);
+    bool TakeListeners();
+    void Drain();
+    bool WorkersExited() const;
+    bool MakeSignalPipe();
+    static void SignalHandler(int sig);
+    int ReadRequest(int fd, size_t max_size);
+    void SendReply(int fd, TextBuffer& reply);
+    bool MakeNonBlocking(int fd);
     bool MakeAsync(int fd);
-    void ProcessCmd(const char* cmd);
+    void SetSocketOptions(int fd, int family, const SocketOptions& so);
+    bool SetListenerOptions(int fd);
+    bool MakeEventLoop();
+    bool Flush(int fd);
+    bool GetBuffer(Callback* c);
+    void PutBuffer(Callback* c);
+    bool ReadEof(int fd);
+    bool ShutdownWrite(int fd);
+    bool SpliceFlush(int fd);
+    void FlushEvents(int fd, bool resume_peer);
+    bool MakePipe(int fd, size_t size);
+    bool ParseRelayMode(const char* str, RelayMode& relay) const;
+    bool ParseBalanceMode(const char* str, BalanceMode& balance) const;
+    bool ProcessCmd(const char* cmd);
     void CloseSock(int fd1, int fd2=-1);
-    Route* GetRoute(const char* source_ip);
-    Route* GetRoute(int source_fd);
+    bool SessionAdd(Route* rt, int target, int source_fd, int target_fd, bool connected,
+                    const IpAddr& source_ip, unsigned short source_port, uint64_t accept_ms);
+    void SessionTimer(Session* s);
+    void CloseSession(Session* s);
+    void SessionRemove(Session* s);
+    void RemoveRoute(Route* rt);
+    void RetireRoute(Route* rt);               // The route removed from the table (see retired)
+    int ConnectTarget(Target& t, const SocketOptions& so);
+    void FillPool(Route* rt, int target);
+    void ClosePool(Target& t);
+    int TakePooled(Route* rt, int target);
+    bool IsPooledAlive(int fd) const;
+    inline void CountBytes(Session* s, int fd, size_t n);
+    inline size_t ShapeLimit(Session* s, int fd);
+    void ThrottleRead(Session* s, int fd);
+    void ResumeRead(Session* s);
+    bool IsThrottled(const Session* s, int fd) const;
+    Route* GetRoute(int listener, const IpAddr& source_addr);
+    Route* FirstRoute(int listener=0) const;    // All the routes of the listeners in order
+    Route* NextRoute(const Route* rt) const;
     
     // Utils
     char* TrimString(char* str) const; // Trimming whitespace (both side)
-    bool IsProcessRunning() const;
+    bool ParseSize(const char* str, size_t& size) const; // Parse size with K/M suffix
+    bool ParseAddress(const char* str, const char* default_ip, sockaddr_storage& addr, socklen_t& addr_len) const;
+    bool ParseTime(const char* str, uint64_t& ms) const; // Parse time with ms/s/m/h suffix
+    bool ParseTimeout(const char* str, uint64_t& ms) const; // Parse route timeout: time or "off" (TIMEOUT_OFF)
+    static uint64_t GetTimeout(uint64_t route_ms, uint64_t global_ms); // The route's timeout in effect (0 - none)
+    bool ParseFlag(const char* str, int& flag) const;      // Parse on/off (true/false) as 1/0
+    static uint64_t GetTimeMs();                           // Monotonic time, ms
+    static uint64_t GetTimeUs();                           // Monotonic time, us
+    bool IsProcessRunning(bool wait=false); // wait: Wait for the running instance to release the lock
 
     // Class data
     char base_name[NAME_MAX+1]{}; // Base name of the program
     char conf_name[PATH_MAX+1]{}; // The name of the config file
-    Callback cb[FD_SETSIZE]{};    // Array of callbacks (for every fd)
-    fd_set rfds;                  // Set of fds to be checked for readability
-    fd_set wfds;                  // Set of fds to be checked for writability
-    int fd_max{-1};               // Highest-numbered file descriptor in set
-    unsigned short port{0};       // Port to listen
-    Route* route{nullptr};        // List of routes
+    char loop_name[16]{};         // Event loop backend name (epoll, kqueue or select)
+    CEventLoop* loop{nullptr};    // Event loop backend
+    Callback* cb{nullptr};        // Array of callbacks (for every fd)
+    int cb_size{0};               // The size of callbacks array
+    CBufferPool buffers{MAX_FREE_BUFFERS}; // READ/WRITE buffers of the callbacks
+    CSlab<Session> session_slab;  // Sessions (and pooled target sockets)
+    int listen_backlog{LISTEN_BACKLOG}; // The listen backlog
+    int accept_batch{ACCEPT_BATCH}; // The max number of connections accepted per loop iteration
+    int tcp_fastopen{0};          // TCP_FASTOPEN queue of the listener (0 - off)
+    int defer_accept{0};          // TCP_DEFER_ACCEPT of the listener, s (Linux, 0 - off)
+    SocketOptions sock_opts;      // The default socket options (see SocketOptions)
+    size_t buffer_size{RW_BUFSIZE}; // The default size of READ/WRITE buffer
+    RelayMode relay{RELAY_COPY};  // The default relay mode
+    Listener listeners[MAX_LISTENERS]; // Addresses to listen on, with the tables of routes
+    int listener_count{0};
+    int worker_id{0};             // Worker id (0 - main thread)
+    int worker_count{1};          // The number of workers (event loops)
+    Worker* workers{nullptr};     // Workers (other than main one)
+    bool cpu_affinity{false};     // Pin workers to CPUs
+    bool loop_histogram{false};   // Record the dispatch time of every event loop iteration (see CallbackSelect)
+    int cpu{-1};                  // CPU to pin the worker to (-1 - none)
+    CResolver* resolver{nullptr}; // Target host names resolver (main worker only)
+    int dns_refresh{DNS_REFRESH}; // Target host names refresh interval (0 - never)
+    CTimerWheel* timers{nullptr}; // Session timers
+    uint64_t now_ms{0};           // Event loop time (updated once per loop iteration)
+    uint64_t connect_timeout{CONNECT_TIMEOUT}; // The default target connect timeout, ms
+    uint64_t idle_timeout{0};     // The default session idle timeout, ms (0 - none)
+    uint64_t max_lifetime{0};     // The default session max lifetime, ms (0 - none)
+    uint64_t drain_timeout{0};    // The default half-closed session drain timeout, ms (0 - none)
+    uint64_t health_interval{0};  // Target health check interval, ms (0 - none)
+    int max_fails{MAX_FAILS};     // Consecutive connect errors to eject the target (0 - never)
+    uint64_t eject_time{EJECT_TIME}; // The first ejection time, ms (doubled on every next one)
+    Probe* probes{nullptr};       // Health checks of the target addresses (main worker only)
+    CTimerWheel::Timer health_timer; // Next round of the health checks (main worker only)
+    HeaderWait* header_waits{nullptr}; // Clients waiting for their PROXY header, the oldest first
+    HeaderWait* header_waits_tail{nullptr};
+    CTimerWheel::Timer header_timer; // The oldest client waiting for its PROXY header times out
+    WorkerStats stats;            // Connections of the worker (the routes have their own)
+    pthread_mutex_t routes_mutex = PTHREAD_MUTEX_INITIALIZER; // Locked to change the routes seen by the stats
+    pthread_mutex_t loop_mutex = PTHREAD_MUTEX_INITIALIZER; // Held by the worker unless waiting for the events
+    char metrics_addr[INET6_ADDRSTRLEN+8]{}; // Address of the metrics listener ("[<ip>:]<port>", main worker only)
+    int metrics_fd{-1};           // Metrics socket taken over on upgrade (-1 - none)
+    char admin_path[sizeof(sockaddr_un::sun_path)]{}; // Path of the admin socket (main worker only)
+    TextBuffer batch;             // The route commands of the batch not committed yet
+    bool batch_open{false};       // Is the route batch started?
+    Route* retired{nullptr};      // Routes removed from the table, but still having sessions
+    size_t session_count{0};      // The number of sessions (all routes)
+    CSourceCounts source_counts;  // The number of sessions per route and source address (see max_source_sessions)
+    int* inherited_fds{nullptr};  // All listening sockets taken over (main worker only)
+    int* inherited_listeners{nullptr}; // Listener of every socket taken over (-1 - none)
+    int inherited_count{0};
+    int lock_fd{-1};              // Lock file of the running instance
+    bool draining{false};         // Not accepting, exit when the sessions are closed
+    bool handed_off{false};       // The listeners (and the files) are taken over by the new instance
+    static int signal_fds[2];     // Pipe to pass the signals caught to the event loop
     bool keep_running{false};
 };
 
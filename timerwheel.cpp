@@ -0,0 +1,189 @@
+//
+//  timerwheel.cpp
+//
+#include "timerwheel.h"
+
+CTimerWheel::CTimerWheel(uint64_t now_ms, unsigned int tick_ms) : tick(tick_ms > 0 ? tick_ms : 1)
+{
+    now = now_ms / tick;
+    
+    // Note: Empty list head points to itself
+    for(auto& level : slots)
+    {
+        for(Timer& head : level)
+            head.prev = head.next = &head;
+    }
+    expired.prev = expired.next = &expired;
+}
+
+CTimerWheel::~CTimerWheel()
+{
+    // Disarm the timers left, so their owners don't unlink them from us
+    for(auto& level : slots)
+    {
+        for(Timer& head : level)
+        {
+            while(!IsEmpty(&head))
+                Cancel(head.next);
+        }
+    }
+    while(!IsEmpty(&expired))
+        Cancel(expired.next);
+}
+
+void CTimerWheel::Schedule(Timer* t, uint64_t expires_ms)
+{
+    Cancel(t);
+    
+    // Round up, so the timer never expires early
+    t->expires = (expires_ms + tick - 1) / tick;
+    Add(t);
+    count++;
+}
+
+void CTimerWheel::Cancel(Timer* t)
+{
+    if(!t->IsArmed())
+        return;
+    
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = nullptr;
+    count--;
+}
+
+void CTimerWheel::Advance(uint64_t now_ms)
+{
+    uint64_t target = now_ms / tick;
+    if(count == 0)
+    {
+        // Nothing to expire, just catch up
+        if(target > now)
+            now = target;
+        return;
+    }
+    
+    while(now < target)
+    {
+        now++;
+        
+        // Cascade the timers of the higher level slot when the lower level wraps
+        for(int level = 1; level < WHEEL_LEVELS; level++)
+        {
+            if(((now >> ((level - 1) * WHEEL_BITS)) & (WHEEL_SLOTS - 1)) != 0)
+                break;
+            Cascade(level);
+        }
+        
+        // Move the timers of the current slot to the expired list
+        Timer* head = &slots[0][now & (WHEEL_SLOTS - 1)];
+        while(!IsEmpty(head))
+        {
+            Timer* t = head->next;
+            t->prev->next = t->next;
+            t->next->prev = t->prev;
+            Link(&expired, t);
+        }
+    }
+}
+
+CTimerWheel::Timer* CTimerWheel::PopExpired()
+{
+    if(IsEmpty(&expired))
+        return nullptr;
+    
+    Timer* t = expired.next;
+    Cancel(t);
+    return t;
+}
+
+int CTimerWheel::NextTimeout(uint64_t now_ms) const
+{
+    if(!IsEmpty(&expired))
+        return 0;
+    if(count == 0)
+        return -1;
+    
+    // Find the nearest non-empty slot of every level. The timers of level 0
+    // slot expire at its time, the other ones get cascaded at their slot time.
+    uint64_t next = UINT64_MAX;
+    for(int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        int shift = level * WHEEL_BITS;
+        uint64_t pos = now >> shift;
+        for(int i = 1; i <= WHEEL_SLOTS; i++)
+        {
+            if(!IsEmpty(&slots[level][(pos + i) & (WHEEL_SLOTS - 1)]))
+            {
+                uint64_t time = (pos + i) << shift;
+                if(time < next)
+                    next = time;
+                break;
+            }
+        }
+    }
+    
+    if(next == UINT64_MAX)
+        return -1;
+    
+    uint64_t next_ms = next * tick;
+    if(next_ms <= now_ms)
+        return 0;
+    return (next_ms - now_ms > INT32_MAX ? INT32_MAX : (int)(next_ms - now_ms));
+}
+
+void CTimerWheel::Link(Timer* head, Timer* t)
+{
+    // Add to the tail of the list
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+void CTimerWheel::Add(Timer* t)
+{
+    if(t->expires <= now)
+    {
+        Link(&expired, t);
+        return;
+    }
+    
+    // Note: Clamp the time beyond the wheel range, the owner re-arms it when it expires
+    uint64_t max_delta = (1ull << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+    if(t->expires - now > max_delta)
+        t->expires = now + max_delta;
+    
+    // The lowest level which covers the time
+    uint64_t delta = t->expires - now;
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >= (1ull << ((level + 1) * WHEEL_BITS)))
+        level++;
+    
+    Link(&slots[level][(t->expires >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1)], t);
+}
+
+void CTimerWheel::Cascade(int level)
+{
+    Timer* head = &slots[level][(now >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1)];
+    
+    // Note: Re-add the timers to the lower levels (or the expired list)
+    Timer list;
+    list.prev = list.next = &list;
+    if(!IsEmpty(head))
+    {
+        list.next = head->next;
+        list.prev = head->prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head->prev = head->next = head;
+    }
+    
+    while(!IsEmpty(&list))
+    {
+        Timer* t = list.next;
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        Add(t);
+    }
+}
@@ -0,0 +1,71 @@
+//
+//  timerwheel.h
+//
+#ifndef __TIMER_WHEEL__
+#define __TIMER_WHEEL__
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // uint64_t
+
+//
+// Hierarchical timer wheel. Every level has WHEEL_SLOTS slots, and every
+// slot of a level spans all the slots of the level below it. The timer is
+// put to the slot of the lowest level which covers its expiry time, and
+// moved down a level (cascaded) when the wheel gets to its slot. So both
+// arming and cancelling the timer are O(1), no matter how many timers.
+//
+// Note: The timers are intrusive (embedded in the objects they time) and
+// linked to the circular lists, so a timer is unlinked without knowing
+// where it is. The wheel doesn't own the timers and never calls anything:
+// the caller advances the wheel and pops the expired timers one by one,
+// so it's safe to cancel any other timers in the meanwhile.
+//
+class CTimerWheel
+{
+public:
+    struct Timer
+    {
+        Timer* prev{nullptr};       // Note: nullptr if the timer is not armed
+        Timer* next{nullptr};
+        uint64_t expires{0};        // Expiry time, ticks
+        void* data{nullptr};        // The object the timer is embedded in
+
+        bool IsArmed() const { return next != nullptr; }
+    };
+
+    // tick_ms is the resolution of the timers
+    CTimerWheel(uint64_t now_ms, unsigned int tick_ms);
+    ~CTimerWheel();
+
+    // Arm (or re-arm) the timer to expire at the given time
+    void Schedule(Timer* t, uint64_t expires_ms);
+    void Cancel(Timer* t);
+
+    // Move the timers expired by now to the expired list
+    void Advance(uint64_t now_ms);
+
+    // Get the next expired timer (it's no longer armed), or nullptr
+    Timer* PopExpired();
+
+    // Time to wait until the next timer might expire: -1 if there are no
+    // timers, 0 if there are expired ones not popped yet.
+    int NextTimeout(uint64_t now_ms) const;
+
+    size_t Count() const { return count; }
+
+private:
+    enum { WHEEL_BITS = 6, WHEEL_SLOTS = 1 << WHEEL_BITS, WHEEL_LEVELS = 5 };
+
+    static void Link(Timer* head, Timer* t);
+    static bool IsEmpty(const Timer* head) { return head->next == head; }
+    void Add(Timer* t);
+    void Cascade(int level);
+
+    unsigned int tick{1};                              // Tick, ms
+    uint64_t now{0};                                   // Current time, ticks
+    Timer slots[WHEEL_LEVELS][WHEEL_SLOTS];            // List heads of the slots
+    Timer expired;                                     // List head of the expired timers
+    size_t count{0};                                   // The number of timers (armed and expired)
+};
+
+#endif // __TIMER_WHEEL__